@@ -0,0 +1,238 @@
+/** -*-c++-*-
+ *
+ *  Hash array mapped tries (HAMT) as introduced by Phil Bagwell:
+ *  A PersistentMap in a shared place that any number of threads can read
+ *  and update concurrently without locks.
+ *
+ *  The root node of the current map sits behind an atomic pointer. Lookups
+ *  read through that pointer inside a ReadGuard without touching the node's
+ *  reference count, so that readers on different cores do not write to the
+ *  same cache line. Readers that need a lasting snapshot add a reference,
+ *  which is wait-free as well. Writers compute an updated map from a
+ *  snapshot and publish it with a compare-and-swap, starting over if some
+ *  other writer got there first. A root that was replaced is released
+ *  through epoch-based reclamation (see epoch_reclamation.hpp), since
+ *  readers may still be looking at it.
+ *
+ *  Node reference counts are shared between threads here, so this header
+ *  needs ODF_HASH_TRIE_ATOMIC to be defined.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_ATOMICPERSISTENTMAP_HPP
+#define ODF_ATOMICPERSISTENTMAP_HPP 1
+
+#ifndef ODF_HASH_TRIE_ATOMIC
+#error "AtomicPersistentMap.hpp requires ODF_HASH_TRIE_ATOMIC to be defined"
+#endif
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+
+#include "PersistentMap.hpp"
+#include "epoch_reclamation.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+class AtomicPersistentMap : private boost::noncopyable
+{
+public:
+    PersistentMap<Key, Val, hashFunc> typedef Map;
+
+    explicit AtomicPersistentMap(Map const& initial = Map())
+        : root_(acquire(initial.root_.get()))
+    {
+    }
+
+    // Must not run concurrently with anything else on this map. Also
+    // releases the replaced versions this thread, or threads that exited,
+    // retired and no reader can still see.
+    ~AtomicPersistentMap()
+    {
+        if (root_.load())
+            intrusive_ptr_release(root_.load());
+        EpochReclamation::collect();
+    }
+
+    // The current map. It stays unchanged however the shared one is updated.
+    Map const load() const
+    {
+        EpochReclamation::ReadGuard guard;
+        return Map(NodePtr(root_.load()));
+    }
+
+    // Single lookups need no snapshot, since the guard keeps the root they
+    // read alive.
+    Val getVal(Key const& key, Val const notFound) const
+    {
+        EpochReclamation::ReadGuard guard;
+        Val const* vp = find(root_.load(), key);
+        return vp ? *vp : notFound;
+    }
+
+    bool contains(Key const& key) const
+    {
+        EpochReclamation::ReadGuard guard;
+        return find(root_.load(), key) != 0;
+    }
+
+    size_t size() const
+    {
+        EpochReclamation::ReadGuard guard;
+        NodeType const* const root = root_.load();
+        return root ? root->size() : 0;
+    }
+
+    void store(Map const& map)
+    {
+        swap(map.root_.get());
+    }
+
+    // Replaces the current map m by f(m), retrying with the new current map
+    // when another thread has changed it in between, so f may be called
+    // several times. Returns the map that was stored.
+    template<typename F>
+    Map const apply(F const f)
+    {
+        for (;;)
+        {
+            Map const current = load();
+            Map const next = f(current);
+            if (next.root_ == current.root_
+                or compareAndSwap(current.root_.get(), next.root_.get()))
+                return next;
+        }
+    }
+
+    Map const insert(Key const& key, Val const val)
+    {
+        return apply(Insert(key, val));
+    }
+
+    template<typename F>
+    Map const update(Key const& key, F const f)
+    {
+        return apply(Update<F>(key, f));
+    }
+
+    Map const remove(Key const& key)
+    {
+        return apply(Remove(key));
+    }
+
+private:
+    typename Map::NodePtr typedef NodePtr;
+    typename NodePtr::element_type typedef NodeType;
+
+    boost::atomic<NodeType*> root_;
+
+    struct Insert
+    {
+        Insert(Key const& key, Val const val)
+            : key_(key),
+              val_(val)
+        {
+        }
+
+        Map const operator()(Map const& map) const
+        {
+            return map.insert(key_, val_);
+        }
+
+    private:
+        Key const& key_;
+        Val const val_;
+    };
+
+    template<typename F>
+    struct Update
+    {
+        Update(Key const& key, F const f)
+            : key_(key),
+              f_(f)
+        {
+        }
+
+        Map const operator()(Map const& map) const
+        {
+            return map.update(key_, f_);
+        }
+
+    private:
+        Key const& key_;
+        F const f_;
+    };
+
+    struct Remove
+    {
+        Remove(Key const& key)
+            : key_(key)
+        {
+        }
+
+        Map const operator()(Map const& map) const
+        {
+            return map.remove(key_);
+        }
+
+    private:
+        Key const& key_;
+    };
+
+    static Val const* find(NodeType const* const root, Key const& key)
+    {
+        return root ? root->find(0, hashFunc(key), key) : 0;
+    }
+
+    // The root pointer owns one reference to the node it points to.
+    static NodeType* acquire(NodeType* const node)
+    {
+        if (node)
+            intrusive_ptr_add_ref(node);
+        return node;
+    }
+
+    static void release(void* const node)
+    {
+        intrusive_ptr_release(static_cast<NodeType*>(node));
+    }
+
+    static void retire(NodeType* const node)
+    {
+        if (node)
+            EpochReclamation::retire(node, release);
+    }
+
+    bool compareAndSwap(NodeType* expected, NodeType* const desired)
+    {
+        acquire(desired);
+        if (root_.compare_exchange_strong(expected, desired))
+        {
+            retire(expected);
+            return true;
+        }
+        else
+        {
+            if (desired)
+                intrusive_ptr_release(desired);
+            return false;
+        }
+    }
+
+    void swap(NodeType* const desired)
+    {
+        retire(root_.exchange(acquire(desired)));
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_ATOMICPERSISTENTMAP_HPP
@@ -0,0 +1,136 @@
+/** -*-c++-*-
+ *
+ *  Compressed hash array mapped prefix trees (CHAMP):
+ *  Implementation of the CompactMap class.
+ *
+ *  CompactMap has the same interface as PersistentMap, so either can be
+ *  selected with a typedef. Keys and values are stored inline in the trie
+ *  nodes, which makes it a good fit for small keys and values.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_COMPACTMAP_HPP
+#define ODF_COMPACTMAP_HPP 1
+
+#include "compact_trie.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+class CompactMap
+{
+public:
+    typename CompactNode<Key, Val, hashFunc>::NodePtr typedef NodePtr;
+    typename boost::shared_ptr<Val>                   typedef ValPtr;
+    CompactNode<Key, Val, hashFunc>                   typedef Node;
+
+    CompactMap()
+        : root_(),
+          size_(0)
+    {
+    }
+
+    template<typename Iter>
+    static CompactMap const fromRange(Iter const begin, Iter const end)
+    {
+        CompactMap result;
+        for (Iter iter = begin; iter != end; ++iter)
+            result = result.insert(iter->first, iter->second);
+        return result;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    Val const* find(Key const& key) const
+    {
+        return root_ ? root_->find(0, hashFunc(key), key) : 0;
+    }
+
+    bool contains(Key const& key) const
+    {
+        return find(key) != 0;
+    }
+
+    ValPtr get(Key const& key) const
+    {
+        Val const* vp = find(key);
+        return vp ? ValPtr(new Val(*vp)) : ValPtr();
+    }
+
+    Val getVal(Key const& key, Val const notFound) const
+    {
+        Val const* vp = find(key);
+        if (vp)
+            return *vp;
+        else
+            return notFound;
+    }
+
+    CompactMap const insert(Key const& key, Val const val) const
+    {
+        if (not root_)
+            return CompactMap(Node::single(hashFunc(key), key, val), 1);
+
+        bool added = false;
+        NodePtr root = root_->insert(0, hashFunc(key), key, val, added);
+        if (root == root_)
+            return *this;
+        else
+            return CompactMap(root, size_ + (added ? 1 : 0));
+    }
+
+    CompactMap const remove(Key const& key) const
+    {
+        if (not root_)
+            return *this;
+
+        bool removed = false;
+        NodePtr root = root_->remove(0, hashFunc(key), key, removed);
+        if (root == root_)
+            return *this;
+        else if (size_ == 1)
+            return CompactMap();
+        else
+            return CompactMap(root, size_ - 1);
+    }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << "CompactMap(" << (root_ ? root_->asString() : "{}") << ")";
+        return ss.str();
+    }
+
+private:
+    CompactMap(NodePtr const root, size_t const size)
+        : root_(root),
+          size_(size)
+    {
+    }
+
+    NodePtr root_;
+    size_t size_;
+};
+
+
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+std::ostream& operator<<(std::ostream& out,
+                         CompactMap<Key, Val, hashFunc> const& map)
+{
+    out << map.asString();
+    return out;
+}
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_COMPACTMAP_HPP
@@ -0,0 +1,114 @@
+/** -*-c++-*-
+ *
+ *  Compressed hash array mapped prefix trees (CHAMP):
+ *  Implementation of the CompactSet class.
+ *
+ *  CompactSet has the same interface as PersistentSet, so either can be
+ *  selected with a typedef. Keys are stored inline in the trie nodes.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_COMPACTSET_HPP
+#define ODF_COMPACTSET_HPP 1
+
+#include "compact_trie.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+template<typename Key, hashType (*hashFunc)(Key const)>
+class CompactSet
+{
+public:
+    typename CompactNode<Key, NoValue, hashFunc>::NodePtr typedef NodePtr;
+    CompactNode<Key, NoValue, hashFunc>                   typedef Node;
+
+    CompactSet()
+        : root_(),
+          size_(0)
+    {
+    }
+
+    template<typename Iter>
+    static CompactSet const fromRange(Iter const begin, Iter const end)
+    {
+        CompactSet result;
+        for (Iter iter = begin; iter != end; ++iter)
+            result = result.insert(*iter);
+        return result;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    bool contains(Key const& key) const
+    {
+        return root_ and root_->find(0, hashFunc(key), key) != 0;
+    }
+
+    CompactSet const insert(Key const& key) const
+    {
+        if (not root_)
+            return CompactSet(Node::single(hashFunc(key), key, NoValue()), 1);
+
+        bool added = false;
+        NodePtr root = root_->insert(0, hashFunc(key), key, NoValue(), added);
+        if (root == root_)
+            return *this;
+        else
+            return CompactSet(root, size_ + (added ? 1 : 0));
+    }
+
+    CompactSet const remove(Key const& key) const
+    {
+        if (not root_)
+            return *this;
+
+        bool removed = false;
+        NodePtr root = root_->remove(0, hashFunc(key), key, removed);
+        if (root == root_)
+            return *this;
+        else if (size_ == 1)
+            return CompactSet();
+        else
+            return CompactSet(root, size_ - 1);
+    }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << "CompactSet(" << (root_ ? root_->asString() : "{}") << ")";
+        return ss.str();
+    }
+
+private:
+    CompactSet(NodePtr const root, size_t const size)
+        : root_(root),
+          size_(size)
+    {
+    }
+
+    NodePtr root_;
+    size_t size_;
+};
+
+
+template<typename Key, hashType (*hashFunc)(Key const)>
+std::ostream& operator<<(std::ostream& out,
+                         CompactSet<Key, hashFunc> const& set)
+{
+    out << set.asString();
+    return out;
+}
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_COMPACTSET_HPP
@@ -0,0 +1,161 @@
+/** -*-c++-*-
+ *
+ *  Hash array mapped tries (HAMT) as introduced by Phil Bagwell:
+ *  A read-only map that does lookups directly in a memory-mapped snapshot
+ *  file, as written by PersistentMap::writeSnapshot(), or in the current
+ *  version in a snapshot log, as written by PersistentMap::appendSnapshot().
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_MAPPEDMAP_HPP
+#define ODF_MAPPEDMAP_HPP 1
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/noncopyable.hpp>
+
+#include "trie_snapshot.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// The pages of the file are shared with all other processes that map it, and
+// nothing is read before it is needed. If the file cannot be opened, was not
+// written for this key type, value type and trie shape, or is a snapshot that
+// was not written to the end, isOpen() returns false and the map is empty.
+// Lookups only read nodes that lie within the file, so a damaged file gives
+// wrong answers at worst. The file must not change while it is mapped,
+// except that versions may be appended to a log. Those become visible when
+// the log is mapped again.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+class MappedMap : private boost::noncopyable
+{
+public:
+    explicit MappedMap(char const* const path)
+        : base_(0),
+          length_(0),
+          size_(0),
+          root_(0)
+    {
+        int const fd = open(path, O_RDONLY);
+        if (fd < 0)
+            return;
+
+        struct stat info;
+        if (fstat(fd, &info) == 0 and info.st_size >= off_t(sizeof(Header)))
+        {
+            void* p = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            if (p != MAP_FAILED)
+            {
+                base_ = static_cast<char const*>(p);
+                length_ = info.st_size;
+            }
+        }
+        close(fd);
+
+        if (base_ and not findRoot())
+        {
+            munmap(const_cast<char*>(base_), length_);
+            base_ = 0;
+            length_ = 0;
+        }
+    }
+
+    ~MappedMap()
+    {
+        if (base_)
+            munmap(const_cast<char*>(base_), length_);
+    }
+
+    bool isOpen() const
+    {
+        return base_ != 0;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    // Returns a pointer to the value for the key inside the mapped file, or 0
+    // if there is none. The pointer is valid as long as this map.
+    Val const* find(Key const& key) const
+    {
+        return base_
+            ? findInSnapshot<Key, Val>(base_, length_, root_, hashFunc(key),
+                                       key)
+            : 0;
+    }
+
+    bool contains(Key const& key) const
+    {
+        return find(key) != 0;
+    }
+
+    Val getVal(Key const& key, Val const notFound) const
+    {
+        Val const* vp = find(key);
+        if (vp)
+            return *vp;
+        else
+            return notFound;
+    }
+
+private:
+    typedef SnapshotHeader Header;
+
+    char const* base_;
+    size_t length_;
+    uint64_t size_;
+    uint64_t root_;
+
+    Header const& header() const
+    {
+        return *reinterpret_cast<Header const*>(base_);
+    }
+
+    bool findRoot()
+    {
+        if (isSnapshotHeaderFor<Key, Val>(header(), snapshotMagic))
+        {
+            if (header().length != length_)
+                return false;
+            size_ = header().size;
+            root_ = header().root;
+        }
+        else if (isSnapshotHeaderFor<Key, Val>(header(), snapshotLogMagic))
+        {
+            uint64_t const pos = findSnapshotLogRoot<Key, Val>(base_, length_);
+            if (pos > 0)
+            {
+                SnapshotRoot const* record =
+                    reinterpret_cast<SnapshotRoot const*>(base_ + pos);
+                size_ = record->size;
+                root_ = record->root;
+            }
+        }
+        else
+        {
+            return false;
+        }
+
+        return root_ == 0
+            or snapshotNodeSize<Key, Val>(base_, length_, root_) > 0;
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_MAPPEDMAP_HPP
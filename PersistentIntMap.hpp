@@ -0,0 +1,704 @@
+/** -*-c++-*-
+ *
+ *  Maps with integer keys as path-compressed radix tries:
+ *  Implementation of the PersistentIntMap class.
+ *
+ *  The keys themselves are used in place of hash codes, in chunks of
+ *  chunkBits bits taken from the most significant end. Inner nodes store
+ *  their children in packed arrays indexed by a bitmap, just like the
+ *  bitmapped nodes of a hash trie. Unlike there, an inner node is only made
+ *  where keys actually diverge, and it remembers the chunk it splits on along
+ *  with the bits above that its keys all share, as in a Patricia trie. Runs
+ *  of single-child nodes are thus never built, so sparse keys do not cost
+ *  more levels than dense ones. As the chunks are taken from the top, an
+ *  in-order walk visits keys in ascending order, which makes ordered
+ *  iteration and range queries cheap. Nodes are reference counted and
+ *  allocated as in hash_trie.hpp.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_PERSISTENTINTMAP_HPP
+#define ODF_PERSISTENTINTMAP_HPP 1
+
+#include <algorithm>
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/is_integral.hpp>
+
+#include "hash_trie.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// Keys are converted to unsigned 64-bit patterns that sort in the same order
+// as the keys, by flipping the sign bit of signed ones.
+// ----------------------------------------------------------------------------
+
+template<typename Key>
+inline uint64_t keyBits(Key const key)
+{
+    BOOST_STATIC_ASSERT(boost::is_integral<Key>::value);
+    BOOST_STATIC_ASSERT(sizeof(Key) <= sizeof(uint64_t));
+
+    bool const isSigned = Key(-1) < Key(0);
+    return uint64_t(key) ^ (isSigned ? uint64_t(1) << 63 : 0);
+}
+
+// The bits above the chunk at the given shift.
+inline uint64_t bitsAboveChunk(indexType const shift)
+{
+    return shift + chunkBits >= 64 ? 0 : ~uint64_t(0) << (shift + chunkBits);
+}
+
+// The shift of the chunk holding the highest set bit, which must exist.
+inline indexType highestChunk(uint64_t n)
+{
+    indexType pos = 0;
+    for (indexType step = 32; step > 0; step /= 2)
+    {
+        if (n >> step)
+        {
+            n >>= step;
+            pos += step;
+        }
+    }
+    return pos - pos % chunkBits;
+}
+
+
+// ----------------------------------------------------------------------------
+// The nodes. A leaf holds one entry. An inner node holds the bits above its
+// chunk that all its keys share, and two or more children, one for each
+// value of the chunk that occurs.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+class IntMapNode
+{
+public:
+    typename boost::intrusive_ptr<IntMapNode> typedef NodePtr;
+
+    bool isLeaf() const { return isLeaf_; }
+
+    // For leaves the bits of the key, otherwise the shared prefix.
+    uint64_t bits() const { return bits_; }
+
+    indexType shift() const { return shift_; }
+
+    size_t size() const { return size_; }
+
+    // The smallest and largest key bits the node can hold.
+    uint64_t low() const { return bits_; }
+
+    uint64_t high() const
+    {
+        return isLeaf_ ? bits_ : bits_ | ~bitsAboveChunk(shift_);
+    }
+
+    bool covers(uint64_t const bits) const
+    {
+        return (bits & bitsAboveChunk(shift_)) == bits_;
+    }
+
+    indexType chunk(uint64_t const bits) const
+    {
+        return (bits >> shift_) & (fanout - 1);
+    }
+
+    static void* operator new(size_t const bytes)
+    {
+        return Allocator::allocate(bytes);
+    }
+
+    static void operator delete(void* const p, size_t const bytes)
+    {
+        Allocator::deallocate(p, bytes);
+    }
+
+    friend void intrusive_ptr_add_ref(IntMapNode const* const p)
+    {
+        p->counter_.increment();
+    }
+
+    friend void intrusive_ptr_release(IntMapNode const* const p)
+    {
+        if (p->counter_.decrement())
+        {
+            if (DeferredDeletion::isEnabled())
+                DeferredDeletion::defer(const_cast<IntMapNode*>(p), destroy);
+            else
+                destroy(const_cast<IntMapNode*>(p));
+        }
+    }
+
+protected:
+    IntMapNode(bool      const isLeaf,
+               uint64_t  const bits,
+               indexType const shift,
+               size_t    const size)
+        : isLeaf_(isLeaf),
+          shift_(shift),
+          bits_(bits),
+          size_(size),
+          counter_()
+    {
+    }
+
+    ~IntMapNode() {}
+
+private:
+    bool const isLeaf_;
+    indexType const shift_;
+    uint64_t const bits_;
+    size_t const size_;
+    RefCounter<size_t> counter_;
+
+    IntMapNode(IntMapNode const&);
+    IntMapNode& operator=(IntMapNode const&);
+
+    // There is no virtual destructor, so the right type is picked here.
+    static void destroy(void* const p);
+};
+
+template<typename Key, typename Val>
+class IntMapLeaf : public IntMapNode<Key, Val>
+{
+public:
+    std::pair<Key const, Val> typedef Entry;
+
+    IntMapLeaf(Key const key, Val const& val)
+        : IntMapNode<Key, Val>(true, keyBits(key), 0, 1),
+          entry_(key, val)
+    {
+    }
+
+    Entry const& entry() const { return entry_; }
+
+private:
+    Entry const entry_;
+};
+
+template<typename Key, typename Val>
+class IntMapBranch : public IntMapNode<Key, Val>
+{
+public:
+    typename IntMapNode<Key, Val>::NodePtr typedef NodePtr;
+
+    IntMapBranch(uint64_t   const bits,
+                 indexType  const shift,
+                 bitmapType const bitmap,
+                 NodePtr*   const children,
+                 size_t     const size)
+        : IntMapNode<Key, Val>(false, bits, shift, size),
+          bitmap_(bitmap),
+          children_(children)
+    {
+    }
+
+    ~IntMapBranch()
+    {
+        deleteArray(children_, nrChildren());
+    }
+
+    indexType nrChildren() const { return bitCount(bitmap_); }
+
+    NodePtr const& child(indexType const i) const { return children_[i]; }
+
+    // The position of the child for the given chunk, or of the first child
+    // after it if there is none.
+    indexType indexFor(indexType const chunk) const
+    {
+        return indexForBit(bitmap_, bitmapType(1) << chunk);
+    }
+
+    bool hasChild(indexType const chunk) const
+    {
+        return (bitmap_ >> chunk) & 1;
+    }
+
+    NodePtr withChild(indexType const chunk, NodePtr const node) const
+    {
+        indexType const i = indexFor(chunk);
+        bitmapType const bit = bitmapType(1) << chunk;
+        indexType const n = nrChildren();
+
+        if (not node)
+        {
+            if (n == 2)
+                return children_[1 - i];
+            else
+                return NodePtr(new IntMapBranch(
+                                   this->bits(), this->shift(), bitmap_ ^ bit,
+                                   arrayRemove(children_, n, i),
+                                   this->size() - children_[i]->size()));
+        }
+        else if (hasChild(chunk))
+            return NodePtr(new IntMapBranch(
+                               this->bits(), this->shift(), bitmap_,
+                               arrayUpdate(children_, n, i, node),
+                               this->size() - children_[i]->size()
+                               + node->size()));
+        else
+            return NodePtr(new IntMapBranch(
+                               this->bits(), this->shift(), bitmap_ | bit,
+                               arrayInsert(children_, n, i, node),
+                               this->size() + node->size()));
+    }
+
+private:
+    bitmapType const bitmap_;
+    NodePtr* const children_;
+};
+
+template<typename Key, typename Val>
+void IntMapNode<Key, Val>::destroy(void* const p)
+{
+    IntMapNode* node = static_cast<IntMapNode*>(p);
+    if (node->isLeaf())
+        delete static_cast<IntMapLeaf<Key, Val>*>(node);
+    else
+        delete static_cast<IntMapBranch<Key, Val>*>(node);
+}
+
+
+// ----------------------------------------------------------------------------
+// The driver class. Keys may be any integer type of up to 64 bits.
+// ----------------------------------------------------------------------------
+
+template<typename Val, typename Key = int>
+class PersistentIntMap
+{
+public:
+    typename IntMapNode<Key, Val>::NodePtr typedef NodePtr;
+    typename IntMapLeaf<Key, Val>::Entry typedef Entry;
+
+    PersistentIntMap()
+        : root_()
+    {
+    }
+
+    size_t size() const
+    {
+        return root_ ? root_->size() : 0;
+    }
+
+    bool empty() const
+    {
+        return not root_;
+    }
+
+    // Returns a pointer to the value stored for the key, or 0 if there is
+    // none.
+    Val const* find(Key const key) const
+    {
+        uint64_t const bits = keyBits(key);
+        IntMapNode<Key, Val> const* node = root_.get();
+        while (node and not node->isLeaf())
+        {
+            if (not node->covers(bits))
+                return 0;
+
+            IntMapBranch<Key, Val> const* branch = asBranch(node);
+            indexType const chunk = node->chunk(bits);
+            if (not branch->hasChild(chunk))
+                return 0;
+            node = branch->child(branch->indexFor(chunk)).get();
+        }
+
+        if (node and node->bits() == bits)
+            return &asLeaf(node)->entry().second;
+        else
+            return 0;
+    }
+
+    bool contains(Key const key) const
+    {
+        return find(key) != 0;
+    }
+
+    Val getVal(Key const key, Val const notFound) const
+    {
+        Val const* vp = find(key);
+        if (vp)
+            return *vp;
+        else
+            return notFound;
+    }
+
+    // Insertions and updates that would not change the map keep its root.
+    PersistentIntMap const insert(Key const key, Val const& val) const
+    {
+        return PersistentIntMap(updated(root_, keyBits(key), Assign(key, val)));
+    }
+
+    // Replaces the value v for the key by f(v). Does nothing if the key is
+    // not present.
+    template<typename F>
+    PersistentIntMap const update(Key const key, F const f) const
+    {
+        return PersistentIntMap(
+            updated(root_, keyBits(key), Modify<F>(key, f)));
+    }
+
+    PersistentIntMap const remove(Key const key) const
+    {
+        return PersistentIntMap(removed(root_, keyBits(key)));
+    }
+
+    // The entries with keys from lo to hi inclusive. Subtries that lie
+    // completely within the range are shared, so only the nodes along the
+    // paths to the two ends are new.
+    PersistentIntMap const range(Key const lo, Key const hi) const
+    {
+        return PersistentIntMap(inRange(root_, keyBits(lo), keyBits(hi)));
+    }
+
+    // ------------------------------------------------------------------------
+    // Iteration in ascending order of keys.
+    // ------------------------------------------------------------------------
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type const* pointer;
+        typedef value_type const& reference;
+
+        const_iterator()
+            : leaf_(0)
+        {
+        }
+
+        reference operator*() const
+        {
+            return leaf_->entry();
+        }
+
+        pointer operator->() const
+        {
+            return &leaf_->entry();
+        }
+
+        const_iterator& operator++()
+        {
+            advance();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            advance();
+            return old;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return leaf_ == other.leaf_;
+        }
+
+        bool operator!=(const_iterator const& other) const
+        {
+            return leaf_ != other.leaf_;
+        }
+
+    private:
+        friend class PersistentIntMap;
+
+        // The subtries still to visit, next one last.
+        std::vector<IntMapNode<Key, Val> const*> pending_;
+        IntMapLeaf<Key, Val> const* leaf_;
+
+        // Starts at the first key, or the first one not below the given
+        // bits.
+        const_iterator(IntMapNode<Key, Val> const* const root,
+                       bool const bounded = false,
+                       uint64_t const from = 0)
+            : leaf_(0)
+        {
+            IntMapNode<Key, Val> const* node = root;
+            while (bounded and node and not node->isLeaf()
+                   and node->covers(from))
+            {
+                IntMapBranch<Key, Val> const* branch = asBranch(node);
+                indexType const chunk = node->chunk(from);
+                indexType const i = branch->indexFor(chunk);
+                bool const found = branch->hasChild(chunk);
+
+                push(branch, found ? i + 1 : i);
+                node = found ? branch->child(i).get() : 0;
+            }
+
+            if (not node or (bounded and node->high() < from))
+                advance();
+            else
+                descend(node);
+        }
+
+        // Schedules the children of the branch from the given position on.
+        void push(IntMapBranch<Key, Val> const* const branch,
+                  indexType const from)
+        {
+            for (indexType i = branch->nrChildren(); i > from; --i)
+                pending_.push_back(branch->child(i - 1).get());
+        }
+
+        void descend(IntMapNode<Key, Val> const* node)
+        {
+            while (not node->isLeaf())
+            {
+                push(asBranch(node), 1);
+                node = asBranch(node)->child(0).get();
+            }
+            leaf_ = asLeaf(node);
+        }
+
+        void advance()
+        {
+            if (pending_.empty())
+                leaf_ = 0;
+            else
+            {
+                IntMapNode<Key, Val> const* next = pending_.back();
+                pending_.pop_back();
+                descend(next);
+            }
+        }
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const
+    {
+        return root_ ? const_iterator(root_.get()) : end();
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator();
+    }
+
+    // The first entry with a key not less than the given one.
+    const_iterator lower_bound(Key const key) const
+    {
+        return const_iterator(root_.get(), true, keyBits(key));
+    }
+
+    // The first entry with a key greater than the given one.
+    const_iterator upper_bound(Key const key) const
+    {
+        uint64_t const bits = keyBits(key);
+        if (bits == ~uint64_t(0))
+            return end();
+        else
+            return const_iterator(root_.get(), true, bits + 1);
+    }
+
+private:
+    NodePtr root_;
+
+    explicit PersistentIntMap(NodePtr const root)
+        : root_(root)
+    {
+    }
+
+    static IntMapLeaf<Key, Val> const* asLeaf(
+        IntMapNode<Key, Val> const* const node)
+    {
+        return static_cast<IntMapLeaf<Key, Val> const*>(node);
+    }
+
+    static IntMapBranch<Key, Val> const* asBranch(
+        IntMapNode<Key, Val> const* const node)
+    {
+        return static_cast<IntMapBranch<Key, Val> const*>(node);
+    }
+
+    // A node holding two subtries with no keys in common, split at the
+    // highest chunk in which their bits differ.
+    static NodePtr join(NodePtr const a, NodePtr const b)
+    {
+        indexType const shift = highestChunk(a->bits() ^ b->bits());
+        indexType const ia = (a->bits() >> shift) & (fanout - 1);
+        indexType const ib = (b->bits() >> shift) & (fanout - 1);
+
+        NodePtr* children = newArray<NodePtr>(2);
+        children[ia < ib ? 0 : 1] = a;
+        children[ia < ib ? 1 : 0] = b;
+
+        return NodePtr(new IntMapBranch<Key, Val>(
+                           a->bits() & bitsAboveChunk(shift), shift,
+                           (bitmapType(1) << ia) | (bitmapType(1) << ib),
+                           children, a->size() + b->size()));
+    }
+
+    // Stores a value for a key, unless it is already there.
+    struct Assign
+    {
+        Assign(Key const key, Val const& val)
+            : key_(key),
+              val_(val)
+        {
+        }
+
+        NodePtr leaf(NodePtr const current) const
+        {
+            if (not current or asLeaf(current.get())->entry().second != val_)
+                return NodePtr(new IntMapLeaf<Key, Val>(key_, val_));
+            else
+                return current;
+        }
+
+    private:
+        Key const key_;
+        Val const& val_;
+    };
+
+    // Applies a function to the value for a key, if the key is present.
+    template<typename F>
+    struct Modify
+    {
+        Modify(Key const key, F const f)
+            : key_(key),
+              f_(f)
+        {
+        }
+
+        NodePtr leaf(NodePtr const current) const
+        {
+            if (not current)
+                return current;
+
+            Val const& old = asLeaf(current.get())->entry().second;
+            Val const val = f_(old);
+            if (val != old)
+                return NodePtr(new IntMapLeaf<Key, Val>(key_, val));
+            else
+                return current;
+        }
+
+    private:
+        Key const key_;
+        F const f_;
+    };
+
+    // Descends once to where the key goes and lets the update make the leaf
+    // from the current one, or from none. Returns the given node itself if
+    // nothing changed.
+    template<typename U>
+    static NodePtr updated(NodePtr const node,
+                           uint64_t const bits,
+                           U const& update)
+    {
+        if (node and node->isLeaf() and node->bits() == bits)
+            return update.leaf(node);
+
+        if (node and not node->isLeaf() and node->covers(bits))
+        {
+            IntMapBranch<Key, Val> const* branch = asBranch(node.get());
+            indexType const chunk = node->chunk(bits);
+            if (branch->hasChild(chunk))
+            {
+                NodePtr const child = branch->child(branch->indexFor(chunk));
+                NodePtr const result = updated(child, bits, update);
+                if (result == child)
+                    return node;
+                else
+                    return branch->withChild(chunk, result);
+            }
+
+            NodePtr const leaf = update.leaf(NodePtr());
+            return leaf ? branch->withChild(chunk, leaf) : node;
+        }
+
+        NodePtr const leaf = update.leaf(NodePtr());
+        if (not leaf)
+            return node;
+        else if (not node)
+            return leaf;
+        else
+            return join(leaf, node);
+    }
+
+    // Returns the given node itself if nothing changed, and an empty
+    // pointer if nothing remains.
+    static NodePtr removed(NodePtr const node, uint64_t const bits)
+    {
+        if (not node)
+            return node;
+        else if (node->isLeaf())
+            return node->bits() == bits ? NodePtr() : node;
+        else if (not node->covers(bits))
+            return node;
+
+        IntMapBranch<Key, Val> const* branch = asBranch(node.get());
+        indexType const chunk = node->chunk(bits);
+        if (not branch->hasChild(chunk))
+            return node;
+
+        NodePtr const child = branch->child(branch->indexFor(chunk));
+        NodePtr const result = removed(child, bits);
+        if (result == child)
+            return node;
+        else
+            return branch->withChild(chunk, result);
+    }
+
+    static NodePtr inRange(NodePtr const node,
+                           uint64_t const lo,
+                           uint64_t const hi)
+    {
+        if (not node or node->high() < lo or node->low() > hi)
+            return NodePtr();
+        else if (lo <= node->low() and node->high() <= hi)
+            return node;
+
+        // Only inner nodes can straddle an end of the range.
+        IntMapBranch<Key, Val> const* branch = asBranch(node.get());
+        NodePtr parts[fanout];
+        bitmapType bitmap = 0;
+        indexType n = 0;
+        size_t size = 0;
+        bool changed = false;
+
+        for (indexType i = 0; i < branch->nrChildren(); ++i)
+        {
+            NodePtr const child = branch->child(i);
+            NodePtr const part = inRange(child, lo, hi);
+            changed = changed or part != child;
+            if (part)
+            {
+                bitmap |= bitmapType(1) << node->chunk(part->bits());
+                size += part->size();
+                parts[n++] = part;
+            }
+        }
+
+        if (not changed)
+            return node;
+        else if (n < 2)
+            return parts[0];
+
+        NodePtr* children = newArray<NodePtr>(n);
+        std::copy(parts, parts + n, children);
+        return NodePtr(new IntMapBranch<Key, Val>(
+                           node->bits(), node->shift(), bitmap, children,
+                           size));
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_PERSISTENTINTMAP_HPP
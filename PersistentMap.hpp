@@ -11,7 +11,16 @@
 #ifndef ODF_PERSISTENTMAP_HPP
 #define ODF_PERSISTENTMAP_HPP 1
 
+#include <cstddef>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
 #include "hash_trie.hpp"
+#include "intern_table.hpp"
+#include "snapshot_log.hpp"
+#include "trie_snapshot.hpp"
 
 namespace odf
 {
@@ -25,14 +34,16 @@ namespace hash_trie
 template<typename Key, typename Val>
 struct MapLeaf : public Node<Key, Val>
 {
-    typename Node<Key, Val>::ValPtr  typedef ValPtr;
     typename Node<Key, Val>::NodePtr typedef NodePtr;
+    std::pair<Key const, Val>        typedef Entry;
 
-    MapLeaf(hashType const hash, Key const key, ValPtr const value)
+    MapLeaf(hashType const hash, Key const& key, Val const value)
         : hash_(hash),
-          key_(key),
-          value_(value)
+          entry_(key, value)
     {
+#ifdef ODF_HASH_TRIE_MERKLE
+        this->setContentHash(entryContentHash(key, value));
+#endif
     }
 
     ~MapLeaf() {}
@@ -41,18 +52,19 @@ struct MapLeaf : public Node<Key, Val>
 
     bool isLeaf() const { return true; }
 
-    ValPtr get(indexType const shift,
-               hashType  const hash,
-               Key       const key) const
+    Val const* find(indexType const  shift,
+                    hashType  const  hash,
+                    Key       const& key) const
     {
-        return key == key_ ? value_ : ValPtr();
+        return key == entry_.first ? &entry_.second : 0;
     }
 
     NodePtr insert(indexType const shift,
                    hashType  const hash,
-                   NodePtr   const leaf) const
+                   NodePtr   const leaf,
+                   editType  const edit)
     {
-        if (key_ == leaf->key())
+        if (entry_.first == leaf->key())
         {
             return leaf;
         }
@@ -60,124 +72,774 @@ struct MapLeaf : public Node<Key, Val>
         {
             NodePtr base;
             if (hash_ == hash)
-                base = NodePtr(new CollisionNode<Key, Val>(hash));
+                base = NodePtr(new CollisionNode<Key, Val>(hash, edit));
             else
-                base = NodePtr(new BitmappedNode<Key, Val>());
+                base = NodePtr(new BitmappedNode<Key, Val>(edit));
 
             return base
-                ->insert(shift, hash_, clone())
-                ->insert(shift, hash, leaf);
+                ->insert(shift, hash_, NodePtr(this), edit)
+                ->insert(shift, hash, leaf, edit);
         }
     }
 
-    NodePtr remove(indexType const shift,
-                   hashType  const hash,
-                   Key       const key) const
+    NodePtr update(indexType        const  shift,
+                   hashType         const  hash,
+                   Key              const& key,
+                   Update<Key, Val> const& change,
+                   editType         const  edit)
     {
-        return NodePtr();
+        NodePtr current = key == entry_.first ? NodePtr(this) : NodePtr();
+        NodePtr leaf = change.leaf(current);
+        if (leaf == current)
+            return NodePtr(this);
+        else if (current)
+            return leaf;
+        else
+            return insert(shift, hash, leaf, edit);
     }
 
-    Key const& key() const { return key_; }
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   editType  const  edit)
+    {
+        return key == entry_.first ? NodePtr() : NodePtr(this);
+    }
+
+    Key const& key() const { return entry_.first; }
+
+    Entry const& entry() const { return entry_; }
+
+    hashType hash() const { return hash_; }
+
+    size_t nrSlots() const { return 0; }
+
+    Node<Key, Val> const* child(size_t const /*i*/) const { return 0; }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        usage.leaves += sizeof(*this);
+    }
 
 
     std::string asString() const
     {
         std::stringstream ss;
-        ss << key_ << " -> " << *value_.get();
+        ss << entry_.first << " -> " << entry_.second;
         return ss.str();
     }
 
 private:
     hashType const hash_;
-    Key const key_;
-    ValPtr const value_;
-
-    NodePtr const clone() const
-    {
-        return NodePtr(new MapLeaf(*this));
-    }
+    Entry const entry_;
 };
 
 // ----------------------------------------------------------------------------
 // The driver class
 // ----------------------------------------------------------------------------
 
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+class AtomicPersistentMap;
+
 template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
 class PersistentMap
 {
 public:
-    typename Node<Key, Val>::ValPtr  typedef ValPtr;
-    typename Node<Key, Val>::NodePtr typedef NodePtr;
+    typename Node<Key, Val>::NodePtr  typedef NodePtr;
+    typename boost::shared_ptr<Val>   typedef ValPtr;
+    typename MapLeaf<Key, Val>::Entry typedef Entry;
 
     PersistentMap()
         : root_()
     {
     }
 
+    // Builds a map from a range of (key, value) pairs, equivalent to inserting
+    // them one by one, but constructs the subtries below the root in parallel.
+    template<typename Iter>
+    static PersistentMap const fromRange(Iter const begin, Iter const end)
+    {
+        return PersistentMap(
+            buildInParallel<Key, Val, EntryMaker>(begin, end));
+    }
+
     size_t size() const
     {
         return root_ ? root_->size() : 0;
     }
 
-    ValPtr get(Key const key) const
+    // Returns a pointer to the value stored for the key, or 0 if there is
+    // none. The pointer stays valid as long as this map or some other map
+    // sharing the entry is alive.
+    Val const* find(Key const& key) const
+    {
+        return root_ ? root_->find(0, hashFunc(key), key) : 0;
+    }
+
+    bool contains(Key const& key) const
     {
-        return root_ ? root_->get(0, hashFunc(key), key) : ValPtr();
+        return find(key) != 0;
     }
 
-    Val getVal(Key const key, Val const notFound) const
+    // Returns a freshly allocated copy of the value for the key, or an empty
+    // pointer. Prefer find() or getVal() on hot paths.
+    ValPtr get(Key const& key) const
     {
-        ValPtr vp = get(key);
+        Val const* vp = find(key);
+        return vp ? ValPtr(new Val(*vp)) : ValPtr();
+    }
+
+    Val getVal(Key const& key, Val const notFound) const
+    {
+        Val const* vp = find(key);
         if (vp)
             return *vp;
         else
             return notFound;
     }
 
-    PersistentMap const insert(Key const key, Val const val) const
+    // Lookups by a probe that compares equal to the key with ==, such as a
+    // char const* for std::string keys, so that no key needs to be built.
+    // The hash code comes from ProbeHash, which must be specialized for the
+    // probe type to avoid converting it to a key.
+    template<typename Probe>
+    Val const* find(Probe const& probe) const
+    {
+        return find(probe, ProbeHash<Key, hashFunc>::hash(probe));
+    }
+
+    template<typename Probe>
+    bool contains(Probe const& probe) const
+    {
+        return find(probe) != 0;
+    }
+
+    // The same with a hash code supplied by the caller, which must be the
+    // one hashFunc computes for the key.
+    template<typename Probe>
+    Val const* find(Probe const& probe, hashType const hash) const
+    {
+        Node<Key, Val> const* leaf =
+            findLeaf<Key, Val>(root_.get(), hash, probe);
+        return leaf ? &leafValue(leaf) : 0;
+    }
+
+    template<typename Probe>
+    bool contains(Probe const& probe, hashType const hash) const
+    {
+        return find(probe, hash) != 0;
+    }
+
+    // Looks up a batch of keys at once, and stores in out the same pointers
+    // find() would return for them, in the same order. The lookups proceed
+    // side by side with prefetching, which is faster than one by one when
+    // the map is much larger than the cache.
+    void getMany(std::vector<Key> const& keys,
+                 std::vector<Val const*>& out) const
+    {
+        std::vector<hashType> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            hashes[i] = hashFunc(keys[i]);
+
+        std::vector<Node<Key, Val> const*> leaves(keys.size());
+        if (not keys.empty())
+            findLeaves<Key, Val>(root_.get(), &keys[0], &hashes[0],
+                                 keys.size(), &leaves[0]);
+
+        out.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            out[i] = leaves[i] ? &leafValue(leaves[i]) : 0;
+    }
+
+    // Insertions and removals that would not change the map return it as it
+    // is, without allocating.
+    PersistentMap const insert(Key const& key, Val const val) const
+    {
+        hashType hash = hashFunc(key);
+        return withRoot(updated(root_, hash, key, Assign(hash, key, val), 0));
+    }
+
+    // Replaces the value v for the key by f(v). Does nothing if the key is
+    // not present.
+    template<typename F>
+    PersistentMap const update(Key const& key, F const f) const
+    {
+        hashType hash = hashFunc(key);
+        return withRoot(updated(root_, hash, key, Modify<F>(hash, key, f), 0));
+    }
+
+    // Replaces the value v for the key by f(v), or stores init if the key is
+    // not present.
+    template<typename F>
+    PersistentMap const upsert(Key const& key, F const f, Val const init) const
     {
         hashType hash = hashFunc(key);
-        NodePtr leaf(new MapLeaf<Key, Val>(hash, key, ValPtr(new Val(val))));
+        return withRoot(
+            updated(root_, hash, key, Modify<F>(hash, key, f, &init), 0));
+    }
+
+    PersistentMap const remove(Key const& key) const
+    {
         if (not root_)
-        {
-            return PersistentMap(leaf);
-        }
+            return *this;
         else
+            return withRoot(root_->remove(0, hashFunc(key), key, 0));
+    }
+
+    // ------------------------------------------------------------------------
+    // Bulk operations, run on up to nrThreads threads, or one per core if 0
+    // is given. The function arguments are called concurrently and must be
+    // thread-safe. Small maps are processed sequentially.
+    // ------------------------------------------------------------------------
+
+    // Folds the entries into a value with
+    //     T fold(T const& acc, Key const& key, Val const& val)
+    // and merges the partial results with
+    //     T combine(T const& a, T const& b)
+    // which must be associative with init as its neutral element.
+    template<typename T, typename Fold, typename Combine>
+    T parallelReduce(T const init,
+                     Fold const fold,
+                     Combine const combine,
+                     size_t const nrThreads = 0) const
+    {
+        return hash_trie::parallelReduce<Key, Val>(
+            root_.get(), init, fold, combine, nrThreads);
+    }
+
+    // Replaces each value v by f(v). The result has the same shape as this
+    // map, keys are not rehashed, and subtrees with no changed values are
+    // shared.
+    template<typename F>
+    PersistentMap const mapValues(F const f, size_t const nrThreads = 0) const
+    {
+        return withRoot(
+            parallelTransform(root_.get(), MapValue<F>(f), nrThreads));
+    }
+
+    // Keeps the entries for which pred(key, val) is true. Subtrees in which
+    // all entries are kept are shared with this map.
+    template<typename Pred>
+    PersistentMap const filter(Pred const pred,
+                               size_t const nrThreads = 0) const
+    {
+        return withRoot(
+            parallelTransform(root_.get(), Keep<Pred>(pred), nrThreads));
+    }
+
+    // Writes the map in the snapshot format described in trie_snapshot.hpp,
+    // which MappedMap reads in place. Keys and values must be plain old
+    // data. Returns false if the stream reported an error.
+    bool writeSnapshot(std::ostream& out) const
+    {
+        return writeTrieSnapshot(root_.get(), out);
+    }
+
+    // Appends the map to a snapshot log as its new current version, writing
+    // only the nodes that are not shared with the version appended before.
+    // Returns false if the log could not be written.
+    bool appendSnapshot(SnapshotLog<Key, Val>& log) const
+    {
+        return log.append(root_);
+    }
+
+    // An equal map made of the canonical nodes in the given table, so that
+    // it shares all equal subtries with other maps interned there. Equal
+    // maps interned in the same table share their root, so that comparing
+    // them takes constant time.
+    PersistentMap const interned(InternTable<Key, Val>& table) const
+    {
+        return PersistentMap(table.intern(root_));
+    }
+
+    // The memory held by the nodes of this map, including those it shares
+    // with other maps.
+    MemoryUsage memoryUsage() const
+    {
+        MemoryUsage usage;
+        addTrieMemoryUsage(root_.get(), usage);
+        return usage;
+    }
+
+    // The memory held by a range of maps, split into what several of them
+    // share and what each one holds alone.
+    template<typename Iter>
+    static SharedMemoryUsage memoryUsage(Iter const begin, Iter const end)
+    {
+        MemoryCensus<Key, Val> census(std::distance(begin, end));
+        size_t index = 0;
+        for (Iter iter = begin; iter != end; ++iter, ++index)
+            census.visit(iter->root_.get(), index);
+        return census.result();
+    }
+
+    // Describes the shape of the trie, which shows how well the hash
+    // function spreads the keys.
+    TrieStats stats() const
+    {
+        TrieStats result;
+        addTrieStats(root_.get(), 0, result);
+        return result;
+    }
+
+    // Maps are equal if they hold the same entries, no matter how they were
+    // built. Shared subtrees are not looked into.
+    bool operator==(PersistentMap const& other) const
+    {
+        return trieEqual<Key, Val>(root_.get(), other.root_.get(), 0);
+    }
+
+    bool operator!=(PersistentMap const& other) const
+    {
+        return not (*this == other);
+    }
+
+#ifdef ODF_HASH_TRIE_MERKLE
+    // A hash of the entries that does not depend on how the map was built.
+    // Equal maps have equal hashes, and unequal ones almost never do.
+    uint64_t contentHash() const
+    {
+        return root_ ? root_->contentHash() : 0;
+    }
+#endif
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << "PersistentMap(" <<
+            (root_ ? root_->asString() : "{}") << ")";
+        return ss.str();
+    }
+
+    // ------------------------------------------------------------------------
+    // The changes between two versions of a map, as computed by diff().
+    // ------------------------------------------------------------------------
+
+    struct Change
+    {
+        Change(Key const& key, Val const before, Val const after)
+            : key(key),
+              before(before),
+              after(after)
         {
-            ValPtr current = root_->get(0, hash, key);
-            if (not current or *current != val)
-                return PersistentMap(root_->insert(0, hash, leaf));
-            else
-                return *this;
         }
+
+        Key key;
+        Val before;
+        Val after;
+    };
+
+    struct Diff
+    {
+        std::vector<std::pair<Key, Val> > added;
+        std::vector<std::pair<Key, Val> > removed;
+        std::vector<Change> changed;
+    };
+
+    // Reports the changes from one map to another to a visitor; see
+    // trieDiff() for the methods it needs. Subtrees shared by both maps are
+    // skipped, so this is fast when the maps are versions of each other.
+    template<typename Visitor>
+    friend void diff(PersistentMap const& before,
+                     PersistentMap const& after,
+                     Visitor& visitor)
+    {
+        trieDiff<Key, Val>(before.root_.get(), after.root_.get(), 0, visitor);
     }
 
-    PersistentMap const remove(Key const key) const
+    friend Diff const diff(PersistentMap const& before,
+                           PersistentMap const& after)
     {
-        hashType hash = hashFunc(key);
-        if (root_ and root_->get(0, hash, key))
+        DiffCollector collector;
+        diff(before, after, collector);
+        return collector.result;
+    }
+
+    // ------------------------------------------------------------------------
+    // Iterators visit the entries in no particular order. They do not
+    // allocate or touch reference counts, and stay valid as long as the map
+    // they came from.
+    // ------------------------------------------------------------------------
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Entry value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type const* pointer;
+        typedef value_type const& reference;
+
+        const_iterator()
+            : cursor_()
         {
-            return PersistentMap(root_->remove(0, hash, key));
         }
-        else
+
+        reference operator*() const
         {
+            return leaf()->entry();
+        }
+
+        pointer operator->() const
+        {
+            return &leaf()->entry();
+        }
+
+        const_iterator& operator++()
+        {
+            cursor_.advance();
             return *this;
         }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            cursor_.advance();
+            return old;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return cursor_.leaf() == other.cursor_.leaf();
+        }
+
+        bool operator!=(const_iterator const& other) const
+        {
+            return cursor_.leaf() != other.cursor_.leaf();
+        }
+
+    private:
+        friend class PersistentMap;
+
+        explicit const_iterator(Node<Key, Val> const* const root)
+            : cursor_(root)
+        {
+        }
+
+        MapLeaf<Key, Val> const* leaf() const
+        {
+            return static_cast<MapLeaf<Key, Val> const*>(cursor_.leaf());
+        }
+
+        TrieCursor<Key, Val> cursor_;
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const
+    {
+        return const_iterator(root_.get());
     }
 
-    std::string asString() const
+    const_iterator end() const
     {
-        std::stringstream ss;
-        ss << "PersistentMap(" <<
-            (root_ ? root_->asString() : "{}") << ")";
-        return ss.str();
+        return const_iterator();
     }
 
+    // ------------------------------------------------------------------------
+    // A transient map is a mutable builder. Nodes it creates are tagged with
+    // its edit token and updated in place; nodes shared with persistent maps
+    // are copied on first write. Calling persistent() hands out the current
+    // contents in O(1) and switches to a fresh token, so the result is never
+    // modified by later updates to the transient.
+    // ------------------------------------------------------------------------
+
+    class Transient : private boost::noncopyable
+    {
+    public:
+        Transient()
+            : root_(),
+              edit_(newEditToken())
+        {
+        }
+
+        Transient(PersistentMap const& source)
+            : root_(source.root_),
+              edit_(newEditToken())
+        {
+        }
+
+        size_t size() const
+        {
+            return root_ ? root_->size() : 0;
+        }
+
+        Val const* find(Key const& key) const
+        {
+            return root_ ? root_->find(0, hashFunc(key), key) : 0;
+        }
+
+        bool contains(Key const& key) const
+        {
+            return find(key) != 0;
+        }
+
+        ValPtr get(Key const& key) const
+        {
+            Val const* vp = find(key);
+            return vp ? ValPtr(new Val(*vp)) : ValPtr();
+        }
+
+        Val getVal(Key const& key, Val const notFound) const
+        {
+            Val const* vp = find(key);
+            if (vp)
+                return *vp;
+            else
+                return notFound;
+        }
+
+        template<typename Probe>
+        Val const* find(Probe const& probe) const
+        {
+            return find(probe, ProbeHash<Key, hashFunc>::hash(probe));
+        }
+
+        template<typename Probe>
+        bool contains(Probe const& probe) const
+        {
+            return find(probe) != 0;
+        }
+
+        template<typename Probe>
+        Val const* find(Probe const& probe, hashType const hash) const
+        {
+            Node<Key, Val> const* leaf =
+                findLeaf<Key, Val>(root_.get(), hash, probe);
+            return leaf ? &leafValue(leaf) : 0;
+        }
+
+        template<typename Probe>
+        bool contains(Probe const& probe, hashType const hash) const
+        {
+            return find(probe, hash) != 0;
+        }
+
+        Transient& insert(Key const& key, Val const val)
+        {
+            hashType hash = hashFunc(key);
+            root_ = updated(root_, hash, key, Assign(hash, key, val), edit_);
+            return *this;
+        }
+
+        template<typename F>
+        Transient& update(Key const& key, F const f)
+        {
+            hashType hash = hashFunc(key);
+            root_ = updated(root_, hash, key, Modify<F>(hash, key, f), edit_);
+            return *this;
+        }
+
+        template<typename F>
+        Transient& upsert(Key const& key, F const f, Val const init)
+        {
+            hashType hash = hashFunc(key);
+            root_ = updated(root_, hash, key,
+                            Modify<F>(hash, key, f, &init), edit_);
+            return *this;
+        }
+
+        Transient& remove(Key const& key)
+        {
+            if (root_)
+                root_ = root_->remove(0, hashFunc(key), key, edit_);
+            return *this;
+        }
+
+        PersistentMap const persistent()
+        {
+            edit_ = newEditToken();
+            return PersistentMap(root_);
+        }
+
+    private:
+        NodePtr root_;
+        editType edit_;
+    };
+
 private:
+    friend class Transient;
+    friend class AtomicPersistentMap<Key, Val, hashFunc>;
+
+    struct EntryMaker
+    {
+        template<typename Iter>
+        static hashType hash(Iter const iter)
+        {
+            return hashFunc(iter->first);
+        }
+
+        template<typename Iter>
+        static NodePtr leaf(hashType const hash, Iter const iter)
+        {
+            return PersistentMap::leaf(hash, iter->first, iter->second);
+        }
+    };
+
+    struct DiffCollector
+    {
+        Diff result;
+
+        void added(Key const& key, Val const& val)
+        {
+            result.added.push_back(std::make_pair(key, val));
+        }
+
+        void removed(Key const& key, Val const& val)
+        {
+            result.removed.push_back(std::make_pair(key, val));
+        }
+
+        void changed(Key const& key, Val const& before, Val const& after)
+        {
+            result.changed.push_back(Change(key, before, after));
+        }
+    };
+
+    // Stores a value for a key, unless it is already there. Like all updates,
+    // it only lives for the call that makes it, so it holds the key by
+    // reference and copies it only into a new leaf.
+    struct Assign : public Update<Key, Val>
+    {
+        Assign(hashType const hash, Key const& key, Val const val)
+            : hash_(hash),
+              key_(key),
+              val_(val)
+        {
+        }
+
+        NodePtr leaf(NodePtr const current) const
+        {
+            if (not current or *current->find(0, hash_, key_) != val_)
+                return PersistentMap::leaf(hash_, key_, val_);
+            else
+                return current;
+        }
+
+    private:
+        hashType const hash_;
+        Key const& key_;
+        Val const val_;
+    };
+
+    // Applies a function to the value for a key. If the key is missing,
+    // stores *init if given, and otherwise does nothing.
+    template<typename F>
+    struct Modify : public Update<Key, Val>
+    {
+        Modify(hashType   const  hash,
+               Key        const& key,
+               F          const  f,
+               Val const* const  init = 0)
+            : hash_(hash),
+              key_(key),
+              f_(f),
+              init_(init)
+        {
+        }
+
+        NodePtr leaf(NodePtr const current) const
+        {
+            if (current)
+            {
+                Val const& old = *current->find(0, hash_, key_);
+                Val const val = f_(old);
+                if (val != old)
+                    return PersistentMap::leaf(hash_, key_, val);
+                else
+                    return current;
+            }
+            else if (init_)
+            {
+                return PersistentMap::leaf(hash_, key_, *init_);
+            }
+            else
+            {
+                return NodePtr();
+            }
+        }
+
+    private:
+        hashType const hash_;
+        Key const& key_;
+        F const f_;
+        Val const* const init_;
+    };
+
+    // Replaces a leaf's value by a function of it, reusing the hash code.
+    template<typename F>
+    struct MapValue : public Transform<Key, Val>
+    {
+        MapValue(F const f)
+            : f_(f)
+        {
+        }
+
+        NodePtr leaf(Node<Key, Val> const* const current) const
+        {
+            Entry const& entry =
+                static_cast<MapLeaf<Key, Val> const*>(current)->entry();
+            Val const val = f_(entry.second);
+            if (val != entry.second)
+                return PersistentMap::leaf(current->hash(), entry.first, val);
+            else
+                return sharedNode(current);
+        }
+
+    private:
+        F const f_;
+    };
+
+    // Keeps the leaves whose entries satisfy a predicate.
+    template<typename Pred>
+    struct Keep : public Transform<Key, Val>
+    {
+        Keep(Pred const pred)
+            : pred_(pred)
+        {
+        }
+
+        NodePtr leaf(Node<Key, Val> const* const current) const
+        {
+            Entry const& entry =
+                static_cast<MapLeaf<Key, Val> const*>(current)->entry();
+            if (pred_(entry.first, entry.second))
+                return sharedNode(current);
+            else
+                return NodePtr();
+        }
+
+    private:
+        Pred const pred_;
+    };
+
     PersistentMap(NodePtr const root)
         : root_(root)
     {
     }
 
+    PersistentMap const withRoot(NodePtr const root) const
+    {
+        return root == root_ ? *this : PersistentMap(root);
+    }
+
+    static NodePtr updated(NodePtr          const  root,
+                           hashType         const  hash,
+                           Key              const& key,
+                           Update<Key, Val> const& change,
+                           editType         const  edit)
+    {
+        if (root)
+            return root->update(0, hash, key, change, edit);
+        else
+            return change.leaf(NodePtr());
+    }
+
+    static NodePtr leaf(hashType const hash, Key const& key, Val const val)
+    {
+        return NodePtr(new MapLeaf<Key, Val>(hash, key, val));
+    }
+
     NodePtr root_;
 };
 
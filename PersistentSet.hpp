@@ -11,7 +11,12 @@
 #ifndef ODF_PERSISTENTSET_HPP
 #define ODF_PERSISTENTSET_HPP 1
 
+#include <cstddef>
+#include <iterator>
+#include <boost/noncopyable.hpp>
+
 #include "hash_trie.hpp"
+#include "intern_table.hpp"
 
 namespace odf
 {
@@ -25,13 +30,15 @@ namespace hash_trie
 template<typename Key>
 struct SetLeaf : public Node<Key, bool>
 {
-    typename Node<Key, bool>::ValPtr  typedef ValPtr;
     typename Node<Key, bool>::NodePtr typedef NodePtr;
 
-    SetLeaf(hashType const hash, Key const key)
+    SetLeaf(hashType const hash, Key const& key)
         : hash_(hash),
           key_(key)
     {
+#ifdef ODF_HASH_TRIE_MERKLE
+        this->setContentHash(entryContentHash(key, true));
+#endif
     }
 
     ~SetLeaf() {}
@@ -40,16 +47,18 @@ struct SetLeaf : public Node<Key, bool>
 
     bool isLeaf() const { return true; }
 
-    ValPtr get(indexType const shift,
-               hashType  const hash,
-               Key       const key) const
+    bool const* find(indexType const  shift,
+                     hashType  const  hash,
+                     Key       const& key) const
     {
-        return ValPtr(new bool(key == key_));
+        static bool const present = true;
+        return key == key_ ? &present : 0;
     }
 
     NodePtr insert(indexType const shift,
                    hashType  const hash,
-                   NodePtr   const leaf) const
+                   NodePtr   const leaf,
+                   editType  const edit)
     {
         if (key_ == leaf->key())
         {
@@ -59,25 +68,53 @@ struct SetLeaf : public Node<Key, bool>
         {
             NodePtr base;
             if (hash_ == hash)
-                base = NodePtr(new CollisionNode<Key, bool>(hash));
+                base = NodePtr(new CollisionNode<Key, bool>(hash, edit));
             else
-                base = NodePtr(new BitmappedNode<Key, bool>());
+                base = NodePtr(new BitmappedNode<Key, bool>(edit));
 
             return base
-                ->insert(shift, hash_, clone())
-                ->insert(shift, hash, leaf);
+                ->insert(shift, hash_, NodePtr(this), edit)
+                ->insert(shift, hash, leaf, edit);
         }
     }
 
-    NodePtr remove(indexType const shift,
-                   hashType  const hash,
-                   Key       const key) const
+    NodePtr update(indexType         const  shift,
+                   hashType          const  hash,
+                   Key               const& key,
+                   Update<Key, bool> const& change,
+                   editType          const  edit)
+    {
+        NodePtr current = key == key_ ? NodePtr(this) : NodePtr();
+        NodePtr leaf = change.leaf(current);
+        if (leaf == current)
+            return NodePtr(this);
+        else if (current)
+            return leaf;
+        else
+            return insert(shift, hash, leaf, edit);
+    }
+
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   editType  const  edit)
     {
-        return NodePtr();
+        return key == key_ ? NodePtr() : NodePtr(this);
     }
 
     Key const& key() const { return key_; }
 
+    hashType hash() const { return hash_; }
+
+    size_t nrSlots() const { return 0; }
+
+    Node<Key, bool> const* child(size_t const /*i*/) const { return 0; }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        usage.leaves += sizeof(*this);
+    }
+
 
     std::string asString() const
     {
@@ -89,11 +126,6 @@ struct SetLeaf : public Node<Key, bool>
 private:
     hashType const hash_;
     Key const key_;
-
-    NodePtr const clone() const
-    {
-        return NodePtr(new SetLeaf(*this));
-    }
 };
 
 // ----------------------------------------------------------------------------
@@ -105,44 +137,166 @@ class PersistentSet
 {
 public:
     typename Node<Key, bool>::NodePtr typedef NodePtr;
-    typename Node<Key, bool>::ValPtr  typedef ValPtr;
 
     PersistentSet()
         : root_()
     {
     }
 
+    // Builds a set from a range of keys, equivalent to inserting them one by
+    // one, but constructs the subtries below the root in parallel.
+    template<typename Iter>
+    static PersistentSet const fromRange(Iter const begin, Iter const end)
+    {
+        return PersistentSet(buildInParallel<Key, bool, KeyMaker>(begin, end));
+    }
+
     size_t size() const
     {
         return root_ ? root_->size() : 0;
     }
 
-    bool contains(Key const key) const
+    bool contains(Key const& key) const
     {
         return found(hashFunc(key), key);
     }
 
-    PersistentSet const insert(Key const key) const
+    // A lookup by a probe that compares equal to the key with ==, such as a
+    // char const* for std::string keys, so that no key needs to be built.
+    // The hash code comes from ProbeHash, which must be specialized for the
+    // probe type to avoid converting it to a key.
+    template<typename Probe>
+    bool contains(Probe const& probe) const
+    {
+        return contains(probe, ProbeHash<Key, hashFunc>::hash(probe));
+    }
+
+    // The same with a hash code supplied by the caller, which must be the
+    // one hashFunc computes for the key.
+    template<typename Probe>
+    bool contains(Probe const& probe, hashType const hash) const
+    {
+        return findLeaf<Key, bool>(root_.get(), hash, probe) != 0;
+    }
+
+    // Looks up a batch of keys at once, and stores in out whether each one
+    // is in the set, in the same order. The lookups proceed side by side
+    // with prefetching, which is faster than one by one when the set is
+    // much larger than the cache.
+    void containsMany(std::vector<Key> const& keys,
+                      std::vector<bool>& out) const
+    {
+        std::vector<hashType> hashes(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            hashes[i] = hashFunc(keys[i]);
+
+        std::vector<Node<Key, bool> const*> leaves(keys.size());
+        if (not keys.empty())
+            findLeaves<Key, bool>(root_.get(), &keys[0], &hashes[0],
+                                  keys.size(), &leaves[0]);
+
+        out.resize(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i)
+            out[i] = leaves[i] != 0;
+    }
+
+    PersistentSet const insert(Key const& key) const
     {
         hashType hash = hashFunc(key);
-        NodePtr leaf(new SetLeaf<Key>(hash, key));
+        return withRoot(updated(root_, hash, key, Add(hash, key), 0));
+    }
+
+    PersistentSet const remove(Key const& key) const
+    {
         if (not root_)
-            return PersistentSet(leaf);
-        else if (not found(hash, key))
-            return PersistentSet(root_->insert(0, hash, leaf));
-        else
             return *this;
+        else
+            return withRoot(root_->remove(0, hashFunc(key), key, 0));
     }
 
-    PersistentSet const remove(Key const key) const
+    // Set operations. These descend both tries in step and reuse the
+    // subtrees the two sets share, so their cost depends mostly on how much
+    // the sets differ.
+    PersistentSet const unite(PersistentSet const& other) const
     {
-        hashType hash = hashFunc(key);
-        if (found(hash, key))
-            return PersistentSet(root_->remove(0, hash, key));
-        else
-            return *this;
+        return withRoot(trieUnion<Key, bool>(root_, other.root_, 0));
+    }
+
+    PersistentSet const intersect(PersistentSet const& other) const
+    {
+        return withRoot(trieIntersection<Key, bool>(root_, other.root_, 0));
+    }
+
+    PersistentSet const subtract(PersistentSet const& other) const
+    {
+        return withRoot(trieDifference<Key, bool>(root_, other.root_, 0));
+    }
+
+    bool isSubsetOf(PersistentSet const& other) const
+    {
+        return trieIsSubset<Key, bool>(root_, other.root_, 0);
+    }
+
+    // An equal set made of the canonical nodes in the given table, so that
+    // it shares all equal subtries with other sets interned there. Equal
+    // sets interned in the same table share their root, so that comparing
+    // them takes constant time.
+    PersistentSet const interned(InternTable<Key, bool>& table) const
+    {
+        return PersistentSet(table.intern(root_));
+    }
+
+    // The memory held by the nodes of this set, including those it shares
+    // with other sets.
+    MemoryUsage memoryUsage() const
+    {
+        MemoryUsage usage;
+        addTrieMemoryUsage(root_.get(), usage);
+        return usage;
+    }
+
+    // The memory held by a range of sets, split into what several of them
+    // share and what each one holds alone.
+    template<typename Iter>
+    static SharedMemoryUsage memoryUsage(Iter const begin, Iter const end)
+    {
+        MemoryCensus<Key, bool> census(std::distance(begin, end));
+        size_t index = 0;
+        for (Iter iter = begin; iter != end; ++iter, ++index)
+            census.visit(iter->root_.get(), index);
+        return census.result();
+    }
+
+    // Describes the shape of the trie, which shows how well the hash
+    // function spreads the keys.
+    TrieStats stats() const
+    {
+        TrieStats result;
+        addTrieStats(root_.get(), 0, result);
+        return result;
+    }
+
+    // Sets are equal if they hold the same keys, no matter how they were
+    // built. Shared subtrees are not looked into.
+    bool operator==(PersistentSet const& other) const
+    {
+        return trieEqual<Key, bool>(root_.get(), other.root_.get(), 0);
     }
 
+    bool operator!=(PersistentSet const& other) const
+    {
+        return not (*this == other);
+    }
+
+#ifdef ODF_HASH_TRIE_MERKLE
+    // A hash of the entries that does not depend on how the set was built.
+    // Equal sets have equal hashes, and unequal ones almost never do.
+    uint64_t contentHash() const
+    {
+        return root_ ? root_->contentHash() : 0;
+    }
+#endif
+
     std::string asString() const
     {
         std::stringstream ss;
@@ -151,23 +305,214 @@ public:
         return ss.str();
     }
 
-private:
-    PersistentSet(NodePtr const root)
-        : root_(root)
+    // ------------------------------------------------------------------------
+    // Iterators visit the keys in no particular order. They do not
+    // allocate or touch reference counts, and stay valid as long as the set
+    // they came from.
+    // ------------------------------------------------------------------------
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef Key value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type const* pointer;
+        typedef value_type const& reference;
+
+        const_iterator()
+            : cursor_()
+        {
+        }
+
+        reference operator*() const
+        {
+            return cursor_.leaf()->key();
+        }
+
+        pointer operator->() const
+        {
+            return &cursor_.leaf()->key();
+        }
+
+        const_iterator& operator++()
+        {
+            cursor_.advance();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            cursor_.advance();
+            return old;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return cursor_.leaf() == other.cursor_.leaf();
+        }
+
+        bool operator!=(const_iterator const& other) const
+        {
+            return cursor_.leaf() != other.cursor_.leaf();
+        }
+
+    private:
+        friend class PersistentSet;
+
+        explicit const_iterator(Node<Key, bool> const* const root)
+            : cursor_(root)
+        {
+        }
+
+        TrieCursor<Key, bool> cursor_;
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const
+    {
+        return const_iterator(root_.get());
+    }
+
+    const_iterator end() const
     {
+        return const_iterator();
     }
 
-    bool found(hashType const hash, Key const key) const
+    // ------------------------------------------------------------------------
+    // A transient set is a mutable builder. Nodes it creates are tagged with
+    // its edit token and updated in place; nodes shared with persistent sets
+    // are copied on first write. Calling persistent() hands out the current
+    // contents in O(1) and switches to a fresh token, so the result is never
+    // modified by later updates to the transient.
+    // ------------------------------------------------------------------------
+
+    class Transient : private boost::noncopyable
     {
-        if (root_)
+    public:
+        Transient()
+            : root_(),
+              edit_(newEditToken())
         {
-            ValPtr const result = root_->get(0, hashFunc(key), key);
-            return result && *result;
         }
-        else
+
+        Transient(PersistentSet const& source)
+            : root_(source.root_),
+              edit_(newEditToken())
+        {
+        }
+
+        size_t size() const
+        {
+            return root_ ? root_->size() : 0;
+        }
+
+        bool contains(Key const& key) const
+        {
+            return root_ and root_->find(0, hashFunc(key), key);
+        }
+
+        template<typename Probe>
+        bool contains(Probe const& probe) const
+        {
+            return contains(probe, ProbeHash<Key, hashFunc>::hash(probe));
+        }
+
+        template<typename Probe>
+        bool contains(Probe const& probe, hashType const hash) const
+        {
+            return findLeaf<Key, bool>(root_.get(), hash, probe) != 0;
+        }
+
+        Transient& insert(Key const& key)
         {
-            return false;
+            hashType hash = hashFunc(key);
+            root_ = updated(root_, hash, key, Add(hash, key), edit_);
+            return *this;
+        }
+
+        Transient& remove(Key const& key)
+        {
+            if (root_)
+                root_ = root_->remove(0, hashFunc(key), key, edit_);
+            return *this;
+        }
+
+        PersistentSet const persistent()
+        {
+            edit_ = newEditToken();
+            return PersistentSet(root_);
+        }
+
+    private:
+        NodePtr root_;
+        editType edit_;
+    };
+
+private:
+    friend class Transient;
+
+    struct KeyMaker
+    {
+        template<typename Iter>
+        static hashType hash(Iter const iter)
+        {
+            return hashFunc(*iter);
+        }
+
+        template<typename Iter>
+        static NodePtr leaf(hashType const hash, Iter const iter)
+        {
+            return NodePtr(new SetLeaf<Key>(hash, *iter));
+        }
+    };
+
+    // Adds a key unless it is already present.
+    struct Add : public Update<Key, bool>
+    {
+        Add(hashType const hash, Key const& key)
+            : hash_(hash),
+              key_(key)
+        {
+        }
+
+        NodePtr leaf(NodePtr const current) const
+        {
+            return current ? current : NodePtr(new SetLeaf<Key>(hash_, key_));
         }
+
+    private:
+        hashType const hash_;
+        Key const& key_;
+    };
+
+    PersistentSet(NodePtr const root)
+        : root_(root)
+    {
+    }
+
+    PersistentSet const withRoot(NodePtr const root) const
+    {
+        return root == root_ ? *this : PersistentSet(root);
+    }
+
+    static NodePtr updated(NodePtr           const  root,
+                           hashType          const  hash,
+                           Key               const& key,
+                           Update<Key, bool> const& change,
+                           editType          const  edit)
+    {
+        if (root)
+            return root->update(0, hash, key, change, edit);
+        else
+            return change.leaf(NodePtr());
+    }
+
+    bool found(hashType const hash, Key const& key) const
+    {
+        return root_ and root_->find(0, hash, key);
     }
 
     NodePtr root_;
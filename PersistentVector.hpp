@@ -0,0 +1,598 @@
+/** -*-c++-*-
+ *
+ *  Persistent vectors as bitmapped vector tries, in the manner of Clojure:
+ *  Implementation of the PersistentVector class.
+ *
+ *  The elements are kept in leaves of fanout consecutive slots, which hang
+ *  off a trie of inner nodes indexed by successive chunks of the index, much
+ *  like the plain array nodes of a hash trie. The last leaf, the tail, is
+ *  held outside the trie, so that most appends and removals at the end only
+ *  copy the tail. Nodes are reference counted, allocated and edited in place
+ *  by transients in the same way as hash trie nodes, and the trie shape
+ *  settings in hash_trie.hpp apply here as well.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_PERSISTENTVECTOR_HPP
+#define ODF_PERSISTENTVECTOR_HPP 1
+
+#include <cstddef>
+#include <iterator>
+#include <boost/noncopyable.hpp>
+
+#include "hash_trie.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// A node of a vector trie. Inner nodes have fanout child slots, some of which
+// may be empty; leaves have fanout element slots. Nodes tagged with a nonzero
+// edit token are changed in place by whoever holds that token, all others
+// are copied with the change.
+// ----------------------------------------------------------------------------
+
+template<typename T>
+class VectorNode
+{
+public:
+    typename boost::intrusive_ptr<VectorNode> typedef NodePtr;
+
+    // Fresh nodes are filled in before they are shared, so that nodes made
+    // under the persistent token 0 need not be copied for their first entry.
+    static NodePtr inner(editType const edit,
+                         NodePtr  const first,
+                         NodePtr  const second = NodePtr())
+    {
+        NodePtr* children = newArray<NodePtr>(fanout);
+        children[0] = first;
+        children[1] = second;
+        return NodePtr(new VectorNode(children, 0, edit));
+    }
+
+    static NodePtr leaf(editType const edit, T const& first)
+    {
+        T* values = newArray<T>(fanout);
+        values[0] = first;
+        return NodePtr(new VectorNode(0, values, edit));
+    }
+
+    ~VectorNode()
+    {
+        deleteArray(children_, fanout);
+        deleteArray(values_, fanout);
+    }
+
+    bool isLeaf() const { return values_ != 0; }
+
+    VectorNode const* child(indexType const i) const
+    {
+        return children_[i].get();
+    }
+
+    NodePtr const& childPtr(indexType const i) const
+    {
+        return children_[i];
+    }
+
+    T const& value(indexType const i) const
+    {
+        return values_[i];
+    }
+
+    T const* values() const
+    {
+        return values_;
+    }
+
+    NodePtr withChild(indexType const i,
+                      NodePtr   const child,
+                      editType  const edit)
+    {
+        if (isEditable(edit_, edit))
+        {
+            children_[i] = child;
+            return NodePtr(this);
+        }
+        else
+            return NodePtr(new VectorNode(
+                               arrayUpdate(children_, fanout, i, child),
+                               0, edit));
+    }
+
+    NodePtr withValue(indexType const i, T const& val, editType const edit)
+    {
+        if (isEditable(edit_, edit))
+        {
+            values_[i] = val;
+            return NodePtr(this);
+        }
+        else
+            return NodePtr(new VectorNode(
+                               0, arrayUpdate(values_, fanout, i, val), edit));
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        if (isLeaf())
+            usage.leaves += sizeof(*this) + fanout * sizeof(T);
+        else
+        {
+            usage.arrays += sizeof(*this);
+            usage.childArrays += fanout * sizeof(NodePtr);
+        }
+    }
+
+    static void* operator new(size_t const bytes)
+    {
+        return Allocator::allocate(bytes);
+    }
+
+    static void operator delete(void* const p, size_t const bytes)
+    {
+        Allocator::deallocate(p, bytes);
+    }
+
+    friend void intrusive_ptr_add_ref(VectorNode const* const p)
+    {
+        p->counter_.increment();
+    }
+
+    friend void intrusive_ptr_release(VectorNode const* const p)
+    {
+        if (p->counter_.decrement())
+        {
+            if (DeferredDeletion::isEnabled())
+                DeferredDeletion::defer(const_cast<VectorNode*>(p), destroy);
+            else
+                delete p;
+        }
+    }
+
+private:
+    NodePtr* children_;
+    T* values_;
+    editType edit_;
+    RefCounter<size_t> counter_;
+
+    VectorNode(NodePtr* const children, T* const values, editType const edit)
+        : children_(children),
+          values_(values),
+          edit_(edit),
+          counter_()
+    {
+    }
+
+    VectorNode(VectorNode const&);
+    VectorNode& operator=(VectorNode const&);
+
+    static void destroy(void* const p)
+    {
+        delete static_cast<VectorNode*>(p);
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// The state of a vector: the trie holding all full leaves but the last, and
+// the tail, which holds the last 1 to fanout elements. The root is an inner
+// node with its children shift bits of the index apart; it is empty if there
+// are no more than fanout elements. All changes go through here, both for
+// persistent vectors, which pass the edit token 0, and for transients.
+// ----------------------------------------------------------------------------
+
+template<typename T>
+struct VectorTrie
+{
+    typename VectorNode<T>::NodePtr typedef NodePtr;
+
+    VectorTrie()
+        : size(0),
+          shift(chunkBits),
+          root(),
+          tail()
+    {
+    }
+
+    size_t size;
+    indexType shift;
+    NodePtr root;
+    NodePtr tail;
+
+    static size_t const mask = fanout - 1;
+
+    // The index of the first element in the tail.
+    size_t tailOffset() const
+    {
+        return size < fanout ? 0 : ((size - 1) >> chunkBits) << chunkBits;
+    }
+
+    // The leaf holding the element at index i.
+    VectorNode<T> const* leafFor(size_t const i) const
+    {
+        if (i >= tailOffset())
+            return tail.get();
+
+        VectorNode<T> const* node = root.get();
+        for (indexType level = shift; level > 0; level -= chunkBits)
+            node = node->child((i >> level) & mask);
+        return node;
+    }
+
+    T const& at(size_t const i) const
+    {
+        return leafFor(i)->value(i & mask);
+    }
+
+    void set(size_t const i, T const& val, editType const edit)
+    {
+        if (i >= tailOffset())
+            tail = tail->withValue(i & mask, val, edit);
+        else
+            root = withValue(shift, root, i, val, edit);
+    }
+
+    void pushBack(T const& val, editType const edit)
+    {
+        if (size - tailOffset() < fanout)
+        {
+            if (tail)
+                tail = tail->withValue(size & mask, val, edit);
+            else
+                tail = VectorNode<T>::leaf(edit, val);
+        }
+        else
+        {
+            // The tail is full, so it goes into the trie, which gets a new
+            // root on top if it is full as well.
+            if ((size >> chunkBits) > (size_t(1) << shift))
+            {
+                root = VectorNode<T>::inner(edit, root,
+                                            newPath(shift, tail, edit));
+                shift += chunkBits;
+            }
+            else if (root)
+                root = pushTail(shift, root, edit);
+            else
+                root = newPath(shift, tail, edit);
+
+            tail = VectorNode<T>::leaf(edit, val);
+        }
+        ++size;
+    }
+
+    void popBack(editType const edit)
+    {
+        if (size <= 1)
+        {
+            *this = VectorTrie();
+            return;
+        }
+
+        if (size - tailOffset() > 1)
+        {
+            // Resetting the slot releases whatever the element holds on to.
+            tail = tail->withValue((size - 1) & mask, T(), edit);
+        }
+        else
+        {
+            tail = NodePtr(const_cast<VectorNode<T>*>(leafFor(size - 2)));
+            root = popTail(shift, root, edit);
+            if (shift > chunkBits and not root->child(1))
+            {
+                root = root->childPtr(0);
+                shift -= chunkBits;
+            }
+        }
+        --size;
+    }
+
+private:
+    // A chain of fresh inner nodes down to the given node at level 0.
+    static NodePtr newPath(indexType const level,
+                           NodePtr   const node,
+                           editType  const edit)
+    {
+        if (level == 0)
+            return node;
+        else
+            return VectorNode<T>::inner(
+                edit, newPath(level - chunkBits, node, edit));
+    }
+
+    NodePtr pushTail(indexType const level,
+                     NodePtr   const parent,
+                     editType  const edit) const
+    {
+        indexType const i = ((size - 1) >> level) & mask;
+        NodePtr child;
+        if (level == chunkBits)
+            child = tail;
+        else if (parent->child(i))
+            child = pushTail(level - chunkBits, parent->childPtr(i), edit);
+        else
+            child = newPath(level - chunkBits, tail, edit);
+
+        return parent->withChild(i, child, edit);
+    }
+
+    // Removes the last leaf. Returns an empty pointer where no children
+    // remain.
+    NodePtr popTail(indexType const level,
+                    NodePtr   const node,
+                    editType  const edit) const
+    {
+        indexType const i = ((size - 2) >> level) & mask;
+        if (level > chunkBits)
+        {
+            NodePtr child = popTail(level - chunkBits, node->childPtr(i), edit);
+            if (not child and i == 0)
+                return NodePtr();
+            else
+                return node->withChild(i, child, edit);
+        }
+        else if (i == 0)
+            return NodePtr();
+        else
+            return node->withChild(i, NodePtr(), edit);
+    }
+
+    static NodePtr withValue(indexType const level,
+                             NodePtr   const node,
+                             size_t    const i,
+                             T         const& val,
+                             editType  const edit)
+    {
+        if (level == 0)
+            return node->withValue(i & mask, val, edit);
+
+        indexType const k = (i >> level) & mask;
+        return node->withChild(
+            k, withValue(level - chunkBits, node->childPtr(k), i, val, edit),
+            edit);
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// The driver class. Elements must be default constructible.
+// ----------------------------------------------------------------------------
+
+template<typename T>
+class PersistentVector
+{
+public:
+    PersistentVector()
+        : trie_()
+    {
+    }
+
+    size_t size() const
+    {
+        return trie_.size;
+    }
+
+    bool empty() const
+    {
+        return trie_.size == 0;
+    }
+
+    // The element at index i, which must be less than size().
+    T const& at(size_t const i) const
+    {
+        return trie_.at(i);
+    }
+
+    T const& operator[](size_t const i) const
+    {
+        return trie_.at(i);
+    }
+
+    T getVal(size_t const i, T const notFound) const
+    {
+        return i < size() ? trie_.at(i) : notFound;
+    }
+
+    // Replaces the element at index i, which must be less than size().
+    PersistentVector const set(size_t const i, T const& val) const
+    {
+        PersistentVector result(*this);
+        result.trie_.set(i, val, 0);
+        return result;
+    }
+
+    PersistentVector const push_back(T const& val) const
+    {
+        PersistentVector result(*this);
+        result.trie_.pushBack(val, 0);
+        return result;
+    }
+
+    // Removes the last element, if any.
+    PersistentVector const pop_back() const
+    {
+        PersistentVector result(*this);
+        result.trie_.popBack(0);
+        return result;
+    }
+
+    MemoryUsage memoryUsage() const
+    {
+        MemoryUsage usage;
+        addMemoryUsage(trie_.root.get(), usage);
+        if (trie_.tail)
+            trie_.tail->addMemoryUsage(usage);
+        return usage;
+    }
+
+    class const_iterator
+    {
+    public:
+        typedef std::forward_iterator_tag iterator_category;
+        typedef T value_type;
+        typedef std::ptrdiff_t difference_type;
+        typedef value_type const* pointer;
+        typedef value_type const& reference;
+
+        const_iterator()
+            : trie_(0),
+              index_(0),
+              block_(0)
+        {
+        }
+
+        reference operator*() const
+        {
+            return block_[index_ & VectorTrie<T>::mask];
+        }
+
+        pointer operator->() const
+        {
+            return &**this;
+        }
+
+        const_iterator& operator++()
+        {
+            ++index_;
+            if ((index_ & VectorTrie<T>::mask) == 0 and index_ < trie_->size)
+                block_ = trie_->leafFor(index_)->values();
+            return *this;
+        }
+
+        const_iterator operator++(int)
+        {
+            const_iterator old(*this);
+            ++*this;
+            return old;
+        }
+
+        bool operator==(const_iterator const& other) const
+        {
+            return index_ == other.index_;
+        }
+
+        bool operator!=(const_iterator const& other) const
+        {
+            return index_ != other.index_;
+        }
+
+    private:
+        friend class PersistentVector;
+
+        const_iterator(VectorTrie<T> const* const trie, size_t const index)
+            : trie_(trie),
+              index_(index),
+              block_(index < trie->size ? trie->leafFor(index)->values() : 0)
+        {
+        }
+
+        VectorTrie<T> const* trie_;
+        size_t index_;
+        T const* block_;
+    };
+
+    typedef const_iterator iterator;
+
+    const_iterator begin() const
+    {
+        return const_iterator(&trie_, 0);
+    }
+
+    const_iterator end() const
+    {
+        return const_iterator(&trie_, trie_.size);
+    }
+
+    // ------------------------------------------------------------------------
+    // A transient vector for batches of changes. It starts out sharing all
+    // nodes with its source, and copies each node once at most before
+    // changing it in place. After persistent() is called, further changes
+    // no longer affect the vector it returned.
+    // ------------------------------------------------------------------------
+
+    class Transient : private boost::noncopyable
+    {
+    public:
+        Transient()
+            : trie_(),
+              edit_(newEditToken())
+        {
+        }
+
+        Transient(PersistentVector const& source)
+            : trie_(source.trie_),
+              edit_(newEditToken())
+        {
+        }
+
+        size_t size() const
+        {
+            return trie_.size;
+        }
+
+        T const& at(size_t const i) const
+        {
+            return trie_.at(i);
+        }
+
+        Transient& set(size_t const i, T const& val)
+        {
+            trie_.set(i, val, edit_);
+            return *this;
+        }
+
+        Transient& push_back(T const& val)
+        {
+            trie_.pushBack(val, edit_);
+            return *this;
+        }
+
+        Transient& pop_back()
+        {
+            trie_.popBack(edit_);
+            return *this;
+        }
+
+        PersistentVector const persistent()
+        {
+            edit_ = newEditToken();
+            return PersistentVector(trie_);
+        }
+
+    private:
+        VectorTrie<T> trie_;
+        editType edit_;
+    };
+
+private:
+    friend class Transient;
+
+    VectorTrie<T> trie_;
+
+    explicit PersistentVector(VectorTrie<T> const& trie)
+        : trie_(trie)
+    {
+    }
+
+    static void addMemoryUsage(VectorNode<T> const* const node,
+                               MemoryUsage& usage)
+    {
+        if (not node)
+            return;
+
+        node->addMemoryUsage(usage);
+        if (not node->isLeaf())
+            for (indexType i = 0; i < fanout; ++i)
+                addMemoryUsage(node->child(i), usage);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_PERSISTENTVECTOR_HPP
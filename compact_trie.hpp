@@ -0,0 +1,539 @@
+/** -*-c++-*-
+ *
+ *  Compressed hash array mapped prefix trees (CHAMP) after Steindorfer and
+ *  Vinju: common functionality, used in CompactMap and CompactSet.
+ *
+ *  Each node keeps two bitmaps, one for entries stored inline and one for
+ *  child nodes. A node is a single heap block holding a small header, then
+ *  the inline entries, then the child pointers. There are no leaf objects
+ *  and no virtual functions.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_COMPACT_TRIE_HPP
+#define ODF_COMPACT_TRIE_HPP 1
+
+#include <new>
+#include <sstream>
+
+#include <boost/smart_ptr.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+
+#include "hash_trie.hpp"
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// Entries as stored inline in compact nodes. Sets use NoValue, for which the
+// specialization below stores the key only.
+// ----------------------------------------------------------------------------
+
+struct NoValue
+{
+    bool operator==(NoValue const&) const { return true; }
+    bool operator!=(NoValue const&) const { return false; }
+};
+
+template<typename Key, typename Val>
+struct CompactEntry
+{
+    CompactEntry(Key const& key, Val const& value)
+        : key_(key),
+          value_(value)
+    {
+    }
+
+    Key const& key() const { return key_; }
+
+    Val const& value() const { return value_; }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << key_ << " -> " << value_;
+        return ss.str();
+    }
+
+private:
+    Key key_;
+    Val value_;
+};
+
+template<typename Key>
+struct CompactEntry<Key, NoValue>
+{
+    CompactEntry(Key const& key, NoValue const&)
+        : key_(key)
+    {
+    }
+
+    Key const& key() const { return key_; }
+
+    NoValue const& value() const
+    {
+        static NoValue const none = NoValue();
+        return none;
+    }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << key_;
+        return ss.str();
+    }
+
+private:
+    Key key_;
+};
+
+
+// ----------------------------------------------------------------------------
+// A compact trie node. Below the last level that consumes hash bits, a node
+// is a collision node: both bitmaps are zero and its entries, which all have
+// the same hash code, are simply listed.
+//
+// Nodes are built bottom up and never modified. Except for the root, every
+// node holds at least two entries in its subtree, so a subtree that shrinks
+// to a single entry is pulled up into its parent.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val, hashType (*hashFunc)(Key const)>
+class CompactNode
+{
+public:
+    typedef CompactEntry<Key, Val> Entry;
+    typedef boost::intrusive_ptr<CompactNode> NodePtr;
+
+    // A root holding just one entry. Maps and sets represent the empty trie
+    // by a null root, so this is where a trie starts out.
+    static NodePtr single(hashType const hash, Key const& key, Val const val)
+    {
+        CompactNode* node = allocate(maskBit(hash, 0), 0, 1);
+        new (node->entries()) Entry(key, val);
+        return NodePtr(node);
+    }
+
+    size_t nrEntries() const { return nrEntries_; }
+
+    size_t nrNodes() const { return bitCount(nodeMap_); }
+
+    Val const* find(indexType const  shift,
+                    hashType  const  hash,
+                    Key       const& key) const
+    {
+        CompactNode const* node = this;
+        for (indexType s = shift; ; s += chunkBits)
+        {
+            if (s >= hashBits)
+            {
+                Entry const* e = node->findInBucket(key);
+                return e ? &e->value() : 0;
+            }
+
+            bitmapType bit = maskBit(hash, s);
+            if (node->dataMap_ & bit)
+            {
+                Entry const& e = node->entries()[indexForBit(node->dataMap_,
+                                                             bit)];
+                return e.key() == key ? &e.value() : 0;
+            }
+            else if (node->nodeMap_ & bit)
+                node = node->nodes()[indexForBit(node->nodeMap_, bit)].get();
+            else
+                return 0;
+        }
+    }
+
+    NodePtr insert(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   Val       const  val,
+                   bool&            added) const
+    {
+        if (shift >= hashBits)
+        {
+            Entry const* e = findInBucket(key);
+            if (e == 0)
+            {
+                added = true;
+                return withAppended(Entry(key, val));
+            }
+            else if (e->value() != val)
+                return withValue(e - entries(), val);
+            else
+                return self();
+        }
+
+        bitmapType bit = maskBit(hash, shift);
+        if (dataMap_ & bit)
+        {
+            indexType i = indexForBit(dataMap_, bit);
+            Entry const& e = entries()[i];
+            if (e.key() == key)
+            {
+                if (e.value() != val)
+                    return withValue(i, val);
+                else
+                    return self();
+            }
+            else
+            {
+                added = true;
+                NodePtr sub = fromTwo(shift + chunkBits,
+                                      hashFunc(e.key()), e,
+                                      hash, Entry(key, val));
+                return withEntryMovedDown(bit, sub);
+            }
+        }
+        else if (nodeMap_ & bit)
+        {
+            indexType i = indexForBit(nodeMap_, bit);
+            NodePtr const& child = nodes()[i];
+            NodePtr node =
+                child->insert(shift + chunkBits, hash, key, val, added);
+            return node == child ? self() : withNode(i, node);
+        }
+        else
+        {
+            added = true;
+            return withEntry(bit, Entry(key, val));
+        }
+    }
+
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   bool&            removed) const
+    {
+        if (shift >= hashBits)
+        {
+            Entry const* e = findInBucket(key);
+            if (e == 0)
+                return self();
+            removed = true;
+            return without(e - entries());
+        }
+
+        bitmapType bit = maskBit(hash, shift);
+        if (dataMap_ & bit)
+        {
+            indexType i = indexForBit(dataMap_, bit);
+            if (entries()[i].key() != key)
+                return self();
+            removed = true;
+            return withoutEntry(bit);
+        }
+        else if (nodeMap_ & bit)
+        {
+            indexType i = indexForBit(nodeMap_, bit);
+            NodePtr const& child = nodes()[i];
+            NodePtr node = child->remove(shift + chunkBits, hash, key, removed);
+            if (node == child)
+                return self();
+            else if (node->nrNodes() == 0 and node->nrEntries() == 1)
+                return withNodeMovedUp(bit, node->entries()[0]);
+            else
+                return withNode(i, node);
+        }
+        else
+        {
+            return self();
+        }
+    }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        if (dataMap_ == 0 and nodeMap_ == 0 and nrEntries_ > 1)
+        {
+            ss << "<";
+            for (size_t i = 0; i < nrEntries_; ++i)
+            {
+                if (i > 0)
+                    ss << " | ";
+                ss << entries()[i].asString();
+            }
+            ss << ">";
+        }
+        else
+        {
+            ss << "{";
+            int j = 0;
+            for (int i = 0; i < fanout; ++i)
+            {
+                bitmapType bit = bitmapType(1) << i;
+                if ((dataMap_ | nodeMap_) & bit)
+                {
+                    if (j > 0)
+                        ss << ", ";
+                    ss << i << ": ";
+                    if (dataMap_ & bit)
+                        ss << entries()[indexForBit(dataMap_, bit)].asString();
+                    else
+                        ss << nodes()[indexForBit(nodeMap_, bit)]->asString();
+                    ++j;
+                }
+            }
+            ss << "}";
+        }
+        return ss.str();
+    }
+
+    friend void intrusive_ptr_add_ref(CompactNode const* const p)
+    {
+        p->counter_.increment();
+    }
+
+    friend void intrusive_ptr_release(CompactNode const* const p)
+    {
+        if (p->counter_.decrement())
+            p->destroy();
+    }
+
+private:
+    RefCounter<uint32_t> counter_;
+    uint32_t nrEntries_;
+    bitmapType dataMap_;
+    bitmapType nodeMap_;
+
+    CompactNode(bitmapType const dataMap,
+                bitmapType const nodeMap,
+                size_t   const nrEntries)
+        : counter_(),
+          nrEntries_(nrEntries),
+          dataMap_(dataMap),
+          nodeMap_(nodeMap)
+    {
+    }
+
+    // ------------------------------------------------------------------------
+    // Memory layout: header, entries, child pointers in one block.
+    // ------------------------------------------------------------------------
+
+    static size_t alignUp(size_t const n, size_t const alignment)
+    {
+        return (n + alignment - 1) / alignment * alignment;
+    }
+
+    static size_t entriesOffset()
+    {
+        return alignUp(sizeof(CompactNode), boost::alignment_of<Entry>::value);
+    }
+
+    static size_t nodesOffset(size_t const nrEntries)
+    {
+        return alignUp(entriesOffset() + nrEntries * sizeof(Entry),
+                       boost::alignment_of<NodePtr>::value);
+    }
+
+    static CompactNode* allocate(bitmapType const dataMap,
+                                 bitmapType const nodeMap,
+                                 size_t   const nrEntries)
+    {
+        void* block = Allocator::allocate(blockSize(nodeMap, nrEntries));
+        return new (block) CompactNode(dataMap, nodeMap, nrEntries);
+    }
+
+    static size_t blockSize(bitmapType const nodeMap, size_t const nrEntries)
+    {
+        return nodesOffset(nrEntries) + bitCount(nodeMap) * sizeof(NodePtr);
+    }
+
+    void destroy() const
+    {
+        size_t const bytes = blockSize(nodeMap_, nrEntries_);
+        for (size_t i = 0; i < nrEntries_; ++i)
+            entries()[i].~Entry();
+        for (size_t i = 0; i < nrNodes(); ++i)
+            nodes()[i].~NodePtr();
+        this->~CompactNode();
+        Allocator::deallocate(const_cast<CompactNode*>(this), bytes);
+    }
+
+    Entry* entries() const
+    {
+        char* base = reinterpret_cast<char*>(const_cast<CompactNode*>(this));
+        return reinterpret_cast<Entry*>(base + entriesOffset());
+    }
+
+    NodePtr* nodes() const
+    {
+        char* base = reinterpret_cast<char*>(const_cast<CompactNode*>(this));
+        return reinterpret_cast<NodePtr*>(base + nodesOffset(nrEntries_));
+    }
+
+    NodePtr self() const
+    {
+        return NodePtr(const_cast<CompactNode*>(this));
+    }
+
+    Entry const* findInBucket(Key const& key) const
+    {
+        for (size_t i = 0; i < nrEntries_; ++i)
+        {
+            if (entries()[i].key() == key)
+                return entries() + i;
+        }
+        return 0;
+    }
+
+    // ------------------------------------------------------------------------
+    // Copying with small modifications. Entry and node positions given as a
+    // bit refer to the bitmaps; plain indices are array positions.
+    // ------------------------------------------------------------------------
+
+    static NodePtr fromTwo(indexType const shift,
+                           hashType  const hashA,
+                           Entry     const& a,
+                           hashType  const hashB,
+                           Entry     const& b)
+    {
+        if (shift >= hashBits)
+        {
+            CompactNode* node = allocate(0, 0, 2);
+            new (node->entries() + 0) Entry(a);
+            new (node->entries() + 1) Entry(b);
+            return NodePtr(node);
+        }
+
+        bitmapType bitA = maskBit(hashA, shift);
+        bitmapType bitB = maskBit(hashB, shift);
+        if (bitA != bitB)
+        {
+            CompactNode* node = allocate(bitA | bitB, 0, 2);
+            new (node->entries() + 0) Entry(bitA < bitB ? a : b);
+            new (node->entries() + 1) Entry(bitA < bitB ? b : a);
+            return NodePtr(node);
+        }
+        else
+        {
+            CompactNode* node = allocate(0, bitA, 0);
+            new (node->nodes()) NodePtr(
+                fromTwo(shift + chunkBits, hashA, a, hashB, b));
+            return NodePtr(node);
+        }
+    }
+
+    NodePtr withValue(size_t const i, Val const val) const
+    {
+        CompactNode* node = allocate(dataMap_, nodeMap_, nrEntries_);
+        for (size_t k = 0; k < nrEntries_; ++k)
+        {
+            if (k == i)
+                new (node->entries() + k) Entry(entries()[k].key(), val);
+            else
+                new (node->entries() + k) Entry(entries()[k]);
+        }
+        copyNodes(node, 0, nrNodes(), 0);
+        return NodePtr(node);
+    }
+
+    NodePtr withNode(size_t const i, NodePtr const child) const
+    {
+        CompactNode* node = allocate(dataMap_, nodeMap_, nrEntries_);
+        copyEntries(node, 0, nrEntries_, 0);
+        for (size_t k = 0; k < nrNodes(); ++k)
+            new (node->nodes() + k) NodePtr(k == i ? child : nodes()[k]);
+        return NodePtr(node);
+    }
+
+    NodePtr withEntry(bitmapType const bit, Entry const& entry) const
+    {
+        size_t i = indexForBit(dataMap_, bit);
+        CompactNode* node = allocate(dataMap_ | bit, nodeMap_, nrEntries_ + 1);
+        copyEntries(node, 0, i, 0);
+        new (node->entries() + i) Entry(entry);
+        copyEntries(node, i, nrEntries_, i + 1);
+        copyNodes(node, 0, nrNodes(), 0);
+        return NodePtr(node);
+    }
+
+    // Appends an entry to a collision node.
+    NodePtr withAppended(Entry const& entry) const
+    {
+        CompactNode* node = allocate(0, 0, nrEntries_ + 1);
+        copyEntries(node, 0, nrEntries_, 0);
+        new (node->entries() + nrEntries_) Entry(entry);
+        return NodePtr(node);
+    }
+
+    NodePtr withoutEntry(bitmapType const bit) const
+    {
+        size_t i = indexForBit(dataMap_, bit);
+        CompactNode* node = allocate(dataMap_ ^ bit, nodeMap_, nrEntries_ - 1);
+        copyEntries(node, 0, i, 0);
+        copyEntries(node, i + 1, nrEntries_, i);
+        copyNodes(node, 0, nrNodes(), 0);
+        return NodePtr(node);
+    }
+
+    // Removes the i-th entry of a collision node.
+    NodePtr without(size_t const i) const
+    {
+        CompactNode* node = allocate(0, 0, nrEntries_ - 1);
+        copyEntries(node, 0, i, 0);
+        copyEntries(node, i + 1, nrEntries_, i);
+        return NodePtr(node);
+    }
+
+    NodePtr withEntryMovedDown(bitmapType const bit, NodePtr const child) const
+    {
+        size_t i = indexForBit(dataMap_, bit);
+        size_t j = indexForBit(nodeMap_, bit);
+        CompactNode* node = allocate(dataMap_ ^ bit, nodeMap_ | bit,
+                                     nrEntries_ - 1);
+        copyEntries(node, 0, i, 0);
+        copyEntries(node, i + 1, nrEntries_, i);
+        copyNodes(node, 0, j, 0);
+        new (node->nodes() + j) NodePtr(child);
+        copyNodes(node, j, nrNodes(), j + 1);
+        return NodePtr(node);
+    }
+
+    NodePtr withNodeMovedUp(bitmapType const bit, Entry const& entry) const
+    {
+        size_t i = indexForBit(dataMap_, bit);
+        size_t j = indexForBit(nodeMap_, bit);
+        CompactNode* node = allocate(dataMap_ | bit, nodeMap_ ^ bit,
+                                     nrEntries_ + 1);
+        copyEntries(node, 0, i, 0);
+        new (node->entries() + i) Entry(entry);
+        copyEntries(node, i, nrEntries_, i + 1);
+        copyNodes(node, 0, j, 0);
+        copyNodes(node, j + 1, nrNodes(), j);
+        return NodePtr(node);
+    }
+
+    // Copies entries or child pointers [from, to) to the target, starting at
+    // position dest.
+
+    void copyEntries(CompactNode* target,
+                     size_t const from,
+                     size_t const to,
+                     size_t const dest) const
+    {
+        for (size_t k = from; k < to; ++k)
+            new (target->entries() + dest + k - from) Entry(entries()[k]);
+    }
+
+    void copyNodes(CompactNode* target,
+                   size_t const from,
+                   size_t const to,
+                   size_t const dest) const
+    {
+        for (size_t k = from; k < to; ++k)
+            new (target->nodes() + dest + k - from) NodePtr(nodes()[k]);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_COMPACT_TRIE_HPP
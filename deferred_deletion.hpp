@@ -0,0 +1,211 @@
+/** -*-c++-*-
+ *
+ *  Deferred deletion of trie nodes.
+ *
+ *  Normally, dropping the last reference to a trie frees all its nodes on
+ *  the spot, which for a large trie can take a long time. With deferred
+ *  deletion enabled, a node whose count drops to zero goes onto a queue
+ *  instead, still holding its children. Calling drain() then frees a given
+ *  number of queued nodes. Their children, once unreferenced, go onto the
+ *  same queue, so each node freed costs a bounded amount of work, and a large
+ *  trie is freed a little at a time. A BackgroundDrain does this on a thread
+ *  of its own.
+ *
+ *  Nodes may be freed by a different thread than the one that dropped them,
+ *  so when tries are shared between threads or a BackgroundDrain is used,
+ *  ODF_HASH_TRIE_ATOMIC must be defined.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_DEFERRED_DELETION_HPP
+#define ODF_DEFERRED_DELETION_HPP 1
+
+#include <stddef.h>
+#include <algorithm>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+class DeferredDeletion
+{
+public:
+    // Frees an object, e.g. by calling delete on it with the right type.
+    typedef void (*Destroy)(void*);
+
+    // Switches deferral on or off for all threads. Nodes already queued stay
+    // there until drained.
+    static void enable(bool const on = true)
+    {
+        enabled().store(on);
+    }
+
+    static bool isEnabled()
+    {
+        return enabled().load(boost::memory_order_relaxed);
+    }
+
+    // Queues an object. Called for each node whose count drops to zero while
+    // deferral is enabled.
+    static void defer(void* const object, Destroy const destroy)
+    {
+        Item const item = { object, destroy };
+
+        std::vector<Item>* local = drainStack();
+        if (local)
+        {
+            local->push_back(item);
+        }
+        else
+        {
+            boost::mutex::scoped_lock lock(queueMutex());
+            queue().push_back(item);
+        }
+    }
+
+    // Frees at most budget queued objects and returns how many it freed.
+    // Takes that many from the shared queue; nodes that become unreferenced
+    // while this runs are queued for the same call without taking the lock,
+    // and whatever is left goes back to the shared queue at the end.
+    static size_t drain(size_t const budget)
+    {
+        std::vector<Item> work;
+        {
+            boost::mutex::scoped_lock lock(queueMutex());
+            size_t const n = std::min(budget, queue().size());
+            work.assign(queue().end() - n, queue().end());
+            queue().resize(queue().size() - n);
+        }
+
+        std::vector<Item>* const outer = drainStack();
+        drainStack() = &work;
+
+        size_t freed = 0;
+        while (freed < budget and not work.empty())
+        {
+            Item const item = work.back();
+            work.pop_back();
+            item.destroy(item.object);
+            ++freed;
+        }
+
+        drainStack() = outer;
+
+        if (not work.empty())
+        {
+            boost::mutex::scoped_lock lock(queueMutex());
+            queue().insert(queue().end(), work.begin(), work.end());
+        }
+
+        return freed;
+    }
+
+    // The number of objects waiting to be freed.
+    static size_t pending()
+    {
+        boost::mutex::scoped_lock lock(queueMutex());
+        return queue().size();
+    }
+
+private:
+    struct Item
+    {
+        void* object;
+        Destroy destroy;
+    };
+
+    static boost::atomic<bool>& enabled()
+    {
+        static boost::atomic<bool> flag(false);
+        return flag;
+    }
+
+    static boost::mutex& queueMutex()
+    {
+        static boost::mutex mutex;
+        return mutex;
+    }
+
+    static std::vector<Item>& queue()
+    {
+        static std::vector<Item> items;
+        return items;
+    }
+
+    // The queue of the drain() call running on this thread, if any.
+    static std::vector<Item>*& drainStack()
+    {
+        static __thread std::vector<Item>* stack = 0;
+        return stack;
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// Drains the queue on a thread of its own, in steps of the given budget, and
+// sleeps for the given pause whenever the queue runs empty. The destructor
+// stops the thread; anything still queued stays there.
+// ----------------------------------------------------------------------------
+
+class BackgroundDrain : private boost::noncopyable
+{
+public:
+    explicit BackgroundDrain(size_t const budget = 4096,
+                             unsigned const pauseMillis = 10)
+        : stop_(false),
+          thread_(Loop(this, budget, pauseMillis))
+    {
+    }
+
+    ~BackgroundDrain()
+    {
+        stop_.store(true);
+        thread_.join();
+    }
+
+private:
+    struct Loop
+    {
+        Loop(BackgroundDrain* const owner,
+             size_t const budget,
+             unsigned const pauseMillis)
+            : owner_(owner),
+              budget_(budget),
+              pauseMillis_(pauseMillis)
+        {
+        }
+
+        void operator()() const
+        {
+            while (not owner_->stop_.load())
+            {
+                if (DeferredDeletion::drain(budget_) < budget_)
+                    boost::this_thread::sleep(
+                        boost::posix_time::milliseconds(pauseMillis_));
+            }
+        }
+
+    private:
+        BackgroundDrain* owner_;
+        size_t budget_;
+        unsigned pauseMillis_;
+    };
+
+    boost::atomic<bool> stop_;
+    boost::thread thread_;
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_DEFERRED_DELETION_HPP
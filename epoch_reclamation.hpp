@@ -0,0 +1,239 @@
+/** -*-c++-*-
+ *
+ *  Epoch-based reclamation for objects that lock-free readers may still be
+ *  looking at after they were unlinked.
+ *
+ *  Each thread that takes part owns a record in a global list. A reader
+ *  announces the current global epoch in its record for the duration of a
+ *  ReadGuard, and clears it afterwards. A writer that has unlinked an object
+ *  retires it with the epoch it then advances the global counter from, and
+ *  the object is released once no record announces that epoch or an earlier
+ *  one. Announcing and clearing are single stores, so reads are wait-free.
+ *
+ *  Retired objects wait in the record of the thread that retired them, and
+ *  are collected by that thread's later calls to retire() or collect(). When
+ *  a thread exits, its record becomes free for the next thread that needs
+ *  one, and anything still waiting in it is taken over by the next call to
+ *  retire() or collect() on any thread. Records are never freed.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_EPOCH_RECLAMATION_HPP
+#define ODF_EPOCH_RECLAMATION_HPP 1
+
+#include <stdint.h>
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/tss.hpp>
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+class EpochReclamation
+{
+    struct Record;
+
+public:
+    // Releases a retired object, e.g. by dropping a reference to it.
+    typedef void (*Release)(void*);
+
+    // Keeps everything unlinked after it starts from being released before
+    // it ends.
+    class ReadGuard : private boost::noncopyable
+    {
+    public:
+        ReadGuard()
+            : record_(localRecord())
+        {
+            record_.epoch.store(globalEpoch().load());
+        }
+
+        ~ReadGuard()
+        {
+            record_.epoch.store(0, boost::memory_order_release);
+        }
+
+    private:
+        Record& record_;
+    };
+
+    // Releases the object once no reader can still see it. Must be called
+    // after the object was unlinked, and not inside a ReadGuard.
+    static void retire(void* const object, Release const release)
+    {
+        Record& record = localRecord();
+        Retired item;
+        item.object = object;
+        item.release = release;
+        item.epoch = globalEpoch().fetch_add(1);
+        record.retired.push_back(item);
+        collect(record);
+    }
+
+    // Releases what this thread has retired, or taken over from threads that
+    // exited, and no reader can still see. Returns the number of objects that
+    // are still waiting.
+    static size_t collect()
+    {
+        Record& record = localRecord();
+        collect(record);
+        return record.retired.size();
+    }
+
+private:
+    struct Retired
+    {
+        void* object;
+        Release release;
+        uint64_t epoch;
+    };
+
+    struct Record
+    {
+        Record()
+            : epoch(0),
+              inUse(true),
+              abandoned(false),
+              next(0)
+        {
+        }
+
+        // The epoch announced by a reader, or 0.
+        boost::atomic<uint64_t> epoch;
+        boost::atomic<bool> inUse;
+
+        // Set when a thread exited with retired objects still waiting here.
+        boost::atomic<bool> abandoned;
+        Record* next;
+
+        // Only touched by the thread using the record.
+        std::vector<Retired> retired;
+
+        // Keeps the announcements of different threads in different cache
+        // lines.
+        char padding[64];
+    };
+
+    // Starts at 1, so that 0 can mean "not reading".
+    static boost::atomic<uint64_t>& globalEpoch()
+    {
+        static boost::atomic<uint64_t> epoch(1);
+        return epoch;
+    }
+
+    static boost::atomic<Record*>& records()
+    {
+        static boost::atomic<Record*> head(0);
+        return head;
+    }
+
+    // Reuses a record left by a thread that exited, or adds a new one.
+    static Record* acquireRecord()
+    {
+        for (Record* r = records().load(); r != 0; r = r->next)
+        {
+            bool expected = false;
+            if (not r->inUse.load(boost::memory_order_relaxed)
+                and r->inUse.compare_exchange_strong(expected, true))
+            {
+                r->abandoned.store(false);
+                return r;
+            }
+        }
+
+        Record* r = new Record();
+        Record* head = records().load();
+        do
+            r->next = head;
+        while (not records().compare_exchange_weak(head, r));
+        return r;
+    }
+
+    static void releaseRecord(Record* const record)
+    {
+        cachedRecord() = 0;
+        record->epoch.store(0);
+        record->abandoned.store(not record->retired.empty());
+        record->inUse.store(false);
+    }
+
+    // Moves the objects waiting in abandoned records into the given one. A
+    // record is claimed through its inUse flag while doing so, just as when
+    // a thread acquires it.
+    static void adoptAbandoned(Record& record)
+    {
+        for (Record* r = records().load(); r != 0; r = r->next)
+        {
+            bool expected = false;
+            if (r->abandoned.load(boost::memory_order_relaxed)
+                and r->inUse.compare_exchange_strong(expected, true))
+            {
+                record.retired.insert(record.retired.end(),
+                                      r->retired.begin(), r->retired.end());
+                r->retired.clear();
+                r->abandoned.store(false);
+                r->inUse.store(false);
+            }
+        }
+    }
+
+    // As in PoolAllocator, the thread-specific pointer hands the record back
+    // when the thread exits; the __thread copy is a fast way to reach it.
+    static Record& localRecord()
+    {
+        Record*& cached = cachedRecord();
+        if (cached == 0)
+        {
+            static boost::thread_specific_ptr<Record> owner(releaseRecord);
+            cached = acquireRecord();
+            owner.reset(cached);
+        }
+        return *cached;
+    }
+
+    static Record*& cachedRecord()
+    {
+        static __thread Record* cached = 0;
+        return cached;
+    }
+
+    static void collect(Record& record)
+    {
+        adoptAbandoned(record);
+        if (record.retired.empty())
+            return;
+
+        // Everything retired before the oldest epoch still announced is safe.
+        uint64_t oldest = globalEpoch().load();
+        for (Record* r = records().load(); r != 0; r = r->next)
+        {
+            uint64_t const e = r->epoch.load();
+            if (e != 0 and e < oldest)
+                oldest = e;
+        }
+
+        std::vector<Retired> waiting;
+        for (size_t i = 0; i < record.retired.size(); ++i)
+        {
+            Retired const& item = record.retired[i];
+            if (item.epoch < oldest)
+                item.release(item.object);
+            else
+                waiting.push_back(item);
+        }
+        record.retired.swap(waiting);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_EPOCH_RECLAMATION_HPP
@@ -12,10 +12,26 @@
 #define ODF_HASH_TRIE_HPP 1
 
 #include <stdint.h>
+#include <algorithm>
 #include <vector>
 #include <sstream>
 
 #include <boost/smart_ptr.hpp>
+#include <boost/static_assert.hpp>
+#include <boost/thread.hpp>
+#include <boost/unordered_map.hpp>
+
+#ifdef ODF_HASH_TRIE_ATOMIC
+#include <boost/atomic.hpp>
+#endif
+
+#ifdef ODF_HASH_TRIE_MERKLE
+#include <boost/functional/hash.hpp>
+#endif
+
+#include "deferred_deletion.hpp"
+#include "trie_allocator.hpp"
+#include "work_stealing.hpp"
 
 
 namespace odf
@@ -23,20 +39,232 @@ namespace odf
 namespace hash_trie
 {
 
+// ----------------------------------------------------------------------------
+// The shape of the trie. By default, hash codes have 32 bits, and each level
+// of the trie uses the next 5 of them to pick one of 32 child slots. Inner
+// nodes with up to 16 children store them in a packed array indexed by a
+// bitmap; fuller nodes use a plain array, and go back to the packed form
+// when fewer than 9 children remain. The following can be defined to change
+// this:
+//     ODF_HASH_TRIE_HASH_BITS     32 or 64
+//     ODF_HASH_TRIE_CHUNK_BITS    4, 5 or 6 bits per level
+//     ODF_HASH_TRIE_MAX_BITMAPPED the largest packed node
+//     ODF_HASH_TRIE_MIN_ARRAY     the smallest plain array node
+// The last two default to one half and one quarter plus one of the fanout.
+// Hash functions must return hashType.
+//
+// All translation units in a program must agree on these settings.
+// ----------------------------------------------------------------------------
+
+#ifndef ODF_HASH_TRIE_HASH_BITS
+#define ODF_HASH_TRIE_HASH_BITS 32
+#endif
+
+#ifndef ODF_HASH_TRIE_CHUNK_BITS
+#define ODF_HASH_TRIE_CHUNK_BITS 5
+#endif
+
+#if ODF_HASH_TRIE_HASH_BITS == 64
+typedef uint64_t hashType;
+#elif ODF_HASH_TRIE_HASH_BITS == 32
 typedef uint32_t hashType;
+#else
+#error "ODF_HASH_TRIE_HASH_BITS must be 32 or 64"
+#endif
+
+#if ODF_HASH_TRIE_CHUNK_BITS == 6
+typedef uint64_t bitmapType;
+#elif ODF_HASH_TRIE_CHUNK_BITS == 4 or ODF_HASH_TRIE_CHUNK_BITS == 5
+typedef uint32_t bitmapType;
+#else
+#error "ODF_HASH_TRIE_CHUNK_BITS must be 4, 5 or 6"
+#endif
+
 typedef uint8_t  indexType;
+typedef size_t   editType;
+
+indexType const hashBits  = 8 * sizeof(hashType);
+indexType const chunkBits = ODF_HASH_TRIE_CHUNK_BITS;
+indexType const fanout    = 1 << chunkBits;
+
+#ifdef ODF_HASH_TRIE_MAX_BITMAPPED
+indexType const maxBitmappedSize = ODF_HASH_TRIE_MAX_BITMAPPED;
+#else
+indexType const maxBitmappedSize = fanout / 2;
+#endif
+
+#ifdef ODF_HASH_TRIE_MIN_ARRAY
+indexType const minArraySize = ODF_HASH_TRIE_MIN_ARRAY;
+#else
+indexType const minArraySize = fanout / 4 + 1;
+#endif
+
+// Array nodes must not be demoted as soon as they are made.
+BOOST_STATIC_ASSERT(maxBitmappedSize < fanout);
+BOOST_STATIC_ASSERT(minArraySize >= 2);
+BOOST_STATIC_ASSERT(minArraySize <= maxBitmappedSize + 1);
+
+// The largest number of inner nodes on any path from the root: one for each
+// chunk of the hash code, plus a collision node at the bottom.
+indexType const maxDepth = (hashBits + chunkBits - 1) / chunkBits + 1;
+
+
+// ----------------------------------------------------------------------------
+// Reference counts for trie nodes. By default these are plain integers. When
+// ODF_HASH_TRIE_ATOMIC is defined, they become atomic, so that tries can be
+// shared freely between threads. Increments are relaxed; the final decrement
+// synchronizes with all earlier ones before the node is freed.
+//
+// All translation units in a program must agree on this setting.
+// ----------------------------------------------------------------------------
+
+template<typename T>
+class RefCounter
+{
+public:
+    RefCounter()
+        : count_(0)
+    {
+    }
+
+    // Copies start out unreferenced.
+    RefCounter(RefCounter const&)
+        : count_(0)
+    {
+    }
+
+    RefCounter& operator=(RefCounter const&)
+    {
+        return *this;
+    }
+
+#ifdef ODF_HASH_TRIE_ATOMIC
+    void increment() const
+    {
+        count_.fetch_add(1, boost::memory_order_relaxed);
+    }
+
+    // Returns true if the count dropped to zero.
+    bool decrement() const
+    {
+        if (count_.fetch_sub(1, boost::memory_order_release) == 1)
+        {
+            // Acquire all earlier releases before the caller frees the node.
+            count_.load(boost::memory_order_acquire);
+            return true;
+        }
+        else
+        {
+            return false;
+        }
+    }
+
+    T value() const
+    {
+        return count_.load(boost::memory_order_relaxed);
+    }
+
+private:
+    mutable boost::atomic<T> count_;
+#else
+    void increment() const
+    {
+        ++count_;
+    }
+
+    // Returns true if the count dropped to zero.
+    bool decrement() const
+    {
+        return --count_ == 0;
+    }
+
+    T value() const
+    {
+        return count_;
+    }
+
+private:
+    mutable T count_;
+#endif
+};
+
+
+// ----------------------------------------------------------------------------
+// Edit tokens for transient (in-place) updates. A node tagged with a nonzero
+// token may be modified destructively by whoever holds that same token.
+// Tokens are never reused, so dropping one freezes all nodes tagged with it.
+// ----------------------------------------------------------------------------
+
+inline editType newEditToken()
+{
+#ifdef ODF_HASH_TRIE_ATOMIC
+    static boost::atomic<editType> next(0);
+    return next.fetch_add(1, boost::memory_order_relaxed) + 1;
+#else
+    static editType next = 0;
+    return ++next;
+#endif
+}
+
+inline bool isEditable(editType const owner, editType const edit)
+{
+    return edit != 0 and edit == owner;
+}
+
+
+// ----------------------------------------------------------------------------
+// Content hashes. When ODF_HASH_TRIE_MERKLE is defined, every node caches a
+// 64-bit hash of the entries below it, computed when the node is built or
+// edited. The hash of a subtree is the sum of the hashes of its entries, so
+// it depends only on its contents and not on the shape of the subtree or the
+// order of a collision bucket. Keys and values must work with boost::hash.
+//
+// All translation units in a program must agree on this setting.
+// ----------------------------------------------------------------------------
+
+#ifdef ODF_HASH_TRIE_MERKLE
+
+inline uint64_t mixBits(uint64_t h)
+{
+    uint64_t const m1 = (uint64_t(0xff51afd7) << 32) | 0xed558ccd;
+    uint64_t const m2 = (uint64_t(0xc4ceb9fe) << 32) | 0x1a85ec53;
+
+    h ^= h >> 33;
+    h *= m1;
+    h ^= h >> 33;
+    h *= m2;
+    h ^= h >> 33;
+    return h;
+}
+
+template<typename Key, typename Val>
+uint64_t entryContentHash(Key const& key, Val const& val)
+{
+    size_t seed = 0;
+    boost::hash_combine(seed, key);
+    boost::hash_combine(seed, val);
+    return mixBits(seed);
+}
+
+#endif // ODF_HASH_TRIE_MERKLE
 
 
 // ----------------------------------------------------------------------------
 // Bit counting and manipulation functions.
+//
+// These run on every level of every lookup and update, so bitCount uses the
+// POPCNT instruction where it can. If the compilation target guarantees it
+// (e.g. with -mpopcnt or -march=native), the instruction is used directly.
+// Otherwise, on x86 with GCC or Clang, the CPU is asked once at startup and
+// the portable version is used only if the instruction is missing.
 // ----------------------------------------------------------------------------
 
-indexType masked(hashType const n, indexType const shift)
+inline indexType masked(hashType const n, indexType const shift)
 {
-    return (n >> shift) & 0x1f;
+    return (n >> shift) & (fanout - 1);
 }
 
-indexType bitCount(hashType n)
+inline indexType portableBitCount(uint32_t n)
 {
     n -= (n >> 1) & 0x55555555;
     n = (n & 0x33333333) + ((n >> 2) & 0x33333333);
@@ -45,34 +273,128 @@ indexType bitCount(hashType n)
     return (n + (n >> 16)) & 0x3f;
 }
 
-indexType indexForBit(hashType const bitmap, hashType const bit)
+inline indexType portableBitCount(uint64_t const n)
+{
+    return portableBitCount(uint32_t(n)) + portableBitCount(uint32_t(n >> 32));
+}
+
+#if defined(__POPCNT__)
+
+inline bool hasHardwareBitCount()
+{
+    return true;
+}
+
+inline indexType bitCount(bitmapType const n)
+{
+    if (sizeof(bitmapType) > 4)
+        return __builtin_popcountll(n);
+    else
+        return __builtin_popcount(n);
+}
+
+#elif defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+
+inline bool detectHardwareBitCount()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("popcnt");
+}
+
+// A class template, so that the flag can be defined in this header. Code
+// that runs before it is initialized simply takes the portable path.
+template<int N>
+struct CpuFeatures
+{
+    static bool const hasPopcount;
+};
+
+template<int N>
+bool const CpuFeatures<N>::hasPopcount = detectHardwareBitCount();
+
+inline bool hasHardwareBitCount()
+{
+    return CpuFeatures<0>::hasPopcount;
+}
+
+inline indexType hardwareBitCount(uint32_t const n)
+{
+    uint32_t count;
+    __asm__("popcntl %1, %0" : "=r" (count) : "rm" (n) : "cc");
+    return count;
+}
+
+inline indexType hardwareBitCount(uint64_t const n)
+{
+#if defined(__x86_64__)
+    uint64_t count;
+    __asm__("popcntq %1, %0" : "=r" (count) : "rm" (n) : "cc");
+    return count;
+#else
+    return hardwareBitCount(uint32_t(n)) + hardwareBitCount(uint32_t(n >> 32));
+#endif
+}
+
+inline indexType bitCount(bitmapType const n)
+{
+    if (CpuFeatures<0>::hasPopcount)
+        return hardwareBitCount(n);
+    else
+        return portableBitCount(n);
+}
+
+#else
+
+inline bool hasHardwareBitCount()
+{
+    return false;
+}
+
+inline indexType bitCount(bitmapType const n)
+{
+    return portableBitCount(n);
+}
+
+#endif
+
+inline indexType indexForBit(bitmapType const bitmap, bitmapType const bit)
 {
     return bitCount(bitmap & (bit - 1));
 }
 
-hashType maskBit(hashType const n, indexType const shift)
+inline bitmapType maskBit(hashType const n, indexType const shift)
+{
+    return bitmapType(1) << masked(n, shift);
+}
+
+// Asks for the cache line at the given address to be loaded, without waiting
+// for it. A no-op where the compiler offers no way to do this.
+inline void prefetch(void const* const p)
 {
-    return 1 << masked(n, shift);
+#if defined(__GNUC__)
+    __builtin_prefetch(p);
+#endif
 }
 
 
 // ----------------------------------------------------------------------------
-// Array copying with small modifications
+// Array copying with small modifications. Results are allocated with newArray
+// and must be released with deleteArray.
 // ----------------------------------------------------------------------------
 
 template<typename T>
-T const* arrayUpdate(T const* source, int const len, int const pos, T const val)
+T* arrayUpdate(T const* source, int const len, int const pos, T const val)
 {
-    T* copy = new T[len];
+    T* copy = newArray<T>(len);
     for (int i = 0; i < len; ++i)
         copy[i] = (i == pos) ? val : source[i];
     return copy;
 }
 
 template<typename T>
-T const* arrayInsert(T const* source, int const len, int const pos, T const val)
+T* arrayInsert(T const* source, int const len, int const pos, T const val)
 {
-    T* copy = new T[len + 1];
+    T* copy = newArray<T>(len + 1);
     for (int i = 0; i < pos; ++i)
         copy[i] = source[i];
     copy[pos] = val;
@@ -82,9 +404,9 @@ T const* arrayInsert(T const* source, int const len, int const pos, T const val)
 }
 
 template<typename T>
-T const* arrayRemove(T const* source, int const len, int const pos)
+T* arrayRemove(T const* source, int const len, int const pos)
 {
-    T* copy = new T[len - 1];
+    T* copy = newArray<T>(len - 1);
     for (int i = 0; i < pos; ++i)
         copy[i] = source[i];
     for (int i = pos+1; i < len; ++i)
@@ -93,65 +415,212 @@ T const* arrayRemove(T const* source, int const len, int const pos)
 }
 
 
+// ----------------------------------------------------------------------------
+// Memory held by trie nodes, in bytes, by kind of node. The arrays of child
+// pointers in inner and collision nodes are counted separately. Memory that
+// keys and values allocate for themselves is not included.
+// ----------------------------------------------------------------------------
+
+struct MemoryUsage
+{
+    MemoryUsage()
+        : leaves(0),
+          collisions(0),
+          bitmapped(0),
+          arrays(0),
+          childArrays(0)
+    {
+    }
+
+    size_t total() const
+    {
+        return leaves + collisions + bitmapped + arrays + childArrays;
+    }
+
+    MemoryUsage& operator+=(MemoryUsage const& other)
+    {
+        leaves      += other.leaves;
+        collisions  += other.collisions;
+        bitmapped   += other.bitmapped;
+        arrays      += other.arrays;
+        childArrays += other.childArrays;
+        return *this;
+    }
+
+    size_t leaves;
+    size_t collisions;
+    size_t bitmapped;
+    size_t arrays;
+    size_t childArrays;
+};
+
 // ----------------------------------------------------------------------------
 // The classes BitmappedNode and ArrayNode reference each other, so we need to
 // forward declare one.
 // ----------------------------------------------------------------------------
 
 template<typename Key, typename Val> class BitmappedNode;
+template<typename Key, typename Val> struct Update;
 
 // ----------------------------------------------------------------------------
-// The interface for nodes of the hash trie data structure
+// The interface for nodes of the hash trie data structure.
+//
+// The insert, update and remove methods take an edit token. Nodes tagged
+// with the same nonzero token are updated in place; all others are
+// path-copied, and the copies are tagged with the given token. Persistent
+// updates pass 0.
+//
+// The update and remove methods descend only once and return the node itself
+// if nothing changed. In-place edits also return the node itself, so callers
+// compare sizes as well as pointers to detect a no-op.
 // ----------------------------------------------------------------------------
 
 template<typename Key, typename Val>
 struct Node
 {
-    typename boost::shared_ptr<Val>     typedef ValPtr;
     typename boost::intrusive_ptr<Node> typedef NodePtr;
 
     virtual size_t size() const = 0;
 
     virtual bool isLeaf() const = 0;
 
-    virtual ValPtr get(indexType const shift,
-                       hashType  const hash,
-                       Key       const key) const = 0;
+    virtual Val const* find(indexType const  shift,
+                            hashType  const  hash,
+                            Key       const& key) const = 0;
 
     virtual NodePtr insert(indexType const shift,
                            hashType  const hash,
-                           NodePtr   const leaf) const = 0;
+                           NodePtr   const leaf,
+                           editType  const edit) = 0;
 
-    virtual NodePtr remove(indexType const shift,
-                           hashType  const hash,
-                           Key       const key) const = 0;
+    virtual NodePtr update(indexType        const  shift,
+                           hashType         const  hash,
+                           Key              const& key,
+                           Update<Key, Val> const& change,
+                           editType         const  edit) = 0;
+
+    virtual NodePtr remove(indexType const  shift,
+                           hashType  const  hash,
+                           Key       const& key,
+                           editType  const  edit) = 0;
 
     virtual Key const& key() const {};
 
+    // The common hash code of the entries below a leaf or collision node.
+    virtual hashType hash() const { return 0; }
+
+    // Child access for traversal. Inner nodes have nrSlots() child slots,
+    // some of which may be empty; leaves have none.
+    virtual size_t nrSlots() const = 0;
+
+    virtual Node const* child(size_t const i) const = 0;
+
+    // For inner nodes, the child in the slot for the given hash code at the
+    // given level, or 0 if that slot is empty.
+    virtual Node const* childFor(indexType const /*shift*/,
+                                 hashType  const /*hash*/) const
+    {
+        return 0;
+    }
+
+    // For inner nodes, prefetches the memory childFor() will read beyond the
+    // node itself.
+    virtual void prefetchChildFor(indexType const /*shift*/,
+                                  hashType  const /*hash*/) const
+    {
+    }
+
+    // For inner nodes, stores each child in the slot of a fanout-sized array
+    // given by its hash chunk. The other slots are left untouched.
+    virtual void getChildren(NodePtr* const /*slots*/) const {}
+
+    virtual void getChildren(Node const** const /*slots*/) const {}
+
+    // Adds the memory held by this node itself, but not by its children.
+    virtual void addMemoryUsage(MemoryUsage& usage) const = 0;
+
     virtual std::string asString() const = 0;
 
+    static void* operator new(size_t const bytes)
+    {
+        return Allocator::allocate(bytes);
+    }
+
+    static void operator delete(void* const p, size_t const bytes)
+    {
+        Allocator::deallocate(p, bytes);
+    }
+
+    // The number of references to this node. Only meaningful while no
+    // other thread can change it.
+    size_t useCount() const
+    {
+        return counter_.value();
+    }
+
     friend void intrusive_ptr_add_ref(Node const* const p)
     {
-        ++p->counter_;
+        p->counter_.increment();
     }
 
+    // With deferred deletion enabled, a node is queued rather than freed,
+    // and its children are released only when the queue gets to it.
     friend void intrusive_ptr_release(Node const* const p)
     {
-        if (--p->counter_ == 0)
-            delete p;
+        if (p->counter_.decrement())
+        {
+            if (DeferredDeletion::isEnabled())
+                DeferredDeletion::defer(const_cast<Node*>(p), destroy);
+            else
+                delete p;
+        }
     }
 
+#ifdef ODF_HASH_TRIE_MERKLE
+    uint64_t contentHash() const { return contentHash_; }
+#endif
+
 protected:
+    static void destroy(void* const p)
+    {
+        delete static_cast<Node*>(p);
+    }
+
     Node()
-        : counter_(0)
+        : counter_()
+#ifdef ODF_HASH_TRIE_MERKLE
+        , contentHash_(0)
+#endif
     {
     }
 
     Node(Node const&)
-        : counter_(0)
+        : counter_()
+#ifdef ODF_HASH_TRIE_MERKLE
+        , contentHash_(0)
+#endif
+    {
+    }
+
+    // Recomputes the content hash from the given children, if enabled.
+    void rehash(NodePtr const* const children, size_t const n)
     {
+#ifdef ODF_HASH_TRIE_MERKLE
+        uint64_t sum = 0;
+        for (size_t i = 0; i < n; ++i)
+            if (children[i])
+                sum += children[i]->contentHash();
+        contentHash_ = sum;
+#else
+        (void) children;
+        (void) n;
+#endif
     }
 
+#ifdef ODF_HASH_TRIE_MERKLE
+    void setContentHash(uint64_t const h) { contentHash_ = h; }
+#endif
+
     virtual ~Node() {};
 
     Node& operator=(Node const&)
@@ -160,7 +629,28 @@ protected:
     }
 
 private:
-    mutable size_t counter_;
+    RefCounter<size_t> counter_;
+#ifdef ODF_HASH_TRIE_MERKLE
+    uint64_t contentHash_;
+#endif
+};
+
+
+// ----------------------------------------------------------------------------
+// A change to the entry for a single key. Given the current leaf for the key,
+// or an empty pointer if there is none, leaf() returns the leaf to store in
+// its place. Returning the current leaf, or an empty pointer when the key is
+// missing, leaves the trie unchanged.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+struct Update
+{
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    virtual ~Update() {}
+
+    virtual NodePtr leaf(NodePtr const current) const = 0;
 };
 
 
@@ -171,71 +661,126 @@ private:
 template<typename Key, typename Val>
 struct CollisionNode : public Node<Key, Val>
 {
-    typename Node<Key, Val>::ValPtr  typedef ValPtr;
     typename Node<Key, Val>::NodePtr typedef NodePtr;
 
     typedef std::vector<NodePtr> Bucket;
 
-    CollisionNode(hashType const hash)
+    CollisionNode(hashType const hash, editType const edit)
         : hash_(hash),
+          edit_(edit),
           bucket_()
     {
     }
 
+    // A node holding the given leaves, which must all have the given hash
+    // code and different keys.
+    static NodePtr fromBucket(hashType const hash, Bucket const& bucket)
+    {
+        return NodePtr(new CollisionNode(hash, bucket, 0));
+    }
+
     size_t size() const { return bucket_.size(); }
 
     bool isLeaf() const { return true; }
 
-    ValPtr get(indexType const shift,
-               hashType  const hash,
-               Key       const key) const
+    Val const* find(indexType const  shift,
+                    hashType  const  hash,
+                    Key       const& key) const
     {
         for (typename Bucket::const_iterator iter = bucket_.begin();
              iter != bucket_.end();
              ++iter)
         {
             if ((*iter)->key() == key)
-                return (*iter)->get(shift, hash, key);
+                return (*iter)->find(shift, hash, key);
         }
-        return ValPtr();
+        return 0;
     }
 
     NodePtr insert(indexType const shift,
                    hashType  const hash,
-                   NodePtr   const leaf) const
+                   NodePtr   const leaf,
+                   editType  const edit)
     {
         if (hash != hash_)
         {
-            return NodePtr(new BitmappedNode<Key, Val>())
-                ->insert(shift, hash_, clone())
-                ->insert(shift, hash, leaf);
+            return NodePtr(new BitmappedNode<Key, Val>(edit))
+                ->insert(shift, hash_, NodePtr(this), edit)
+                ->insert(shift, hash, leaf, edit);
+        }
+        else if (isEditable(edit_, edit))
+        {
+            removeFromBucket(leaf->key());
+            bucket_.push_back(leaf);
+            rehash();
+            return NodePtr(this);
         }
         else
         {
             Bucket newBucket = bucketWithout(leaf->key());
             newBucket.push_back(leaf);
-            return NodePtr(new CollisionNode(hash, newBucket));
+            return NodePtr(new CollisionNode(hash, newBucket, edit));
         }
     }
 
-    NodePtr remove(indexType const shift,
-                   hashType  const hash,
-                   Key       const key) const
+    NodePtr update(indexType        const  shift,
+                   hashType         const  hash,
+                   Key              const& key,
+                   Update<Key, Val> const& change,
+                   editType         const  edit)
+    {
+        NodePtr current = hash == hash_ ? leafFor(key) : NodePtr();
+        NodePtr leaf = change.leaf(current);
+        if (leaf == current)
+            return NodePtr(this);
+        else
+            return insert(shift, hash, leaf, edit);
+    }
+
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   editType  const  edit)
     {
         assert(size() >= 2);
-        if (size() == 2)
+        if (hash != hash_ or not leafFor(key))
+        {
+            return NodePtr(this);
+        }
+        else if (size() == 2)
         {
             if (bucket_.at(0)->key() != key)
                 return bucket_.at(0);
             else
                 return bucket_.at(1);
         }
+        else if (isEditable(edit_, edit))
+        {
+            removeFromBucket(key);
+            rehash();
+            return NodePtr(this);
+        }
         else
         {
-            return NodePtr(new CollisionNode(hash, bucketWithout(key)));
+            return NodePtr(new CollisionNode(hash, bucketWithout(key), edit));
         }
     }
 
+    hashType hash() const { return hash_; }
+
+    size_t nrSlots() const { return bucket_.size(); }
+
+    Node<Key, Val> const* child(size_t const i) const
+    {
+        return bucket_[i].get();
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        usage.collisions += sizeof(*this);
+        usage.childArrays += bucket_.capacity() * sizeof(NodePtr);
+    }
+
     std::string asString() const
     {
         std::stringstream ss;
@@ -254,20 +799,38 @@ struct CollisionNode : public Node<Key, Val>
         
 private:
     hashType const hash_;
-    Bucket const bucket_;
+    editType const edit_;
+    Bucket bucket_;
 
-    CollisionNode(hashType const hash, Bucket const bucket)
+    CollisionNode(hashType const hash,
+                  Bucket const bucket,
+                  editType const edit)
         : hash_(hash),
+          edit_(edit),
           bucket_(bucket)
     {
+        rehash();
     }
 
-    NodePtr const clone() const
+    void rehash()
     {
-        return NodePtr(new CollisionNode(*this));
+        if (not bucket_.empty())
+            Node<Key, Val>::rehash(&bucket_[0], bucket_.size());
+    }
+
+    NodePtr leafFor(Key const& key) const
+    {
+        for (typename Bucket::const_iterator iter = bucket_.begin();
+             iter != bucket_.end();
+             ++iter)
+        {
+            if ((*iter)->key() == key)
+                return *iter;
+        }
+        return NodePtr();
     }
 
-    Bucket bucketWithout(Key const key) const
+    Bucket bucketWithout(Key const& key) const
     {
         Bucket result;
         for (typename Bucket::const_iterator iter = bucket_.begin();
@@ -279,123 +842,241 @@ private:
         }
         return result;
     }
+
+    void removeFromBucket(Key const& key)
+    {
+        for (typename Bucket::iterator iter = bucket_.begin();
+             iter != bucket_.end();
+             ++iter)
+        {
+            if ((*iter)->key() == key)
+            {
+                bucket_.erase(iter);
+                return;
+            }
+        }
+    }
 };
 
 // ----------------------------------------------------------------------------
-// An array node provides room for up to 32 child nodes with direct access
+// An array node provides a slot for every child node with direct access
 // ----------------------------------------------------------------------------
 
 template<typename Key, typename Val>
 struct ArrayNode : public Node<Key, Val>
 {
-    typename Node<Key, Val>::ValPtr  typedef ValPtr;
     typename Node<Key, Val>::NodePtr typedef NodePtr;
 
-    ArrayNode(NodePtr const* progeny, size_t const size)
+    ArrayNode(NodePtr* progeny, size_t const size, editType const edit)
         : progeny_(progeny),
-          size_(size)
+          size_(size),
+          edit_(edit)
     {
+        this->rehash(progeny_, fanout);
     }
 
     ~ArrayNode()
     {
-        delete[] progeny_;
+        deleteArray(progeny_, fanout);
     }
 
     size_t size() const { return size_; }
 
     bool isLeaf() const { return false; }
 
-    ValPtr get(indexType const shift,
-               hashType  const hash,
-               Key       const key) const
+    Val const* find(indexType const  shift,
+                    hashType  const  hash,
+                    Key       const& key) const
     {
         indexType i = masked(hash, shift);
         if (progeny_[i])
-            return progeny_[i]->get(shift + 5, hash, key);
+            return progeny_[i]->find(shift + chunkBits, hash, key);
         else
-            return ValPtr();
+            return 0;
     }
 
     NodePtr insert(indexType const shift,
                    hashType  const hash,
-                   NodePtr   const leaf) const
+                   NodePtr   const leaf,
+                   editType  const edit)
     {
         indexType i = masked(hash, shift);
         NodePtr oldNode = progeny_[i];
-        NodePtr newNode = oldNode ? oldNode->insert(shift+5, hash, leaf) : leaf;
-        size_t d = oldNode ? newNode->size() - oldNode->size() : leaf->size();
-        return NodePtr(new ArrayNode(arrayUpdate(progeny_, 32, i, newNode),
-                                     size() + d));
+        size_t oldSize = oldNode ? oldNode->size() : 0;
+        NodePtr newNode =
+            oldNode ? oldNode->insert(shift + chunkBits, hash, leaf, edit)
+                    : leaf;
+        return withChild(i, newNode, size() + newNode->size() - oldSize, edit);
     }
 
-    NodePtr remove(indexType const shift,
-                   hashType  const hash,
-                   Key       const key) const
+    NodePtr update(indexType        const  shift,
+                   hashType         const  hash,
+                   Key              const& key,
+                   Update<Key, Val> const& change,
+                   editType         const  edit)
     {
         indexType i = masked(hash, shift);
-        NodePtr node = progeny_[i]->remove(shift+5, hash, key);
-        if (node and node->size() > 0)
+        NodePtr oldNode = progeny_[i];
+        if (oldNode)
+        {
+            size_t oldSize = oldNode->size();
+            NodePtr newNode =
+                oldNode->update(shift + chunkBits, hash, key, change, edit);
+            if (newNode == oldNode and newNode->size() == oldSize)
+                return unchanged(edit);
+            else
+                return withChild(i, newNode,
+                                 size() + newNode->size() - oldSize, edit);
+        }
+        else
+        {
+            NodePtr leaf = change.leaf(NodePtr());
+            if (not leaf)
+                return NodePtr(this);
+            else
+                return withChild(i, leaf, size() + leaf->size(), edit);
+        }
+    }
+
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   editType  const  edit)
+    {
+        indexType i = masked(hash, shift);
+        NodePtr oldNode = progeny_[i];
+        if (not oldNode)
+            return NodePtr(this);
+
+        size_t oldSize = oldNode->size();
+        NodePtr node = oldNode->remove(shift + chunkBits, hash, key, edit);
+        if (node == oldNode and node->size() == oldSize)
+        {
+            return NodePtr(this);
+        }
+        else if (node and node->size() > 0)
         {
-            return NodePtr(new ArrayNode(arrayUpdate(progeny_, 32, i, node),
-                                         size() - 1));
+            return withChild(i, node, size() - 1, edit);
         }
         else
         {
             indexType count = 0;
-            for (indexType j = 0; j < 32; ++j)
+            for (indexType j = 0; j < fanout; ++j)
             {
                 if (j != i and progeny_[j])
                     ++count;
             }
-            if (count <= 8)
+            if (count < minArraySize)
             {
-                NodePtr* remaining = new NodePtr[count];
-                hashType bitmap = 0;
+                NodePtr* remaining = newArray<NodePtr>(count);
+                bitmapType bitmap = 0;
                 indexType k = 0;
-                for (indexType j = 0; j < 32; ++j)
+                for (indexType j = 0; j < fanout; ++j)
                 {
                     if (j != i and progeny_[j])
                     {
-                        bitmap |= 1 << j;
+                        bitmap |= bitmapType(1) << j;
                         remaining[k] = progeny_[j];
                         ++k;
                     }
                 }
                 return NodePtr(new BitmappedNode<Key, Val>(
-                                   bitmap, remaining, size() - 1));
+                                   bitmap, remaining, size() - 1, edit));
             }
             else
             {
-                return NodePtr(new ArrayNode(
-                                   arrayUpdate(progeny_, 32, i, NodePtr()),
-                                   size() - 1));
+                return withChild(i, NodePtr(), size() - 1, edit);
             }
         }
     }
 
-    std::string asString() const
+    size_t nrSlots() const { return fanout; }
+
+    Node<Key, Val> const* child(size_t const i) const
     {
-        std::stringstream ss;
-        ss << "[";
-        int j = 0;
-        for (int i = 0; i < 32; ++i)
-        {
-            if (progeny_[i])
-            {
-                if (j > 0)
-                    ss << ", ";
-                ss << i << ": " << progeny_[i]->asString();
-                ++j;
-            }
-        }
-        ss << "]";
-        return ss.str();
+        return progeny_[i].get();
+    }
+
+    Node<Key, Val> const* childFor(indexType const shift,
+                                   hashType  const hash) const
+    {
+        return progeny_[masked(hash, shift)].get();
+    }
+
+    void prefetchChildFor(indexType const shift, hashType const hash) const
+    {
+        prefetch(&progeny_[masked(hash, shift)]);
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        usage.arrays += sizeof(*this);
+        usage.childArrays += fanout * sizeof(NodePtr);
+    }
+
+    void getChildren(NodePtr* const slots) const
+    {
+        for (indexType i = 0; i < fanout; ++i)
+            slots[i] = progeny_[i];
+    }
+
+    void getChildren(Node<Key, Val> const** const slots) const
+    {
+        for (indexType i = 0; i < fanout; ++i)
+            slots[i] = progeny_[i].get();
+    }
+
+    std::string asString() const
+    {
+        std::stringstream ss;
+        ss << "[";
+        int j = 0;
+        for (int i = 0; i < fanout; ++i)
+        {
+            if (progeny_[i])
+            {
+                if (j > 0)
+                    ss << ", ";
+                ss << i << ": " << progeny_[i]->asString();
+                ++j;
+            }
+        }
+        ss << "]";
+        return ss.str();
     }
         
 private:
-    NodePtr const* progeny_;
-    size_t const size_;
+    NodePtr* progeny_;
+    size_t size_;
+    editType const edit_;
+
+    // A child returned itself from update(). It may still have been edited
+    // in place, so its content hash may have changed.
+    NodePtr unchanged(editType const edit)
+    {
+        if (isEditable(edit_, edit))
+            this->rehash(progeny_, fanout);
+        return NodePtr(this);
+    }
+
+    NodePtr withChild(indexType const i,
+                      NodePtr   const node,
+                      size_t    const newSize,
+                      editType  const edit)
+    {
+        if (isEditable(edit_, edit))
+        {
+            progeny_[i] = node;
+            size_ = newSize;
+            this->rehash(progeny_, fanout);
+            return NodePtr(this);
+        }
+        else
+        {
+            return NodePtr(new ArrayNode(arrayUpdate(progeny_, fanout, i, node),
+                                         newSize, edit));
+        }
+    }
 };
 
 // ----------------------------------------------------------------------------
@@ -405,129 +1086,261 @@ private:
 template<typename Key, typename Val>
 struct BitmappedNode : public Node<Key, Val>
 {
-    typename Node<Key, Val>::ValPtr  typedef ValPtr;
     typename Node<Key, Val>::NodePtr typedef NodePtr;
 
-    BitmappedNode()
+    BitmappedNode(editType const edit)
         : bitmap_(0),
+          capacity_(0),
           progeny_(0),
-          size_(0)
+          size_(0),
+          edit_(edit)
     {
     }
 
-    BitmappedNode(hashType const bitmap,
-                  NodePtr const* progeny,
-                  size_t const size)
+    BitmappedNode(bitmapType const bitmap,
+                  NodePtr* progeny,
+                  size_t const size,
+                  editType const edit)
         : bitmap_(bitmap),
+          capacity_(bitCount(bitmap)),
           progeny_(progeny),
-          size_(size)
+          size_(size),
+          edit_(edit)
     {
+        this->rehash(progeny_, bitCount(bitmap_));
     }
 
     ~BitmappedNode()
     {
-        delete[] progeny_;
+        deleteArray(progeny_, capacity_);
     }
 
     size_t size() const { return size_; }
 
     bool isLeaf() const { return false; }
 
-    ValPtr get(indexType const shift,
-               hashType  const hash,
-               Key       const key) const
+    Val const* find(indexType const  shift,
+                    hashType  const  hash,
+                    Key       const& key) const
     {
-        hashType bit = maskBit(hash, shift);
+        bitmapType bit = maskBit(hash, shift);
         if ((bitmap_ & bit) != 0)
         {
             indexType i = indexForBit(bitmap_, bit);
-            return progeny_[i]->get(shift + 5, hash, key);
+            return progeny_[i]->find(shift + chunkBits, hash, key);
         }
         else
         {
-            return ValPtr();
+            return 0;
         }
     }
 
     NodePtr insert(indexType const shift,
                    hashType  const hash,
-                   NodePtr   const leaf) const
+                   NodePtr   const leaf,
+                   editType  const edit)
     {
-        hashType bit = maskBit(hash, shift);
+        bitmapType bit = maskBit(hash, shift);
         indexType i = indexForBit(bitmap_, bit);
         indexType nrBits = bitCount(bitmap_);
         
-        if ((bitmap_ & bit) == 0 && nrBits >= 16)
+        if ((bitmap_ & bit) == 0 && nrBits >= maxBitmappedSize)
         {
-            NodePtr* newArray = new NodePtr[32];
+            NodePtr* expanded = newArray<NodePtr>(fanout);
             size_t newSize = size() + leaf->size();
-            for (int j = 0; j < 32; ++j)
+            for (int j = 0; j < fanout; ++j)
             {
-                hashType b = 1 << j;
+                bitmapType b = bitmapType(1) << j;
                 if ((bitmap_ & b) != 0)
-                    newArray[j] = progeny_[indexForBit(bitmap_, b)];
+                    expanded[j] = progeny_[indexForBit(bitmap_, b)];
             }
-            newArray[masked(hash, shift)] = leaf;
-            return NodePtr(new ArrayNode<Key, Val>(newArray, newSize));
+            expanded[masked(hash, shift)] = leaf;
+            return NodePtr(new ArrayNode<Key, Val>(expanded, newSize, edit));
         }
-        else
+        else if ((bitmap_ & bit) == 0)
         {
-            NodePtr const* newArray;
-            size_t newSize;
+            size_t newSize = size() + leaf->size();
 
-            if ((bitmap_ & bit) == 0)
+            if (isEditable(edit_, edit))
             {
-                newArray = arrayInsert(progeny_, nrBits, i, leaf);
-                newSize = size() + leaf->size();
+                // Transient nodes grow their arrays geometrically and fill
+                // them in place.
+                if (nrBits >= capacity_)
+                {
+                    indexType newCapacity = nrBits < 2 ? 2 : 2 * nrBits;
+                    if (newCapacity > maxBitmappedSize)
+                        newCapacity = maxBitmappedSize;
+                    NodePtr* grown = newArray<NodePtr>(newCapacity);
+                    for (indexType j = 0; j < nrBits; ++j)
+                        grown[j] = progeny_[j];
+                    deleteArray(progeny_, capacity_);
+                    progeny_ = grown;
+                    capacity_ = newCapacity;
+                }
+                for (indexType j = nrBits; j > i; --j)
+                    progeny_[j] = progeny_[j - 1];
+                progeny_[i] = leaf;
+                bitmap_ |= bit;
+                size_ = newSize;
+                this->rehash(progeny_, nrBits + 1);
+                return NodePtr(this);
             }
             else
             {
-                NodePtr oldNode = progeny_[i];
-                NodePtr newNode = oldNode->insert(shift + 5, hash, leaf);
-                newArray = arrayUpdate(progeny_, nrBits, i, newNode);
-                newSize = size() + newNode->size() - oldNode->size();
+                return NodePtr(new BitmappedNode(
+                                   bitmap_ | bit,
+                                   arrayInsert(progeny_, nrBits, i, leaf),
+                                   newSize,
+                                   edit));
             }
-            return NodePtr(new BitmappedNode(bitmap_ | bit, newArray, newSize));
+        }
+        else
+        {
+            NodePtr oldNode = progeny_[i];
+            size_t oldSize = oldNode->size();
+            NodePtr newNode =
+                oldNode->insert(shift + chunkBits, hash, leaf, edit);
+            return withChild(i, newNode, size() + newNode->size() - oldSize,
+                             edit);
         }
     }
 
-    NodePtr remove(indexType const shift,
-                   hashType  const hash,
-                   Key       const key) const
+    NodePtr update(indexType        const  shift,
+                   hashType         const  hash,
+                   Key              const& key,
+                   Update<Key, Val> const& change,
+                   editType         const  edit)
+    {
+        bitmapType bit = maskBit(hash, shift);
+        if ((bitmap_ & bit) == 0)
+        {
+            NodePtr leaf = change.leaf(NodePtr());
+            if (not leaf)
+                return NodePtr(this);
+            else
+                return insert(shift, hash, leaf, edit);
+        }
+        else
+        {
+            indexType i = indexForBit(bitmap_, bit);
+            NodePtr oldNode = progeny_[i];
+            size_t oldSize = oldNode->size();
+            NodePtr newNode =
+                oldNode->update(shift + chunkBits, hash, key, change, edit);
+            if (newNode == oldNode and newNode->size() == oldSize)
+                return unchanged(edit);
+            else
+                return withChild(i, newNode,
+                                 size() + newNode->size() - oldSize, edit);
+        }
+    }
+
+    NodePtr remove(indexType const  shift,
+                   hashType  const  hash,
+                   Key       const& key,
+                   editType  const  edit)
     {
-        hashType bit = maskBit(hash, shift);
+        bitmapType bit = maskBit(hash, shift);
+        if ((bitmap_ & bit) == 0)
+            return NodePtr(this);
+
         indexType i = indexForBit(bitmap_, bit);
+        indexType nrBits = bitCount(bitmap_);
         NodePtr v = progeny_[i];
-        NodePtr node = v->remove(shift + 5, hash, key);
-
-        hashType newBitmap;
-        size_t   newSize;
-        NodePtr const*  newArray;
+        size_t oldSize = v->size();
+        NodePtr node = v->remove(shift + chunkBits, hash, key, edit);
 
-        if (node and node->size() > 0)
+        if (node == v and node->size() == oldSize)
+        {
+            return NodePtr(this);
+        }
+        else if (node and node->size() > 0)
         {
-            newBitmap = bitmap_;
-            newSize   = size() + node->size() - v->size();
-            newArray  = arrayUpdate(progeny_, bitCount(bitmap_), i, node);
+            if (nrBits == 1 and node->isLeaf())
+                return node;
+            else
+                return withChild(i, node, size() + node->size() - oldSize,
+                                 edit);
         }
         else
         {
-            newBitmap = bitmap_ ^ bit;
-            newSize   = size() - 1;
-            newArray  = arrayRemove(progeny_, bitCount(bitmap_), i);
+            assert(nrBits > 1);
+            if (nrBits == 2 and progeny_[1 - i]->isLeaf())
+            {
+                return progeny_[1 - i];
+            }
+            else if (isEditable(edit_, edit))
+            {
+                for (indexType j = i + 1; j < nrBits; ++j)
+                    progeny_[j - 1] = progeny_[j];
+                progeny_[nrBits - 1] = NodePtr();
+                bitmap_ ^= bit;
+                size_ = size() - 1;
+                this->rehash(progeny_, nrBits - 1);
+                return NodePtr(this);
+            }
+            else
+            {
+                return NodePtr(new BitmappedNode(
+                                   bitmap_ ^ bit,
+                                   arrayRemove(progeny_, nrBits, i),
+                                   size() - 1,
+                                   edit));
+            }
         }
+    }
+
+    size_t nrSlots() const { return bitCount(bitmap_); }
+
+    Node<Key, Val> const* child(size_t const i) const
+    {
+        return progeny_[i].get();
+    }
+
+    Node<Key, Val> const* childFor(indexType const shift,
+                                   hashType  const hash) const
+    {
+        bitmapType const bit = maskBit(hash, shift);
+        if ((bitmap_ & bit) != 0)
+            return progeny_[indexForBit(bitmap_, bit)].get();
+        else
+            return 0;
+    }
+
+    void prefetchChildFor(indexType const shift, hashType const hash) const
+    {
+        prefetch(&progeny_[indexForBit(bitmap_, maskBit(hash, shift))]);
+    }
+
+    void addMemoryUsage(MemoryUsage& usage) const
+    {
+        usage.bitmapped += sizeof(*this);
+        usage.childArrays += capacity_ * sizeof(NodePtr);
+    }
 
-        indexType nrBits = bitCount(newBitmap);
-        assert(nrBits > 0);
-        if (nrBits == 1 and newArray[0]->isLeaf())
+    void getChildren(NodePtr* const slots) const
+    {
+        indexType j = 0;
+        for (indexType i = 0; i < fanout; ++i)
         {
-            NodePtr result = newArray[0];
-            delete[] newArray;
-            return result;
+            if (bitmap_ & (bitmapType(1) << i))
+            {
+                slots[i] = progeny_[j];
+                ++j;
+            }
         }
-        else
+    }
+
+    void getChildren(Node<Key, Val> const** const slots) const
+    {
+        indexType j = 0;
+        for (indexType i = 0; i < fanout; ++i)
         {
-            return NodePtr(new BitmappedNode(newBitmap, newArray, newSize));
+            if (bitmap_ & (bitmapType(1) << i))
+            {
+                slots[i] = progeny_[j].get();
+                ++j;
+            }
         }
     }
 
@@ -535,9 +1348,9 @@ struct BitmappedNode : public Node<Key, Val>
     {
         std::stringstream ss;
         ss << "{";
-        for (int i = 0; i < 32; ++i)
+        for (int i = 0; i < fanout; ++i)
         {
-            hashType bit = 1 << i;
+            bitmapType bit = bitmapType(1) << i;
             if (bitmap_ & bit)
             {
                 indexType j = indexForBit(bitmap_, bit);
@@ -551,11 +1364,1211 @@ struct BitmappedNode : public Node<Key, Val>
     }
         
 private:
-    hashType const bitmap_;
-    NodePtr const* progeny_;
-    size_t const size_;
+    bitmapType bitmap_;
+    indexType capacity_;
+    NodePtr* progeny_;
+    size_t size_;
+    editType const edit_;
+
+    // A child returned itself from update(). It may still have been edited
+    // in place, so its content hash may have changed.
+    NodePtr unchanged(editType const edit)
+    {
+        if (isEditable(edit_, edit))
+            this->rehash(progeny_, bitCount(bitmap_));
+        return NodePtr(this);
+    }
+
+    NodePtr withChild(indexType const i,
+                      NodePtr   const node,
+                      size_t    const newSize,
+                      editType  const edit)
+    {
+        if (isEditable(edit_, edit))
+        {
+            progeny_[i] = node;
+            size_ = newSize;
+            this->rehash(progeny_, bitCount(bitmap_));
+            return NodePtr(this);
+        }
+        else
+        {
+            NodePtr* const progeny =
+                arrayUpdate(progeny_, bitCount(bitmap_), i, node);
+            return NodePtr(new BitmappedNode(bitmap_, progeny, newSize, edit));
+        }
+    }
+};
+
+// ----------------------------------------------------------------------------
+// A cursor visits the leaves of a trie in depth-first order. The path to the
+// current leaf is kept on a fixed-size stack of plain pointers, so moving the
+// cursor neither allocates nor touches reference counts. It must not outlive
+// the trie it walks.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+class TrieCursor
+{
+public:
+    typedef Node<Key, Val> NodeType;
+
+    TrieCursor()
+        : depth_(0),
+          leaf_(0)
+    {
+    }
+
+    explicit TrieCursor(NodeType const* const root)
+        : depth_(0),
+          leaf_(0)
+    {
+        if (root)
+        {
+            enter(root);
+            if (not leaf_)
+                advance();
+        }
+    }
+
+    // The current leaf, or 0 when the traversal is complete.
+    NodeType const* leaf() const { return leaf_; }
+
+    void advance()
+    {
+        leaf_ = 0;
+        while (depth_ > 0)
+        {
+            indexType const top = depth_ - 1;
+            if (next_[top] >= ends_[top])
+            {
+                --depth_;
+            }
+            else
+            {
+                NodeType const* node = nodes_[top]->child(next_[top]);
+                ++next_[top];
+                if (node)
+                {
+                    enter(node);
+                    if (leaf_)
+                        return;
+                }
+            }
+        }
+    }
+
+private:
+    NodeType const* nodes_[maxDepth];
+    size_t next_[maxDepth];
+    size_t ends_[maxDepth];
+    indexType depth_;
+    NodeType const* leaf_;
+
+    void enter(NodeType const* const node)
+    {
+        size_t const n = node->nrSlots();
+        if (n == 0)
+        {
+            leaf_ = node;
+        }
+        else
+        {
+            assert(depth_ < maxDepth);
+            nodes_[depth_] = node;
+            next_[depth_] = 0;
+            ends_[depth_] = n;
+            ++depth_;
+        }
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Assembles a node from a complete array of child slots, indexed by the hash
+// chunk at the node's level. Empty slots are allowed. A single leaf child
+// is returned as it is, and no children give an empty pointer. An array node
+// is made if there are at least arrayFrom children.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+nodeFromChildren(typename Node<Key, Val>::NodePtr const* children,
+                 indexType const arrayFrom = maxBitmappedSize + 1)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    bitmapType bitmap = 0;
+    size_t size = 0;
+    for (indexType i = 0; i < fanout; ++i)
+    {
+        if (children[i])
+        {
+            bitmap |= bitmapType(1) << i;
+            size += children[i]->size();
+        }
+    }
+
+    indexType nrBits = bitCount(bitmap);
+    if (nrBits == 0)
+    {
+        return NodePtr();
+    }
+    else if (nrBits >= arrayFrom)
+    {
+        NodePtr* progeny = newArray<NodePtr>(fanout);
+        for (indexType i = 0; i < fanout; ++i)
+            progeny[i] = children[i];
+        return NodePtr(new ArrayNode<Key, Val>(progeny, size, 0));
+    }
+    else
+    {
+        NodePtr* progeny = newArray<NodePtr>(nrBits);
+        indexType k = 0;
+        for (indexType i = 0; i < fanout; ++i)
+        {
+            if (children[i])
+            {
+                progeny[k] = children[i];
+                ++k;
+            }
+        }
+        if (nrBits == 1 and progeny[0]->isLeaf())
+        {
+            NodePtr result = progeny[0];
+            deleteArray(progeny, nrBits);
+            return result;
+        }
+        else
+        {
+            return NodePtr(
+                new BitmappedNode<Key, Val>(bitmap, progeny, size, 0));
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Bulk construction from a range of entries. The entries are partitioned by
+// the hash bits that select the root slot, the subtries below the root are
+// built concurrently, each as a transient with its own edit token, and the
+// results are assembled directly into a root node.
+//
+// The Maker argument supplies the static function templates
+//     hashType hash(Iter)            and
+//     NodePtr  leaf(hashType, Iter)
+// which compute the hash code and construct a leaf node for an entry.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val, typename Iter, typename Maker>
+struct SubtrieBuilder
+{
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+    typedef std::vector<std::pair<hashType, Iter> > Bucket;
+
+    SubtrieBuilder(Bucket const* bucket, NodePtr* result)
+        : bucket_(bucket),
+          result_(result),
+          edit_(newEditToken())
+    {
+    }
+
+    void operator()() const
+    {
+        NodePtr root;
+        for (typename Bucket::const_iterator iter = bucket_->begin();
+             iter != bucket_->end();
+             ++iter)
+        {
+            NodePtr leaf = Maker::leaf(iter->first, iter->second);
+            if (root)
+                root = root->insert(chunkBits, iter->first, leaf, edit_);
+            else
+                root = leaf;
+        }
+        *result_ = root;
+    }
+
+private:
+    Bucket const* bucket_;
+    NodePtr* result_;
+    editType edit_;
+};
+
+template<typename Key, typename Val, typename Maker, typename Iter>
+typename Node<Key, Val>::NodePtr
+buildInParallel(Iter const begin, Iter const end)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+    typedef SubtrieBuilder<Key, Val, Iter, Maker> Builder;
+
+    std::vector<typename Builder::Bucket> buckets(fanout);
+    size_t count = 0;
+    for (Iter iter = begin; iter != end; ++iter)
+    {
+        hashType hash = Maker::hash(iter);
+        buckets[masked(hash, 0)].push_back(std::make_pair(hash, iter));
+        ++count;
+    }
+
+    NodePtr children[fanout];
+    boost::thread_group threads;
+    for (indexType i = 0; i < fanout; ++i)
+    {
+        if (not buckets[i].empty())
+        {
+            Builder builder(&buckets[i], &children[i]);
+            if (count < parallelThreshold)
+                builder();
+            else
+                threads.create_thread(builder);
+        }
+    }
+    threads.join_all();
+
+    return nodeFromChildren<Key, Val>(children);
+}
+
+// ----------------------------------------------------------------------------
+// Structural set operations on the keys of two tries. Both tries are
+// descended in step from the given level. Subtrees that the two sides share
+// are handled in constant time, and inputs are returned unchanged wherever
+// possible, so that the work is proportional to the parts that differ. Where
+// a key occurs in both tries, either leaf may end up in the result.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr sharedNode(Node<Key, Val> const* const node)
+{
+    return typename Node<Key, Val>::NodePtr(const_cast<Node<Key, Val>*>(node));
+}
+
+// A leaf or collision node counts as a bucket of one or more leaves.
+template<typename Key, typename Val>
+size_t nrLeaves(Node<Key, Val> const* const bucket)
+{
+    return bucket->nrSlots() == 0 ? 1 : bucket->nrSlots();
+}
+
+template<typename Key, typename Val>
+Node<Key, Val> const* leafAt(Node<Key, Val> const* const bucket,
+                             size_t const i)
+{
+    return bucket->nrSlots() == 0 ? bucket : bucket->child(i);
+}
+
+template<typename Key, typename Val>
+bool containsLeafKey(typename Node<Key, Val>::NodePtr const node,
+                     indexType const shift,
+                     Node<Key, Val> const* const leaf)
+{
+    return node and node->find(shift, leaf->hash(), leaf->key()) != 0;
+}
+
+// Stores a given leaf for its key, or keeps the existing one.
+template<typename Key, typename Val>
+struct StoreLeaf : public Update<Key, Val>
+{
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    StoreLeaf(NodePtr const leaf, bool const replace)
+        : leaf_(leaf),
+          replace_(replace)
+    {
+    }
+
+    NodePtr leaf(NodePtr const current) const
+    {
+        return (current and not replace_) ? current : leaf_;
+    }
+
+private:
+    NodePtr const leaf_;
+    bool const replace_;
 };
 
+// The leaves of a bucket whose keys are (or are not) in another trie.
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+filterBucket(typename Node<Key, Val>::NodePtr const bucket,
+             indexType const shift,
+             typename Node<Key, Val>::NodePtr const other,
+             bool const wanted)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    size_t const n = nrLeaves(bucket.get());
+    size_t kept = 0;
+    NodePtr result;
+    for (size_t i = 0; i < n; ++i)
+    {
+        Node<Key, Val> const* leaf = leafAt(bucket.get(), i);
+        if (containsLeafKey(other, shift, leaf) == wanted)
+        {
+            NodePtr ptr = sharedNode(leaf);
+            result = result ? result->insert(shift, leaf->hash(), ptr, 0) : ptr;
+            ++kept;
+        }
+    }
+    return kept == n ? bucket : result;
+}
+
+// Adds the leaves of a bucket to a trie.
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+addBucket(typename Node<Key, Val>::NodePtr const node,
+          indexType const shift,
+          typename Node<Key, Val>::NodePtr const bucket,
+          bool const replace)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    NodePtr result = node;
+    for (size_t i = 0; i < nrLeaves(bucket.get()); ++i)
+    {
+        Node<Key, Val> const* leaf = leafAt(bucket.get(), i);
+        result = result->update(shift, leaf->hash(), leaf->key(),
+                                StoreLeaf<Key, Val>(sharedNode(leaf), replace),
+                                0);
+    }
+    return result;
+}
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+trieUnion(typename Node<Key, Val>::NodePtr const a,
+          typename Node<Key, Val>::NodePtr const b,
+          indexType const shift)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (a == b or not b)
+        return a;
+    else if (not a)
+        return b;
+    else if (a->isLeaf())
+        return addBucket<Key, Val>(b, shift, a, true);
+    else if (b->isLeaf())
+        return addBucket<Key, Val>(a, shift, b, false);
+
+    NodePtr ca[fanout], cb[fanout], c[fanout];
+    a->getChildren(ca);
+    b->getChildren(cb);
+
+    bool sameAsA = true, sameAsB = true;
+    for (indexType i = 0; i < fanout; ++i)
+    {
+        c[i] = trieUnion<Key, Val>(ca[i], cb[i], shift + chunkBits);
+        sameAsA = sameAsA and c[i] == ca[i];
+        sameAsB = sameAsB and c[i] == cb[i];
+    }
+
+    if (sameAsA)
+        return a;
+    else if (sameAsB)
+        return b;
+    else
+        return nodeFromChildren<Key, Val>(c);
+}
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+trieIntersection(typename Node<Key, Val>::NodePtr const a,
+                 typename Node<Key, Val>::NodePtr const b,
+                 indexType const shift)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (a == b)
+        return a;
+    else if (not a or not b)
+        return NodePtr();
+    else if (a->isLeaf())
+        return filterBucket<Key, Val>(a, shift, b, true);
+    else if (b->isLeaf())
+        return filterBucket<Key, Val>(b, shift, a, true);
+
+    NodePtr ca[fanout], cb[fanout], c[fanout];
+    a->getChildren(ca);
+    b->getChildren(cb);
+
+    bool sameAsA = true, sameAsB = true;
+    for (indexType i = 0; i < fanout; ++i)
+    {
+        c[i] = trieIntersection<Key, Val>(ca[i], cb[i], shift + chunkBits);
+        sameAsA = sameAsA and c[i] == ca[i];
+        sameAsB = sameAsB and c[i] == cb[i];
+    }
+
+    if (sameAsA)
+        return a;
+    else if (sameAsB)
+        return b;
+    else
+        return nodeFromChildren<Key, Val>(c);
+}
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+trieDifference(typename Node<Key, Val>::NodePtr const a,
+               typename Node<Key, Val>::NodePtr const b,
+               indexType const shift)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (a == b or not a)
+        return NodePtr();
+    else if (not b)
+        return a;
+    else if (a->isLeaf())
+        return filterBucket<Key, Val>(a, shift, b, false);
+    else if (b->isLeaf())
+    {
+        NodePtr result = a;
+        for (size_t i = 0; result and i < nrLeaves(b.get()); ++i)
+        {
+            Node<Key, Val> const* leaf = leafAt(b.get(), i);
+            result = result->remove(shift, leaf->hash(), leaf->key(), 0);
+        }
+        return result;
+    }
+
+    NodePtr ca[fanout], cb[fanout], c[fanout];
+    a->getChildren(ca);
+    b->getChildren(cb);
+
+    bool sameAsA = true;
+    for (indexType i = 0; i < fanout; ++i)
+    {
+        c[i] = trieDifference<Key, Val>(ca[i], cb[i], shift + chunkBits);
+        sameAsA = sameAsA and c[i] == ca[i];
+    }
+
+    if (sameAsA)
+        return a;
+    else
+        return nodeFromChildren<Key, Val>(c);
+}
+
+template<typename Key, typename Val>
+bool trieIsSubset(typename Node<Key, Val>::NodePtr const a,
+                  typename Node<Key, Val>::NodePtr const b,
+                  indexType const shift)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (a == b or not a)
+        return true;
+    else if (not b or a->size() > b->size())
+        return false;
+    else if (a->isLeaf() or b->isLeaf())
+    {
+        for (TrieCursor<Key, Val> c(a.get()); c.leaf(); c.advance())
+            if (not containsLeafKey(b, shift, c.leaf()))
+                return false;
+        return true;
+    }
+
+    NodePtr ca[fanout], cb[fanout];
+    a->getChildren(ca);
+    b->getChildren(cb);
+
+    for (indexType i = 0; i < fanout; ++i)
+        if (not trieIsSubset<Key, Val>(ca[i], cb[i], shift + chunkBits))
+            return false;
+    return true;
+}
+
+// ----------------------------------------------------------------------------
+// The entry matching a probe in a leaf or collision node, or 0.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val, typename Probe>
+Node<Key, Val> const* matchLeaf(Node<Key, Val> const* const node,
+                                Probe                 const& probe)
+{
+    if (node == 0)
+        return 0;
+    else if (node->nrSlots() == 0)
+        return node->key() == probe ? node : 0;
+
+    for (size_t i = 0; i < node->nrSlots(); ++i)
+        if (node->child(i)->key() == probe)
+            return node->child(i);
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Finds the leaf for a key from any probe value that compares equal to that
+// key with ==, given the key's hash code, and returns 0 if there is none.
+// This allows lookups without building a key, e.g. by a char const* in a
+// trie with std::string keys.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val, typename Probe>
+Node<Key, Val> const* findLeaf(Node<Key, Val> const* node,
+                               hashType       const  hash,
+                               Probe          const& probe)
+{
+    for (indexType shift = 0; node and not node->isLeaf(); shift += chunkBits)
+        node = node->childFor(shift, hash);
+
+    return matchLeaf(node, probe);
+}
+
+// ----------------------------------------------------------------------------
+// Hash codes for lookups by probe. By default, a probe is converted to a key
+// for the trie's hash function. To look up by probes of another type without
+// building keys, specialize this for the hash function, with a hash() that
+// takes the probe type and agrees with the hash function on equal keys:
+//
+//   template<>
+//   struct ProbeHash<std::string, hashString>
+//   {
+//       static hashType hash(char const* const s) { ... }
+//   };
+// ----------------------------------------------------------------------------
+
+template<typename Key, hashType (*hashFunc)(Key const)>
+struct ProbeHash
+{
+    static hashType hash(Key const& key)
+    {
+        return hashFunc(key);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Looks up a batch of keys with known hash codes, storing the leaf for each
+// one, or 0, in the corresponding place of leaves. Instead of following one
+// path down to the end before starting the next, all lookups in a group take
+// one step at a time. Each step first prefetches what the nodes reached so
+// far will read to find their children, then moves on to those children and
+// prefetches them, so the cache misses of independent lookups overlap.
+// ----------------------------------------------------------------------------
+
+size_t const lookupGroupSize = 32;
+
+template<typename Key, typename Val, typename Probe>
+void findLeaves(Node<Key, Val> const*  const root,
+                Probe const*           const probes,
+                hashType const*        const hashes,
+                size_t                 const n,
+                Node<Key, Val> const** const leaves)
+{
+    for (size_t start = 0; start < n; start += lookupGroupSize)
+    {
+        size_t const m = std::min(lookupGroupSize, n - start);
+        Node<Key, Val> const** const nodes = leaves + start;
+        hashType const* const h = hashes + start;
+
+        for (size_t k = 0; k < m; ++k)
+            nodes[k] = root;
+
+        bool active = true;
+        for (indexType shift = 0; active; shift += chunkBits)
+        {
+            for (size_t k = 0; k < m; ++k)
+                if (nodes[k] and not nodes[k]->isLeaf())
+                    nodes[k]->prefetchChildFor(shift, h[k]);
+
+            active = false;
+            for (size_t k = 0; k < m; ++k)
+            {
+                if (nodes[k] and not nodes[k]->isLeaf())
+                {
+                    nodes[k] = nodes[k]->childFor(shift, h[k]);
+                    prefetch(nodes[k]);
+                    active = true;
+                }
+            }
+        }
+
+        for (size_t k = 0; k < m; ++k)
+            nodes[k] = matchLeaf(nodes[k], probes[start + k]);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Reports the differences between two tries to a visitor with the methods
+//     added(Key const&, Val const&)
+//     removed(Key const&, Val const&)
+//     changed(Key const&, Val const& before, Val const& after)
+// Subtrees the two tries share are skipped without looking inside, so the
+// cost depends on the number of changes rather than the size of the tries.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+Val const& leafValue(Node<Key, Val> const* const leaf)
+{
+    return *leaf->find(0, leaf->hash(), leaf->key());
+}
+
+template<typename Key, typename Val, typename Visitor>
+void trieDiff(Node<Key, Val> const* const before,
+              Node<Key, Val> const* const after,
+              indexType const shift,
+              Visitor& visitor)
+{
+    typedef Node<Key, Val> NodeType;
+    typedef TrieCursor<Key, Val> Cursor;
+
+    if (before == after)
+    {
+        return;
+    }
+    else if (before and after and not before->isLeaf() and not after->isLeaf())
+    {
+        NodeType const* cb[fanout] = { 0 };
+        NodeType const* ca[fanout] = { 0 };
+        before->getChildren(cb);
+        after->getChildren(ca);
+        for (indexType i = 0; i < fanout; ++i)
+            trieDiff<Key, Val>(cb[i], ca[i], shift + chunkBits, visitor);
+    }
+    else
+    {
+        // One side is empty, a leaf or a collision bucket, so we compare the
+        // two subtrees entry by entry.
+        for (Cursor c(before); c.leaf(); c.advance())
+        {
+            NodeType const* leaf = c.leaf();
+            Val const* val =
+                after ? after->find(shift, leaf->hash(), leaf->key()) : 0;
+            if (val == 0)
+                visitor.removed(leaf->key(), leafValue(leaf));
+            else if (*val != leafValue(leaf))
+                visitor.changed(leaf->key(), leafValue(leaf), *val);
+        }
+        for (Cursor c(after); c.leaf(); c.advance())
+        {
+            NodeType const* leaf = c.leaf();
+            Val const* val =
+                before ? before->find(shift, leaf->hash(), leaf->key()) : 0;
+            if (val == 0)
+                visitor.added(leaf->key(), leafValue(leaf));
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Tests whether two tries hold the same entries. Shared subtrees are equal
+// without looking inside, and with content hashes enabled, subtrees with
+// different hashes are told apart without looking inside.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+bool trieEqual(Node<Key, Val> const* const a,
+               Node<Key, Val> const* const b,
+               indexType const shift)
+{
+    typedef Node<Key, Val> NodeType;
+
+    if (a == b)
+        return true;
+    else if (not a or not b or a->size() != b->size())
+        return false;
+#ifdef ODF_HASH_TRIE_MERKLE
+    else if (a->contentHash() != b->contentHash())
+        return false;
+#endif
+    else if (not a->isLeaf() and not b->isLeaf())
+    {
+        NodeType const* ca[fanout] = { 0 };
+        NodeType const* cb[fanout] = { 0 };
+        a->getChildren(ca);
+        b->getChildren(cb);
+        for (indexType i = 0; i < fanout; ++i)
+            if (not trieEqual<Key, Val>(ca[i], cb[i], shift + chunkBits))
+                return false;
+        return true;
+    }
+    else
+    {
+        // Both sides have the same size, so it suffices to find each entry
+        // of one in the other.
+        for (TrieCursor<Key, Val> c(a); c.leaf(); c.advance())
+        {
+            NodeType const* leaf = c.leaf();
+            Val const* val = b->find(shift, leaf->hash(), leaf->key());
+            if (val == 0 or *val != leafValue(leaf))
+                return false;
+        }
+        return true;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Leaf-by-leaf rewriting of a trie. Given a leaf, a transform returns it as
+// it is, a replacement with the same key and hash code, or an empty pointer
+// to drop it. The result has the same shape as the input wherever the sizes
+// allow, and subtrees in which no leaf changed are returned as they are.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+struct Transform
+{
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    virtual ~Transform() {}
+
+    virtual NodePtr leaf(Node<Key, Val> const* const current) const = 0;
+};
+
+// Builds an inner node in place of the given one from the new children. An
+// array node stays an array node unless it would be demoted on removal.
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+rebuildInner(Node<Key, Val> const* const original,
+             typename Node<Key, Val>::NodePtr const* const children)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    NodePtr old[fanout];
+    original->getChildren(old);
+
+    bool same = true;
+    for (indexType i = 0; same and i < fanout; ++i)
+        same = children[i] == old[i];
+
+    if (same)
+        return sharedNode(original);
+    else if (dynamic_cast<ArrayNode<Key, Val> const*>(original))
+        return nodeFromChildren<Key, Val>(children, minArraySize);
+    else
+        return nodeFromChildren<Key, Val>(children, fanout + 1);
+}
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+trieTransform(Node<Key, Val> const* const node,
+              indexType const shift,
+              Transform<Key, Val> const& transform)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (node->nrSlots() == 0)
+    {
+        return transform.leaf(node);
+    }
+    else if (node->isLeaf())
+    {
+        NodePtr result;
+        bool same = true;
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+        {
+            Node<Key, Val> const* leaf = node->child(i);
+            NodePtr next = transform.leaf(leaf);
+            same = same and next.get() == leaf;
+            if (next and result)
+                result = result->insert(shift, next->hash(), next, 0);
+            else if (next)
+                result = next;
+        }
+        return same ? sharedNode(node) : result;
+    }
+    else
+    {
+        Node<Key, Val> const* old[fanout] = { 0 };
+        node->getChildren(old);
+
+        NodePtr children[fanout];
+        for (indexType i = 0; i < fanout; ++i)
+            if (old[i])
+                children[i] =
+                    trieTransform(old[i], shift + chunkBits, transform);
+
+        return rebuildInner(node, children);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Parallel traversals. The subtrees a fixed number of levels below the root
+// form a frontier, which is processed as a set of independent tasks on a
+// work-stealing pool. The levels above the frontier are then put together
+// sequentially, visiting the frontier in the same order. The leaf functions
+// must be safe to call from several threads at once.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+struct Frontier
+{
+    // Each subtree, with the shift at its level.
+    std::vector<std::pair<Node<Key, Val> const*, indexType> > subtrees;
+
+    Frontier(Node<Key, Val> const* const root, indexType const cut)
+    {
+        collect(root, 0, cut);
+    }
+
+private:
+    void collect(Node<Key, Val> const* const node,
+                 indexType const shift,
+                 indexType const cut)
+    {
+        if (shift >= cut or node->isLeaf())
+        {
+            subtrees.push_back(std::make_pair(node, shift));
+        }
+        else
+        {
+            Node<Key, Val> const* children[fanout] = { 0 };
+            node->getChildren(children);
+            for (indexType i = 0; i < fanout; ++i)
+                if (children[i])
+                    collect(children[i], shift + chunkBits, cut);
+        }
+    }
+};
+
+// Picks the frontier level and thread count for a trie. A single thread
+// means the work is not worth splitting.
+template<typename Key, typename Val>
+indexType frontierLevel(Node<Key, Val> const* const root, size_t& nrThreads)
+{
+    if (nrThreads == 0)
+        nrThreads = defaultNrThreads();
+    if (not root or root->size() < parallelThreshold)
+        nrThreads = 1;
+
+    // Aim for several tasks per thread, so that stealing can even out
+    // subtrees of different sizes.
+    return nrThreads * 8 > fanout ? 2 * chunkBits : chunkBits;
+}
+
+template<typename Key, typename Val>
+struct TransformTask
+{
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    TransformTask(Node<Key, Val> const* const node,
+                  indexType const shift,
+                  Transform<Key, Val> const* const transform,
+                  NodePtr* const result)
+        : node_(node),
+          shift_(shift),
+          transform_(transform),
+          result_(result)
+    {
+    }
+
+    void operator()()
+    {
+        *result_ = trieTransform(node_, shift_, *transform_);
+    }
+
+private:
+    Node<Key, Val> const* node_;
+    indexType shift_;
+    Transform<Key, Val> const* transform_;
+    NodePtr* result_;
+};
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+assembleFrontier(Node<Key, Val> const* const node,
+                 indexType const shift,
+                 indexType const cut,
+                 typename Node<Key, Val>::NodePtr const*& results)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+
+    if (shift >= cut or node->isLeaf())
+        return *results++;
+
+    Node<Key, Val> const* old[fanout] = { 0 };
+    node->getChildren(old);
+
+    NodePtr children[fanout];
+    for (indexType i = 0; i < fanout; ++i)
+        if (old[i])
+            children[i] = assembleFrontier(old[i], shift + chunkBits,
+                                           cut, results);
+
+    return rebuildInner(node, children);
+}
+
+template<typename Key, typename Val>
+typename Node<Key, Val>::NodePtr
+parallelTransform(Node<Key, Val> const* const root,
+                  Transform<Key, Val> const& transform,
+                  size_t nrThreads)
+{
+    typedef typename Node<Key, Val>::NodePtr NodePtr;
+    typedef TransformTask<Key, Val> Task;
+
+    if (not root)
+        return NodePtr();
+
+    indexType const cut = frontierLevel(root, nrThreads);
+    if (nrThreads == 1)
+        return trieTransform(root, 0, transform);
+
+    Frontier<Key, Val> const frontier(root, cut);
+    size_t const n = frontier.subtrees.size();
+
+    std::vector<NodePtr> results(n);
+    std::vector<Task> tasks;
+    tasks.reserve(n);
+    for (size_t k = 0; k < n; ++k)
+        tasks.push_back(Task(frontier.subtrees[k].first,
+                             frontier.subtrees[k].second,
+                             &transform,
+                             &results[k]));
+    runWorkStealing(tasks, nrThreads);
+
+    NodePtr const* next = &results[0];
+    return assembleFrontier(root, 0, cut, next);
+}
+
+// Folds the entries of a subtree into a value with the function
+//     T fold(T const& acc, Key const& key, Val const& val)
+template<typename Key, typename Val, typename T, typename Fold>
+struct ReduceTask
+{
+    ReduceTask(Node<Key, Val> const* const node,
+               T const& init,
+               Fold const& fold,
+               T* const result)
+        : node_(node),
+          init_(init),
+          fold_(fold),
+          result_(result)
+    {
+    }
+
+    void operator()()
+    {
+        T acc = init_;
+        for (TrieCursor<Key, Val> c(node_); c.leaf(); c.advance())
+            acc = fold_(acc, c.leaf()->key(), leafValue(c.leaf()));
+        *result_ = acc;
+    }
+
+private:
+    Node<Key, Val> const* node_;
+    T init_;
+    Fold fold_;
+    T* result_;
+};
+
+// The partial results for the frontier subtrees are merged in order with
+//     T combine(T const& a, T const& b)
+// so init must be neutral for combine.
+template<typename Key, typename Val, typename T, typename Fold,
+         typename Combine>
+T parallelReduce(Node<Key, Val> const* const root,
+                 T const& init,
+                 Fold const& fold,
+                 Combine const& combine,
+                 size_t nrThreads)
+{
+    typedef ReduceTask<Key, Val, T, Fold> Task;
+
+    indexType const cut = frontierLevel(root, nrThreads);
+    if (nrThreads == 1)
+    {
+        T result = init;
+        Task(root, init, fold, &result)();
+        return result;
+    }
+
+    Frontier<Key, Val> const frontier(root, cut);
+    size_t const n = frontier.subtrees.size();
+
+    std::vector<T> results(n, init);
+    std::vector<Task> tasks;
+    tasks.reserve(n);
+    for (size_t k = 0; k < n; ++k)
+        tasks.push_back(
+            Task(frontier.subtrees[k].first, init, fold, &results[k]));
+    runWorkStealing(tasks, nrThreads);
+
+    T result = init;
+    for (size_t k = 0; k < n; ++k)
+        result = combine(result, results[k]);
+    return result;
+}
+
+// ----------------------------------------------------------------------------
+// Memory accounting. A single trie is a tree, so its nodes are simply added
+// up. For a collection of tries that share structure, each distinct node is
+// counted once, either as shared if more than one trie reaches it, or
+// against the only trie that does. The latter is what dropping that trie
+// would free, provided nothing else holds on to it.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+void addTrieMemoryUsage(Node<Key, Val> const* const node, MemoryUsage& usage)
+{
+    if (node)
+    {
+        node->addMemoryUsage(usage);
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+            addTrieMemoryUsage(node->child(i), usage);
+    }
+}
+
+struct SharedMemoryUsage
+{
+    // Held by more than one of the tries.
+    MemoryUsage shared;
+
+    // Held by just one, in the order the tries were given.
+    std::vector<MemoryUsage> unique;
+};
+
+template<typename Key, typename Val>
+class MemoryCensus
+{
+public:
+    explicit MemoryCensus(size_t const nrTries)
+        : owners_(),
+          nrTries_(nrTries)
+    {
+    }
+
+    // Records the nodes of the trie with the given index. A node that was
+    // already marked as shared has only shared nodes below it, so it is not
+    // entered again. Every node is thus visited at most twice.
+    void visit(Node<Key, Val> const* const node, size_t const index)
+    {
+        if (not node)
+            return;
+
+        typename Owners::iterator found = owners_.find(node);
+        if (found == owners_.end())
+            owners_.insert(std::make_pair(node, index));
+        else if (found->second == index or found->second == shared())
+            return;
+        else
+            found->second = shared();
+
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+            visit(node->child(i), index);
+    }
+
+    SharedMemoryUsage result() const
+    {
+        SharedMemoryUsage usage;
+        usage.unique.resize(nrTries_);
+        for (typename Owners::const_iterator iter = owners_.begin();
+             iter != owners_.end();
+             ++iter)
+        {
+            if (iter->second == shared())
+                iter->first->addMemoryUsage(usage.shared);
+            else
+                iter->first->addMemoryUsage(usage.unique[iter->second]);
+        }
+        return usage;
+    }
+
+private:
+    boost::unordered_map<Node<Key, Val> const*, size_t> typedef Owners;
+
+    Owners owners_;
+    size_t const nrTries_;
+
+    size_t shared() const { return nrTries_; }
+};
+
+// ----------------------------------------------------------------------------
+// The shape of a trie. With a good hash function, leaves sit at a depth close
+// to the logarithm of the size to the base of the fanout, and collision
+// buckets are rare and small. Deep leaves, large buckets or many sparse nodes
+// point to hash codes that are not spread well.
+// ----------------------------------------------------------------------------
+
+struct TrieStats
+{
+    TrieStats()
+        : depths(),
+          bucketSizes(),
+          nrBitmapped(0),
+          nrBitmappedChildren(0),
+          nrArrays(0),
+          nrSparseArrays(0)
+    {
+    }
+
+    // The number of entries at each depth, counted in inner nodes above.
+    std::vector<size_t> depths;
+
+    // The number of collision nodes with each number of entries.
+    std::vector<size_t> bucketSizes;
+
+    size_t nrBitmapped;
+    size_t nrBitmappedChildren;
+
+    // Array nodes, and those of them with fewer than half their slots used.
+    size_t nrArrays;
+    size_t nrSparseArrays;
+
+    double averageBitmappedPopulation() const
+    {
+        return nrBitmapped ? double(nrBitmappedChildren) / nrBitmapped : 0.0;
+    }
+
+    double averageDepth() const
+    {
+        size_t count = 0, sum = 0;
+        for (size_t d = 0; d < depths.size(); ++d)
+        {
+            count += depths[d];
+            sum += d * depths[d];
+        }
+        return count ? double(sum) / count : 0.0;
+    }
+};
+
+inline void countAt(std::vector<size_t>& histogram, size_t const i,
+                    size_t const n)
+{
+    if (histogram.size() <= i)
+        histogram.resize(i + 1);
+    histogram[i] += n;
+}
+
+template<typename Key, typename Val>
+void addTrieStats(Node<Key, Val> const* const node,
+                  size_t const depth,
+                  TrieStats& stats)
+{
+    if (not node)
+    {
+        return;
+    }
+    else if (node->isLeaf())
+    {
+        countAt(stats.depths, depth, node->size());
+        if (node->nrSlots() > 0)
+            countAt(stats.bucketSizes, node->size(), 1);
+    }
+    else
+    {
+        size_t children = 0;
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+        {
+            if (node->child(i))
+            {
+                ++children;
+                addTrieStats(node->child(i), depth + 1, stats);
+            }
+        }
+
+        if (dynamic_cast<ArrayNode<Key, Val> const*>(node))
+        {
+            ++stats.nrArrays;
+            if (2 * children < fanout)
+                ++stats.nrSparseArrays;
+        }
+        else
+        {
+            ++stats.nrBitmapped;
+            stats.nrBitmappedChildren += children;
+        }
+    }
+}
+
 } // namespace hash_trie
 } // namespace odf
 
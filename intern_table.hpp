@@ -0,0 +1,263 @@
+/** -*-c++-*-
+ *
+ *  Hash array mapped tries (HAMT) as introduced by Phil Bagwell:
+ *  Hash-consing of trie nodes, so that equal subtries built independently
+ *  end up as one physical subtrie.
+ *
+ *  An intern table holds one canonical node for each distinct content it has
+ *  seen. Interning a trie rebuilds it bottom-up: each leaf is replaced by an
+ *  equal canonical leaf, and each inner node by the canonical node with the
+ *  same canonical children, which is found by comparing child pointers only.
+ *  Equal tries interned in the same table thus share their root, so that
+ *  comparing them takes constant time, and the memory for their common parts
+ *  is held only once.
+ *
+ *  Keys and values must work with boost::hash and ==. Collision nodes are
+ *  interned like inner nodes, with their leaves in a canonical order. A table
+ *  is not thread-safe.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_INTERN_TABLE_HPP
+#define ODF_INTERN_TABLE_HPP 1
+
+#include <algorithm>
+#include <vector>
+
+#include <boost/functional/hash.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "hash_trie.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// A table holds on to every node it returns, so these stay alive even when
+// no trie uses them any longer. Calling purge() lets go of those.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+class InternTable : private boost::noncopyable
+{
+public:
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    // The number of canonical nodes held.
+    size_t size() const
+    {
+        return nodes_.size();
+    }
+
+    // Returns a trie equal to the given one made of canonical nodes. Nodes
+    // seen for the first time become canonical themselves, and a trie that
+    // was interned before is returned as it is.
+    NodePtr intern(NodePtr const node)
+    {
+        if (not node)
+            return node;
+
+        Entry const entry(node);
+        if (node->isLeaf() and not isBucket(node.get()))
+            return nodes_.insert(entry).first->node;
+
+        typename Nodes::const_iterator found = nodes_.find(entry);
+        if (found != nodes_.end())
+            return found->node;
+
+        NodePtr canonical;
+        if (isBucket(node.get()))
+            canonical = internBucket(node);
+        else
+        {
+            NodePtr children[fanout];
+            node->getChildren(children);
+            for (indexType i = 0; i < fanout; ++i)
+                if (children[i])
+                    children[i] = intern(children[i]);
+            canonical = rebuildInner(node.get(), children);
+        }
+
+        if (canonical == node)
+            return nodes_.insert(entry).first->node;
+        else
+            return nodes_.insert(Entry(canonical)).first->node;
+    }
+
+    // Drops the nodes only the table still refers to. Returns the number of
+    // nodes dropped.
+    //
+    // Dropped nodes are held on to until the end, so that their children can
+    // be recognized as unused by counting the references from dropped
+    // parents. Releasing them right away would not do when deferred deletion
+    // is enabled, since a queued parent still holds its children.
+    size_t purge()
+    {
+        std::vector<NodePtr> dropped;
+        typename Nodes::iterator iter = nodes_.begin();
+        while (iter != nodes_.end())
+        {
+            if (iter->node->useCount() == 1)
+            {
+                dropped.push_back(iter->node);
+                iter = nodes_.erase(iter);
+            }
+            else
+                ++iter;
+        }
+
+        boost::unordered_map<Node<Key, Val> const*, size_t> heldByDropped;
+        for (size_t k = 0; k < dropped.size(); ++k)
+        {
+            Node<Key, Val> const* const parent = dropped[k].get();
+            for (size_t i = 0; i < parent->nrSlots(); ++i)
+            {
+                Node<Key, Val> const* const child = parent->child(i);
+                if (not child)
+                    continue;
+
+                size_t const refs = ++heldByDropped[child];
+                if (child->useCount() != refs + 1)
+                    continue;
+
+                typename Nodes::iterator found =
+                    nodes_.find(Entry(sharedNode(child)));
+                if (found != nodes_.end() and found->node.get() == child)
+                {
+                    dropped.push_back(found->node);
+                    nodes_.erase(found);
+                }
+            }
+        }
+
+        return dropped.size();
+    }
+
+    void clear()
+    {
+        nodes_.clear();
+    }
+
+private:
+    // Leaves are compared by content, inner and collision nodes by their
+    // child pointers, which are canonical for all nodes in the table. Each
+    // entry keeps its hash code, so that probing and rehashing the table
+    // rarely needs to look at the nodes themselves.
+    struct Entry
+    {
+        NodePtr node;
+        size_t hash;
+
+        Entry(NodePtr const& node)
+            : node(node),
+              hash(contentHash(node.get()))
+        {
+        }
+
+        bool operator==(Entry const& other) const
+        {
+            return hash == other.hash and sameContent(node.get(),
+                                                      other.node.get());
+        }
+    };
+
+    struct EntryHash
+    {
+        size_t operator()(Entry const& entry) const
+        {
+            return entry.hash;
+        }
+    };
+
+    boost::unordered_set<Entry, EntryHash> typedef Nodes;
+
+    Nodes nodes_;
+
+    static size_t contentHash(Node<Key, Val> const* const node)
+    {
+        size_t seed = node->size();
+        if (isBucket(node))
+        {
+            boost::hash_combine(seed, node->hash());
+            for (size_t i = 0; i < node->nrSlots(); ++i)
+                boost::hash_combine(seed, node->child(i));
+        }
+        else if (node->isLeaf())
+        {
+            boost::hash_combine(seed, node->key());
+            boost::hash_combine(seed, leafValue(node));
+        }
+        else
+        {
+            Node<Key, Val> const* children[fanout] = { 0 };
+            node->getChildren(children);
+            for (indexType i = 0; i < fanout; ++i)
+                boost::hash_combine(seed, children[i]);
+        }
+        return seed;
+    }
+
+    static bool sameContent(Node<Key, Val> const* const a,
+                            Node<Key, Val> const* const b)
+    {
+        if (a == b)
+            return true;
+        else if (a->isLeaf() != b->isLeaf() or a->size() != b->size()
+                 or isBucket(a) != isBucket(b))
+            return false;
+        else if (isBucket(a))
+        {
+            if (a->hash() != b->hash())
+                return false;
+            for (size_t i = 0; i < a->nrSlots(); ++i)
+                if (a->child(i) != b->child(i))
+                    return false;
+            return true;
+        }
+        else if (a->isLeaf())
+            return a->hash() == b->hash() and a->key() == b->key()
+                and leafValue(a) == leafValue(b);
+
+        Node<Key, Val> const* ca[fanout] = { 0 };
+        Node<Key, Val> const* cb[fanout] = { 0 };
+        a->getChildren(ca);
+        b->getChildren(cb);
+        for (indexType i = 0; i < fanout; ++i)
+            if (ca[i] != cb[i])
+                return false;
+        return true;
+    }
+
+    static bool isBucket(Node<Key, Val> const* const node)
+    {
+        return dynamic_cast<CollisionNode<Key, Val> const*>(node) != 0;
+    }
+
+    // Equal buckets hold the same canonical leaves, so ordering them by
+    // address makes the buckets themselves comparable slot by slot.
+    NodePtr internBucket(NodePtr const node)
+    {
+        typename CollisionNode<Key, Val>::Bucket leaves;
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+            leaves.push_back(intern(sharedNode(node->child(i))));
+        std::sort(leaves.begin(), leaves.end());
+
+        for (size_t i = 0; i < node->nrSlots(); ++i)
+            if (leaves[i].get() != node->child(i))
+                return CollisionNode<Key, Val>::fromBucket(node->hash(),
+                                                           leaves);
+        return node;
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_INTERN_TABLE_HPP
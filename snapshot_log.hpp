@@ -0,0 +1,286 @@
+/** -*-c++-*-
+ *
+ *  Hash array mapped tries (HAMT) as introduced by Phil Bagwell:
+ *  Appending successive versions of a trie to a snapshot log file, as
+ *  described in trie_snapshot.hpp, so that each node is written only once.
+ *
+ *  The log remembers the file offset of every node of the version appended
+ *  last. When the next version is appended, subtries it shares with that
+ *  one are referred to by their known offsets, so only the nodes created in
+ *  between are written, followed by a new root record. Offsets are dropped
+ *  for nodes that are no longer in use, which is found out by walking the
+ *  old and new version side by side, skipping the parts they share. The cost
+ *  of an append is thus proportional to the number of changed nodes, not to
+ *  the size of the trie.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_SNAPSHOT_LOG_HPP
+#define ODF_SNAPSHOT_LOG_HPP 1
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <boost/noncopyable.hpp>
+#include <boost/unordered_map.hpp>
+#include <boost/unordered_set.hpp>
+
+#include "trie_snapshot.hpp"
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// A log holds on to the version appended last, so that the nodes it knows the
+// offsets of cannot be freed and their addresses reused by new nodes. Each
+// append is flushed to disk before the call returns, with the nodes synced
+// before the root record that refers to them. If an append fails, whatever
+// was written by it is truncated away, and the next one writes out the whole
+// trie again. The same happens for the first append after a log is reopened,
+// since the offsets of nodes are only known for the trie they were written
+// from. If the file exists but is not a log for this key type, value type
+// and trie shape, it is left alone and isOpen() returns false.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+class SnapshotLog : private boost::noncopyable
+{
+public:
+    typename Node<Key, Val>::NodePtr typedef NodePtr;
+
+    explicit SnapshotLog(char const* const path)
+        : fd_(open(path, O_RDWR | O_CREAT, 0644)),
+          end_(0),
+          ok_(true)
+    {
+        if (fd_ >= 0 and not recover())
+        {
+            close(fd_);
+            fd_ = -1;
+        }
+    }
+
+    ~SnapshotLog()
+    {
+        if (fd_ >= 0)
+            close(fd_);
+    }
+
+    bool isOpen() const
+    {
+        return fd_ >= 0;
+    }
+
+    // The length of the log file in bytes.
+    uint64_t length() const
+    {
+        return end_;
+    }
+
+    // The number of nodes for which offsets are currently known.
+    size_t nrKnownNodes() const
+    {
+        return offsets_.size();
+    }
+
+    // Appends a new version. Returns false if it could not be written.
+    bool append(NodePtr const root)
+    {
+        if (fd_ < 0)
+            return false;
+
+        uint64_t const start = end_;
+        ok_ = true;
+        kept_.clear();
+
+        SnapshotRoot record;
+        memset(&record, 0, sizeof(record));
+        record.kind  = SnapshotNode::root;
+        record.check = snapshotRootCheck;
+        record.size  = root ? root->size() : 0;
+        record.root  = root ? store(root.get()) : 0;
+
+        flush();
+        sync();
+        buffer_.insert(buffer_.end(),
+                       reinterpret_cast<char const*>(&record),
+                       reinterpret_cast<char const*>(&record + 1));
+        flush();
+        sync();
+
+        if (not ok_)
+        {
+            offsets_.clear();
+            root_.reset();
+            buffer_.clear();
+            if (ftruncate(fd_, start) == 0)
+                end_ = start;
+            else
+            {
+                close(fd_);
+                fd_ = -1;
+            }
+            return false;
+        }
+
+        if (root_)
+            drop(root_.get(), root.get());
+        root_ = root;
+        kept_.clear();
+
+        return true;
+    }
+
+private:
+    typedef SnapshotEncoding<Key, Val> Encoding;
+
+    static size_t const flushSize = 1 << 20;
+
+    int fd_;
+    uint64_t end_;
+    bool ok_;
+    std::vector<char> buffer_;
+    NodePtr root_;
+    boost::unordered_map<Node<Key, Val> const*, uint64_t> offsets_;
+    boost::unordered_set<Node<Key, Val> const*> kept_;
+
+    // Writes the header to an empty file, or finds the end of the last
+    // complete version in an existing one and cuts off anything after it.
+    bool recover()
+    {
+        struct stat info;
+        if (fstat(fd_, &info) != 0)
+            return false;
+
+        if (info.st_size == 0)
+        {
+            SnapshotHeader const header =
+                makeSnapshotHeader<Key, Val>(snapshotLogMagic);
+            buffer_.assign(reinterpret_cast<char const*>(&header),
+                           reinterpret_cast<char const*>(&header + 1));
+            flush();
+            sync();
+            return ok_;
+        }
+
+        if (info.st_size < off_t(sizeof(SnapshotHeader)))
+            return false;
+
+        void* p = mmap(0, info.st_size, PROT_READ, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED)
+            return false;
+
+        char const* base = static_cast<char const*>(p);
+        bool const valid = isSnapshotHeaderFor<Key, Val>(
+            *reinterpret_cast<SnapshotHeader const*>(base), snapshotLogMagic);
+        if (valid)
+        {
+            uint64_t const last =
+                findSnapshotLogRoot<Key, Val>(base, info.st_size);
+            end_ = last ? last + sizeof(SnapshotRoot) : sizeof(SnapshotHeader);
+        }
+        munmap(p, info.st_size);
+
+        if (valid and off_t(end_) < info.st_size)
+            return ftruncate(fd_, end_) == 0;
+        else
+            return valid;
+    }
+
+    void flush()
+    {
+        size_t done = 0;
+        while (ok_ and done < buffer_.size())
+        {
+            ssize_t const n = pwrite(fd_, &buffer_[done],
+                                     buffer_.size() - done, end_ + done);
+            if (n > 0)
+                done += n;
+            else
+                ok_ = false;
+        }
+        end_ += done;
+        buffer_.clear();
+    }
+
+    void sync()
+    {
+        if (ok_ and fsync(fd_) != 0)
+            ok_ = false;
+    }
+
+    // Writes the nodes of a subtrie that are not yet in the log, children
+    // first, and returns the offset of its root.
+    uint64_t store(Node<Key, Val> const* const node)
+    {
+        bool const hasOffset = node->nrSlots() > 0;
+        if (hasOffset)
+        {
+            typename boost::unordered_map<Node<Key, Val> const*, uint64_t>
+                ::const_iterator found = offsets_.find(node);
+            if (found != offsets_.end())
+            {
+                kept_.insert(node);
+                return found->second;
+            }
+        }
+
+        uint64_t offsets[fanout];
+        size_t nrNodes = 0;
+
+        if (not Encoding::isBucket(node))
+        {
+            Node<Key, Val> const* slots[fanout] = { 0 };
+            Encoding::getSlots(node, slots);
+            for (indexType i = 0; i < fanout; ++i)
+                if (slots[i] and slots[i]->nrSlots() > 0)
+                    offsets[nrNodes++] = store(slots[i]);
+        }
+
+        if (buffer_.size() >= flushSize)
+            flush();
+
+        uint64_t const offset = end_ + buffer_.size();
+        Encoding::encode(node, offsets, buffer_);
+        if (hasOffset)
+            offsets_[node] = offset;
+
+        return offset;
+    }
+
+    // Forgets the offsets of the nodes in the old version below the given
+    // node that the new version no longer uses. Where the new version has
+    // the same node in the same place, nothing below it has changed. A node
+    // the new version uses in some other place was found by store().
+    void drop(Node<Key, Val> const* const old, Node<Key, Val> const* const now)
+    {
+        if (old == now or old->nrSlots() == 0 or kept_.count(old))
+            return;
+
+        offsets_.erase(old);
+        if (old->isLeaf())
+            return;
+
+        Node<Key, Val> const* before[fanout] = { 0 };
+        Node<Key, Val> const* after[fanout] = { 0 };
+        old->getChildren(before);
+        if (now and not now->isLeaf())
+            now->getChildren(after);
+
+        for (indexType i = 0; i < fanout; ++i)
+            if (before[i])
+                drop(before[i], after[i]);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_SNAPSHOT_LOG_HPP
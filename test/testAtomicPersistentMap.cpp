@@ -0,0 +1,296 @@
+/* -*-c++-*- */
+
+// Build with ODF_HASH_TRIE_ATOMIC defined (see Makefile).
+
+// On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
+#include <UnitTest++.h>
+
+#include <vector>
+
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+#include "AtomicPersistentMap.hpp"
+
+using namespace odf::hash_trie;
+
+
+SUITE(AtomicPersistentMap)
+{
+    hashType hashfun(int const val)
+    {
+        return (hashType) val * 2654435761u;
+    }
+
+    typedef AtomicPersistentMap<int, int, hashfun> Shared;
+    typedef Shared::Map Map;
+
+    int increment(int const val)
+    {
+        return val + 1;
+    }
+
+    struct Triple
+    {
+        Map const operator()(Map const& map) const
+        {
+            return map.update(1, increment).update(2, increment)
+                .update(3, increment);
+        }
+    };
+
+    TEST(SingleThread)
+    {
+        Shared shared;
+        CHECK_EQUAL(0u, shared.size());
+
+        shared.insert(1, 10);
+        shared.insert(2, 20);
+        Map const before = shared.load();
+
+        shared.update(1, increment);
+        shared.remove(2);
+        shared.insert(3, 30);
+
+        CHECK_EQUAL(2u, shared.size());
+        CHECK_EQUAL(11, shared.getVal(1, 0));
+        CHECK(not shared.contains(2));
+        CHECK_EQUAL(30, shared.getVal(3, 0));
+
+        CHECK_EQUAL(2u, before.size());
+        CHECK_EQUAL(10, before.getVal(1, 0));
+        CHECK_EQUAL(20, before.getVal(2, 0));
+
+        Map const result = shared.apply(Triple());
+        CHECK_EQUAL(12, result.getVal(1, 0));
+        CHECK(not result.contains(2));
+        CHECK_EQUAL(31, result.getVal(3, 0));
+        CHECK(shared.load() == result);
+
+        shared.store(before);
+        CHECK(shared.load() == before);
+        shared.store(Map());
+        CHECK_EQUAL(0u, shared.size());
+
+        Shared other(before);
+        CHECK_EQUAL(20, other.getVal(2, 0));
+    }
+
+    // Counts live instances, to check that replaced versions are freed.
+    struct Tracked
+    {
+        static boost::atomic<int> live;
+
+        int value;
+
+        Tracked(int const v = 0)
+            : value(v)
+        {
+            ++live;
+        }
+
+        Tracked(Tracked const& other)
+            : value(other.value)
+        {
+            ++live;
+        }
+
+        ~Tracked()
+        {
+            --live;
+        }
+
+        bool operator==(Tracked const& other) const
+        {
+            return value == other.value;
+        }
+
+        bool operator!=(Tracked const& other) const
+        {
+            return value != other.value;
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, Tracked const& t)
+        {
+            return out << t.value;
+        }
+    };
+
+    boost::atomic<int> Tracked::live(0);
+
+    TEST(ReleasesReplacedVersions)
+    {
+        {
+            AtomicPersistentMap<int, Tracked, hashfun> shared;
+            for (int i = 0; i < 1000; ++i)
+                shared.insert(i % 100, Tracked(i));
+            CHECK_EQUAL(100u, shared.size());
+            CHECK_EQUAL(999, shared.getVal(99, Tracked()).value);
+        }
+        CHECK_EQUAL(0u, EpochReclamation::collect());
+        CHECK_EQUAL(0, Tracked::live.load());
+    }
+
+    typedef AtomicPersistentMap<int, Tracked, hashfun> TrackedShared;
+
+    struct TrackedWriter
+    {
+        TrackedWriter(TrackedShared* const shared)
+            : shared_(shared)
+        {
+        }
+
+        void operator()() const
+        {
+            for (int i = 0; i < 1000; ++i)
+                shared_->insert(i % 100, Tracked(i));
+        }
+
+    private:
+        TrackedShared* shared_;
+    };
+
+    // The guard keeps the writer from releasing the versions it replaces, so
+    // they are still waiting when it exits.
+    void writeFromExitingThread(TrackedShared& shared)
+    {
+        EpochReclamation::ReadGuard guard;
+        boost::thread(TrackedWriter(&shared)).join();
+    }
+
+    TEST(ReleasesVersionsRetiredByExitedThreads)
+    {
+        {
+            TrackedShared shared;
+            writeFromExitingThread(shared);
+            CHECK(Tracked::live.load() > 100);
+
+            CHECK_EQUAL(0u, EpochReclamation::collect());
+            CHECK_EQUAL(100u, shared.size());
+            CHECK_EQUAL(100, Tracked::live.load());
+        }
+        CHECK_EQUAL(0, Tracked::live.load());
+
+        {
+            TrackedShared shared;
+            writeFromExitingThread(shared);
+        }
+        CHECK_EQUAL(0, Tracked::live.load());
+    }
+
+    TEST(BackgroundDrainFreesReleasedMaps)
+    {
+        DeferredDeletion::enable();
+        {
+            BackgroundDrain const drain(64, 1);
+            {
+                AtomicPersistentMap<int, Tracked, hashfun> shared;
+                for (int i = 0; i < 1000; ++i)
+                    shared.insert(i, Tracked(i));
+            }
+            CHECK_EQUAL(0u, EpochReclamation::collect());
+
+            for (int i = 0; i < 1000 and Tracked::live.load() > 0; ++i)
+                boost::this_thread::sleep(boost::posix_time::milliseconds(5));
+        }
+        DeferredDeletion::enable(false);
+
+        CHECK_EQUAL(0, Tracked::live.load());
+        CHECK_EQUAL(0u, DeferredDeletion::pending());
+    }
+
+    struct Writer
+    {
+        Writer(Shared* const shared, int const first, int const count)
+            : shared_(shared),
+              first_(first),
+              count_(count)
+        {
+        }
+
+        void operator()() const
+        {
+            for (int i = first_; i < first_ + count_; ++i)
+            {
+                shared_->insert(i, 2 * i);
+                shared_->update(-1, increment);
+            }
+        }
+
+    private:
+        Shared* shared_;
+        int first_;
+        int count_;
+    };
+
+    struct Reader
+    {
+        Reader(Shared const* const shared,
+               boost::atomic<bool>* const done,
+               boost::atomic<int>* const errors)
+            : shared_(shared),
+              done_(done),
+              errors_(errors)
+        {
+        }
+
+        void operator()() const
+        {
+            size_t last = 0;
+            while (not done_->load())
+            {
+                Map const map = shared_->load();
+
+                // Versions only ever grow, and each entry has the right value.
+                if (map.size() < last)
+                    ++*errors_;
+                last = map.size();
+
+                for (Map::const_iterator it = map.begin(); it != map.end();
+                     ++it)
+                    if (it->first >= 0 and it->second != 2 * it->first)
+                        ++*errors_;
+            }
+        }
+
+    private:
+        Shared const* shared_;
+        boost::atomic<bool>* done_;
+        boost::atomic<int>* errors_;
+    };
+
+    TEST(ConcurrentReadersAndWriters)
+    {
+        int const nrWriters = 4;
+        int const perWriter = 500;
+
+        Shared shared(Map().insert(-1, 0));
+        boost::atomic<bool> done(false);
+        boost::atomic<int> errors(0);
+
+        boost::thread_group readers;
+        for (int t = 0; t < 2; ++t)
+            readers.create_thread(Reader(&shared, &done, &errors));
+
+        boost::thread_group writers;
+        for (int t = 0; t < nrWriters; ++t)
+            writers.create_thread(Writer(&shared, t * perWriter, perWriter));
+        writers.join_all();
+
+        done.store(true);
+        readers.join_all();
+
+        CHECK_EQUAL(0, errors.load());
+
+        Map const map = shared.load();
+        CHECK_EQUAL(size_t(nrWriters * perWriter + 1), map.size());
+        CHECK_EQUAL(nrWriters * perWriter, map.getVal(-1, 0));
+        for (int i = 0; i < nrWriters * perWriter; ++i)
+            CHECK_EQUAL(2 * i, map.getVal(i, -1));
+    }
+}
+
+int main()
+{
+    return UnitTest::RunAllTests();
+}
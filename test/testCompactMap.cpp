@@ -0,0 +1,217 @@
+/* -*-c++-*- */
+
+// On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
+#include <UnitTest++.h>
+
+#include <map>
+#include <stdlib.h>
+
+#include "CompactMap.hpp"
+#include "CompactSet.hpp"
+
+using namespace odf::hash_trie;
+
+
+SUITE(CompactMap)
+{
+#define CHECK_MISSING(key, map) CHECK_EQUAL(None, (map).get(key).get())
+
+    const void* None = 0;
+
+    SUITE(EightBitHash)
+    {
+        hashType hashfun(int const val)
+        {
+            return val % 256;
+        }
+
+        typedef CompactMap<int, int, hashfun> Map;
+
+        TEST(SimpleTest)
+        {
+            Map map =
+                Map().insert(1, 2).insert(3, 4).insert(259, 5).insert(1027, 6);
+
+            CHECK_EQUAL(2, *map.get(   1));
+            CHECK_EQUAL(4, *map.get(   3));
+            CHECK_EQUAL(5, *map.get( 259));
+            CHECK_EQUAL(6, *map.get(1027));
+
+            CHECK_MISSING(123, map);
+        }
+
+        TEST(EmptyMap)
+        {
+            Map map;
+
+            CHECK_EQUAL(0, map.size());
+            CHECK_MISSING(0, map);
+            CHECK_EQUAL(0, map.remove(0).size());
+            CHECK_EQUAL("CompactMap({})", map.asString());
+        }
+
+        TEST(SingletonMap)
+        {
+            Map map = Map().insert('A', 1);
+
+            CHECK_EQUAL(1, map.size());
+            CHECK_EQUAL(1, *map.get('A'));
+            CHECK_MISSING('B', map);
+            CHECK_EQUAL(0, map.remove('A').remove('A').size());
+            CHECK_EQUAL("CompactMap({1: 65 -> 1})", map.asString());
+        }
+
+        TEST(SingletonMapUpdate)
+        {
+            Map map = Map().insert('A', 1).insert('A', 65);
+
+            CHECK_EQUAL(1, map.size());
+            CHECK_EQUAL(65, *map.get('A'));
+            CHECK_EQUAL(65, map.getVal('A', 0));
+            CHECK_EQUAL(0, map.getVal('B', 0));
+        }
+
+        TEST(FindAndContains)
+        {
+            Map map = Map().insert(257, 1).insert(513, 2).insert(33, 3);
+
+            CHECK_EQUAL(2, *map.find(513));
+            CHECK_EQUAL(None, map.find(769));
+            CHECK(map.contains(257));
+            CHECK(not map.contains(1));
+        }
+
+        TEST(TwoItemsLevelOneCollision)
+        {
+            Map map = Map().insert(1, 'a').insert(33, 'b');
+
+            CHECK_EQUAL(2, map.size());
+            CHECK_EQUAL("CompactMap({1: {0: 1 -> 97, 1: 33 -> 98}})",
+                        map.asString());
+            CHECK_EQUAL("CompactMap({1: 33 -> 98})",
+                        map.remove(1).asString());
+            CHECK_EQUAL(0, map.remove(1).remove(33).size());
+        }
+
+        TEST(ThreeItemsFullCollision)
+        {
+            Map map = Map().insert(257, 'a').insert(513, 'b').insert(769, 'c');
+
+            CHECK_EQUAL(3, map.size());
+            CHECK_EQUAL('a', *map.get(257));
+            CHECK_EQUAL('b', *map.get(513));
+            CHECK_EQUAL('c', *map.get(769));
+            CHECK_MISSING(1025, map);
+
+            Map mod = map.remove(257).remove(769);
+            CHECK_EQUAL(1, mod.size());
+            CHECK_EQUAL("CompactMap({1: 513 -> 98})", mod.asString());
+        }
+
+        TEST(NoOpUpdatesShareRoot)
+        {
+            Map map = Map().insert(1, 2).insert(3, 4);
+
+            CHECK_EQUAL(map.asString(), map.insert(1, 2).asString());
+            CHECK_EQUAL(2, map.remove(5).size());
+            CHECK_EQUAL(2, map.insert(3, 4).size());
+        }
+
+        TEST(RandomAgainstStdMap)
+        {
+            srand(987654321);
+
+            Map map;
+            std::map<int, int> reference;
+
+            for (int i = 0; i < 20000; ++i)
+            {
+                int key = rand() % 3000;
+                if (rand() % 3 == 0)
+                {
+                    map = map.remove(key);
+                    reference.erase(key);
+                }
+                else
+                {
+                    map = map.insert(key, i);
+                    reference[key] = i;
+                }
+            }
+
+            CHECK_EQUAL(reference.size(), map.size());
+            for (int key = 0; key < 3000; ++key)
+            {
+                if (reference.count(key))
+                    CHECK_EQUAL(reference[key], *map.get(key));
+                else
+                    CHECK_MISSING(key, map);
+            }
+        }
+    }
+
+    SUITE(LongHash)
+    {
+        hashType hashfun(int const val)
+        {
+            return (hashType) val;
+        }
+
+        typedef CompactMap<int, int, hashfun> Map;
+
+        TEST(InsertAndRemoveMany)
+        {
+            int const N = 10000;
+            Map map;
+            for (int i = 0; i < N; ++i)
+                map = map.insert(i * 7919, i);
+            CHECK_EQUAL(N, map.size());
+            for (int i = 0; i < N; ++i)
+                CHECK_EQUAL(i, *map.get(i * 7919));
+
+            for (int i = 0; i < N; i += 2)
+                map = map.remove(i * 7919);
+            CHECK_EQUAL(N / 2, map.size());
+            for (int i = 0; i < N; ++i)
+            {
+                if (i % 2 == 0)
+                    CHECK_MISSING(i * 7919, map);
+                else
+                    CHECK_EQUAL(i, *map.get(i * 7919));
+            }
+        }
+    }
+}
+
+SUITE(CompactSet)
+{
+    hashType hashfun(int const val)
+    {
+        return val % 256;
+    }
+
+    typedef CompactSet<int, hashfun> Set;
+
+    TEST(Basic)
+    {
+        Set set = Set().insert(1).insert(257).insert(33).insert(1);
+
+        CHECK_EQUAL(3, set.size());
+        CHECK(set.contains(1));
+        CHECK(set.contains(257));
+        CHECK(set.contains(33));
+        CHECK(not set.contains(513));
+        CHECK_EQUAL("CompactSet({1: {0: {0: {0: {0: {0: {0: <1 | 257>}}}}}, "
+                    "1: 33}})",
+                    set.asString());
+
+        Set mod = set.remove(257).remove(33);
+        CHECK_EQUAL(1, mod.size());
+        CHECK_EQUAL("CompactSet({1: 1})", mod.asString());
+    }
+}
+
+int main()
+{
+    return UnitTest::RunAllTests();
+}
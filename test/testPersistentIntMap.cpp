@@ -0,0 +1,243 @@
+/* -*-c++-*- */
+
+// On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
+#include <UnitTest++.h>
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include <map>
+
+#include "PersistentIntMap.hpp"
+
+using namespace odf::hash_trie;
+
+
+SUITE(PersistentIntMap)
+{
+    typedef PersistentIntMap<int> Map;
+    typedef std::map<int, int> Reference;
+
+    int twice(int const n)
+    {
+        return 2 * n;
+    }
+
+    // Keys that are spread out, negative ones included.
+    int sparseKey(int const i)
+    {
+        return (i % 2 ? -1 : 1) * (i * 7919 + (i % 13) * 1000003);
+    }
+
+    template<typename M, typename R>
+    void checkSame(M const& map, R const& expected)
+    {
+        CHECK_EQUAL(expected.size(), map.size());
+
+        typename M::const_iterator it = map.begin();
+        typename R::const_iterator ref = expected.begin();
+        for (; it != map.end() and ref != expected.end(); ++it, ++ref)
+        {
+            CHECK_EQUAL(ref->first, it->first);
+            CHECK_EQUAL(ref->second, it->second);
+        }
+        CHECK(it == map.end());
+        CHECK(ref == expected.end());
+
+        for (ref = expected.begin(); ref != expected.end(); ++ref)
+            CHECK_EQUAL(ref->second, map.getVal(ref->first, ref->second + 1));
+    }
+
+    TEST(Empty)
+    {
+        Map const map;
+        CHECK_EQUAL(0u, map.size());
+        CHECK(map.empty());
+        CHECK(map.begin() == map.end());
+        CHECK(map.lower_bound(0) == map.end());
+        CHECK(not map.contains(0));
+        CHECK_EQUAL(0u, map.remove(0).size());
+        CHECK_EQUAL(0u, map.range(-5, 5).size());
+    }
+
+    TEST(InsertAndRemove)
+    {
+        Map map;
+        Reference expected;
+        for (int i = 0; i < 1000; ++i)
+        {
+            map = map.insert(sparseKey(i), i);
+            expected[sparseKey(i)] = i;
+        }
+        checkSame(map, expected);
+
+        Map const full = map;
+        map = map.insert(sparseKey(3), -3).update(sparseKey(4), twice)
+            .update(12345, twice);
+        expected[sparseKey(3)] = -3;
+        expected[sparseKey(4)] = 8;
+        CHECK(not map.contains(12345));
+        checkSame(map, expected);
+
+        for (int i = 0; i < 1000; i += 3)
+        {
+            map = map.remove(sparseKey(i));
+            expected.erase(sparseKey(i));
+        }
+        map = map.remove(12345);
+        checkSame(map, expected);
+
+        CHECK_EQUAL(1000u, full.size());
+        CHECK_EQUAL(3, full.getVal(sparseKey(3), 0));
+
+        for (int i = 0; i < 1000; ++i)
+            map = map.remove(sparseKey(i));
+        CHECK(map.empty());
+    }
+
+    int same(int const n)
+    {
+        return n;
+    }
+
+    // Unchanged maps keep their nodes, so each entry is still the same one.
+    template<typename M>
+    bool sharesEntries(M const& map, M const& other)
+    {
+        typename M::const_iterator it = map.begin();
+        typename M::const_iterator jt = other.begin();
+        for (; it != map.end() and jt != other.end(); ++it, ++jt)
+            if (&*it != &*jt)
+                return false;
+        return it == map.end() and jt == other.end();
+    }
+
+    TEST(NoOpUpdatesShareRoot)
+    {
+        Map map;
+        for (int i = 0; i < 100; ++i)
+            map = map.insert(sparseKey(i), i);
+
+        CHECK(sharesEntries(map, map.insert(sparseKey(7), 7)));
+        CHECK(sharesEntries(map, map.update(sparseKey(7), same)));
+        CHECK(sharesEntries(map, map.update(12345, twice)));
+        CHECK(sharesEntries(map, map.remove(12345)));
+
+        CHECK(not sharesEntries(map, map.insert(sparseKey(7), 8)));
+        CHECK(not sharesEntries(map, map.update(sparseKey(7), twice)));
+        CHECK_EQUAL(14, map.update(sparseKey(7), twice)
+                    .getVal(sparseKey(7), 0));
+    }
+
+    TEST(ExtremeKeys)
+    {
+        PersistentIntMap<int, int64_t> map;
+        std::map<int64_t, int> expected;
+        int64_t const keys[] = {
+            INT64_MIN, INT64_MIN + 1, -1, 0, 1, INT64_MAX - 1, INT64_MAX
+        };
+        for (int i = 0; i < 7; ++i)
+        {
+            map = map.insert(keys[6 - i], i);
+            expected[keys[6 - i]] = i;
+        }
+        checkSame(map, expected);
+        CHECK(map.upper_bound(INT64_MAX) == map.end());
+        CHECK_EQUAL(INT64_MIN, map.lower_bound(INT64_MIN)->first);
+
+        PersistentIntMap<int, uint32_t> umap;
+        umap = umap.insert(0xffffffffu, 1).insert(0, 2).insert(0x80000000u, 3);
+        PersistentIntMap<int, uint32_t>::const_iterator it = umap.begin();
+        CHECK_EQUAL(0u, (it++)->first);
+        CHECK_EQUAL(0x80000000u, (it++)->first);
+        CHECK_EQUAL(0xffffffffu, (it++)->first);
+        CHECK(it == umap.end());
+    }
+
+    TEST(Bounds)
+    {
+        Map map;
+        Reference expected;
+        for (int i = 0; i < 500; ++i)
+        {
+            map = map.insert(sparseKey(i), i);
+            expected[sparseKey(i)] = i;
+        }
+
+        srand(1);
+        for (int n = 0; n < 1000; ++n)
+        {
+            int const key = n < 500 ? sparseKey(n) + n % 3 - 1
+                : rand() % 20000000 - 10000000;
+
+            Reference::const_iterator lo = expected.lower_bound(key);
+            Map::const_iterator found = map.lower_bound(key);
+            if (lo == expected.end())
+                CHECK(found == map.end());
+            else if (found == map.end())
+                CHECK(false);
+            else
+                CHECK_EQUAL(lo->first, found->first);
+
+            Reference::const_iterator hi = expected.upper_bound(key);
+            found = map.upper_bound(key);
+            if (hi == expected.end())
+                CHECK(found == map.end());
+            else if (found == map.end())
+                CHECK(false);
+            else
+                CHECK_EQUAL(hi->first, found->first);
+        }
+    }
+
+    TEST(Range)
+    {
+        Map map;
+        Reference expected;
+        for (int i = 0; i < 500; ++i)
+        {
+            map = map.insert(sparseKey(i), i);
+            expected[sparseKey(i)] = i;
+        }
+
+        srand(2);
+        for (int n = 0; n < 100; ++n)
+        {
+            int lo = rand() % 8000000 - 4000000;
+            int hi = lo + rand() % 4000000;
+            if (n == 0)
+            {
+                lo = expected.begin()->first;
+                hi = expected.rbegin()->first;
+            }
+
+            Reference inRange(expected.lower_bound(lo),
+                              expected.upper_bound(hi));
+            checkSame(map.range(lo, hi), inRange);
+        }
+
+        CHECK_EQUAL(0u, map.range(5, 4).size());
+        CHECK_EQUAL(500u, map.range(INT_MIN, INT_MAX).size());
+    }
+
+    TEST(DenseKeys)
+    {
+        Map map;
+        Reference expected;
+        for (int i = 0; i < 5000; ++i)
+        {
+            map = map.insert(i * 2, i);
+            expected[i * 2] = i;
+        }
+        checkSame(map, expected);
+        CHECK_EQUAL(1000u, map.range(100, 2098).size());
+        CHECK_EQUAL(1001, map.upper_bound(2000)->second);
+        CHECK(not map.contains(2001));
+    }
+}
+
+int main()
+{
+    return UnitTest::RunAllTests();
+}
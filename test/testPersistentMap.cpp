@@ -3,13 +3,28 @@
 // On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
 #include <UnitTest++.h>
 
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <string>
+#include <set>
+#include <vector>
+#include <utility>
+
 #include "PersistentMap.hpp"
+#include "MappedMap.hpp"
 
 using namespace odf::hash_trie;
 
 
 SUITE(BitTwiddling)
 {
+#if ODF_HASH_TRIE_CHUNK_BITS == 5
     TEST(MaskedFunction)
     {
         CHECK_EQUAL(0x18, masked(0x12345678,  0));
@@ -18,6 +33,17 @@ SUITE(BitTwiddling)
         CHECK_EQUAL(0x08, masked(0x12345678, 15));
         CHECK_EQUAL(0x03, masked(0x12345678, 20));
     }
+#endif
+
+    TEST(MaskedCoversHash)
+    {
+        hashType const all = ~hashType(0);
+        hashType rebuilt = 0;
+        for (indexType shift = 0; shift < hashBits; shift += chunkBits)
+            rebuilt |= hashType(masked(all, shift)) << shift;
+        CHECK(rebuilt == all);
+        CHECK_EQUAL(fanout - 1, masked(all, 0));
+    }
 
     TEST(BitCountFunction)
     {
@@ -26,6 +52,7 @@ SUITE(BitTwiddling)
         CHECK_EQUAL( 1, bitCount(0x80000000));
         CHECK_EQUAL( 0, bitCount(0x00000000));
         CHECK_EQUAL( 2, bitCount(0x00100400));
+        CHECK_EQUAL(int(8 * sizeof(bitmapType)), bitCount(~bitmapType(0)));
     }
 
     TEST(IndexForBitFunction)
@@ -53,7 +80,7 @@ SUITE(ArrayCopyOnWrite)
             for (int i = 0; i < 4; ++i)
                 CHECK_EQUAL(((i == k) ? 5 : i), out[i]);
 
-            delete[] out;
+            deleteArray(out, 4);
         }
     }
 
@@ -69,7 +96,7 @@ SUITE(ArrayCopyOnWrite)
             for (int i = 0; i < 5; ++i)
                 CHECK_EQUAL(((i < k) ? i : (i == k) ? 5 : i - 1), out[i]);
 
-            delete[] out;
+            deleteArray(out, 5);
         }
     }
 
@@ -85,7 +112,7 @@ SUITE(ArrayCopyOnWrite)
             for (int i = 0; i < 3; ++i)
                 CHECK_EQUAL(((i < k) ? i : i + 1), out[i]);
 
-            delete[] out;
+            deleteArray(out, 3);
         }
     }
 
@@ -94,7 +121,29 @@ SUITE(ArrayCopyOnWrite)
         const int* x = arrayInsert((int *) 0, 0, 0, 1);
         CHECK_EQUAL(1, x[0]);
 
-        delete[] x;
+        deleteArray(x, 1);
+    }
+}
+
+SUITE(PoolAllocator)
+{
+    TEST(ReusesReleasedBlocks)
+    {
+        void* a = PoolAllocator::allocate(40);
+        void* b = PoolAllocator::allocate(40);
+        PoolAllocator::deallocate(a, 40);
+        void* c = PoolAllocator::allocate(36);
+
+        CHECK_EQUAL(a, c);
+
+        PoolAllocator::deallocate(b, 40);
+        PoolAllocator::deallocate(c, 36);
+    }
+
+    TEST(LargeBlocks)
+    {
+        void* a = PoolAllocator::allocate(4096);
+        PoolAllocator::deallocate(a, 4096);
     }
 }
 
@@ -165,6 +214,351 @@ SUITE(PersistentMap)
             CHECK_MISSING('B', map);
         }
 
+        TEST(FindAndContains)
+        {
+            Map map = Map().insert(257, 1).insert(513, 2).insert(33, 3);
+            int const* vp = map.find(513);
+
+            CHECK_EQUAL(2, *vp);
+            CHECK_EQUAL(3, *map.find(33));
+            CHECK_EQUAL(None, map.find(769));
+            CHECK(map.contains(257));
+            CHECK(not map.contains(1));
+            CHECK(not Map().contains(1));
+
+            Map mod = map.insert(513, 5).remove(257);
+
+            CHECK_EQUAL(2, *vp);
+            CHECK_EQUAL(5, *mod.find(513));
+            CHECK(not mod.contains(257));
+        }
+
+        struct Increment
+        {
+            int operator()(int const n) const
+            {
+                return n + 1;
+            }
+        };
+
+        TEST(NoOpsShareEntries)
+        {
+            Map map = Map().insert(257, 1).insert(513, 2).insert(33, 3);
+            int const* vp = map.find(513);
+
+            CHECK_EQUAL(vp, map.insert(513, 2).find(513));
+            CHECK_EQUAL(vp, map.remove(769).find(513));
+            CHECK_EQUAL(vp, map.remove(1).find(513));
+            CHECK_EQUAL(vp, map.update(1, Increment()).find(513));
+            CHECK_EQUAL(3, map.remove(769).size());
+            CHECK(vp != map.insert(513, 5).find(513));
+        }
+
+        TEST(UpdateAndUpsert)
+        {
+            Map map = Map().insert(257, 1).insert(33, 3);
+            Map mod = map.update(257, Increment()).update(513, Increment());
+
+            CHECK_EQUAL(1, *map.find(257));
+            CHECK_EQUAL(2, *mod.find(257));
+            CHECK_EQUAL(3, *mod.find(33));
+            CHECK(not mod.contains(513));
+
+            Map counts;
+            for (int i = 0; i < 100; ++i)
+                counts = counts.upsert((i % 10) * 128, Increment(), 1);
+
+            CHECK_EQUAL(10, counts.size());
+            for (int k = 0; k < 10; ++k)
+                CHECK_EQUAL(10, *counts.find(k * 128));
+        }
+
+        int sumValues(int const acc, int const, int const val)
+        {
+            return acc + val;
+        }
+
+        int plus(int const a, int const b)
+        {
+            return a + b;
+        }
+
+        bool isEven(int const, int const val)
+        {
+            return val % 2 == 0;
+        }
+
+        int half(int const val)
+        {
+            return val % 2 == 0 ? val / 2 : val;
+        }
+
+        TEST(BulkOperations)
+        {
+            Map map;
+            for (int i = 0; i < 1000; ++i)
+                map = map.insert(i, i);
+
+            CHECK_EQUAL(0, Map().parallelReduce(0, sumValues, plus));
+            CHECK_EQUAL(499500, map.parallelReduce(0, sumValues, plus));
+
+            Map even = map.filter(isEven);
+            CHECK_EQUAL(500, even.size());
+            for (int i = 0; i < 1000; ++i)
+                CHECK_EQUAL(i % 2 == 0, even.contains(i));
+
+            Map halved = even.mapValues(half);
+            CHECK_EQUAL(500, halved.size());
+            for (int i = 0; i < 1000; i += 2)
+                CHECK_EQUAL(i / 2, *halved.find(i));
+
+            CHECK_EQUAL(0, even.filter(std::not2(std::ptr_fun(isEven))).size());
+            CHECK(even.filter(isEven).find(2) == even.find(2));
+            CHECK(map.mapValues(Increment()) != map);
+            CHECK(map.mapValues(Increment()).size() == 1000);
+        }
+
+        TEST(GetMany)
+        {
+            Map map;
+            for (int i = 0; i < 3000; i += 2)
+                map = map.insert(i, 5 * i);
+
+            std::vector<int> keys;
+            for (int i = 0; i < 100; ++i)
+                keys.push_back((i * 37) % 3100 - 7);
+            keys.push_back(keys.front());
+
+            std::vector<int const*> values(1, (int const*) 0);
+            map.getMany(keys, values);
+            CHECK_EQUAL(keys.size(), values.size());
+            for (size_t i = 0; i < keys.size(); ++i)
+                CHECK_EQUAL(map.find(keys[i]), values[i]);
+
+            Map().getMany(keys, values);
+            CHECK_EQUAL(keys.size(), values.size());
+            CHECK(std::count(values.begin(), values.end(), (int const*) 0)
+                  == int(keys.size()));
+
+            map.getMany(std::vector<int>(), values);
+            CHECK(values.empty());
+
+            Map const one = Map().insert(12, 1);
+            one.getMany(keys, values);
+            for (size_t i = 0; i < keys.size(); ++i)
+                CHECK_EQUAL(one.find(keys[i]), values[i]);
+        }
+
+        TEST(Interning)
+        {
+            // Keys 256 apart collide, so some subtries hold collision nodes.
+            Map a, b;
+            for (int i = 0; i < 1000; ++i)
+            {
+                a = a.insert(i, i % 7);
+                b = b.insert(999 - i, (999 - i) % 7);
+            }
+            Map const c = b.insert(3, -1);
+
+            InternTable<int, int> table;
+            Map const ia = a.interned(table);
+            Map const ib = b.interned(table);
+            Map const ic = c.interned(table);
+
+            CHECK(ia == a);
+            CHECK(ib == b);
+            CHECK(ic == c);
+            CHECK(ic != ia);
+            CHECK_EQUAL(-1, ic.getVal(3, 0));
+            CHECK_EQUAL(3, ib.getVal(3, 0));
+
+            Map const both[] = { ia, ib };
+            SharedMemoryUsage const usage = Map::memoryUsage(both, both + 2);
+            CHECK(usage.unique[0].total() < usage.shared.total() / 4);
+            CHECK(usage.unique[1].total() < usage.shared.total() / 4);
+
+            CHECK(ia.interned(table).memoryUsage().total()
+                  == ia.memoryUsage().total());
+        }
+
+        TEST(MemoryUsage)
+        {
+            size_t const leafSize = sizeof(MapLeaf<int, int>);
+
+            CHECK_EQUAL(0u, Map().memoryUsage().total());
+            CHECK_EQUAL(leafSize, Map().insert(1, 1).memoryUsage().total());
+
+            odf::hash_trie::MemoryUsage bucket =
+                Map().insert(257, 1).insert(513, 2).insert(769, 3)
+                .memoryUsage();
+            CHECK_EQUAL(3 * leafSize, bucket.leaves);
+            CHECK(bucket.collisions > 0 and bucket.childArrays > 0);
+            CHECK_EQUAL(0u, bucket.bitmapped + bucket.arrays);
+
+            Map map;
+            for (int i = 0; i < 1000; ++i)
+                map = map.insert(i, i);
+            Map next = map.insert(1000, 0);
+
+            odf::hash_trie::MemoryUsage usage = map.memoryUsage();
+            CHECK_EQUAL(1000 * leafSize, usage.leaves);
+            CHECK(usage.arrays > 0 and usage.bitmapped > 0);
+
+            Map versions[] = { map, next, map };
+            SharedMemoryUsage shared = Map::memoryUsage(versions, versions + 3);
+            CHECK_EQUAL(3u, shared.unique.size());
+            CHECK_EQUAL(0u, shared.unique[0].total());
+            CHECK_EQUAL(0u, shared.unique[2].total());
+            CHECK_EQUAL(leafSize, shared.unique[1].leaves);
+            CHECK(shared.unique[1].total() < usage.total() / 10);
+
+            SharedMemoryUsage pair = Map::memoryUsage(versions, versions + 2);
+            CHECK_EQUAL(usage.total(),
+                        pair.shared.total() + pair.unique[0].total());
+            CHECK_EQUAL(next.memoryUsage().total(),
+                        pair.shared.total() + pair.unique[1].total());
+            CHECK(pair.unique[0].total() > 0);
+        }
+
+        TEST(Stats)
+        {
+            Map map;
+            for (int i = 0; i < 1000; ++i)
+                map = map.insert(i, i);
+            TrieStats stats = map.stats();
+
+            // Each of the 256 hash codes is shared by 3 or 4 keys.
+            CHECK_EQUAL(5u, stats.bucketSizes.size());
+            CHECK_EQUAL(24u, stats.bucketSizes[3]);
+            CHECK_EQUAL(232u, stats.bucketSizes[4]);
+
+#if ODF_HASH_TRIE_CHUNK_BITS == 5
+            // A full array node at the root, then 32 bitmapped nodes for the
+            // remaining three bits, then the buckets.
+            CHECK_EQUAL(3u, stats.depths.size());
+            CHECK_EQUAL(1000u, stats.depths[2]);
+            CHECK_EQUAL(2.0, stats.averageDepth());
+            CHECK_EQUAL(1u, stats.nrArrays);
+            CHECK_EQUAL(0u, stats.nrSparseArrays);
+            CHECK_EQUAL(32u, stats.nrBitmapped);
+            CHECK_EQUAL(8.0, stats.averageBitmappedPopulation());
+
+            Map sparse;
+            for (int i = 0; i < 20; ++i)
+                sparse = sparse.insert(i, i);
+            for (int i = 0; i < 10; ++i)
+                sparse = sparse.remove(i);
+            CHECK_EQUAL(1u, sparse.stats().nrSparseArrays);
+#endif
+        }
+
+        TEST(Iteration)
+        {
+            CHECK(Map().begin() == Map().end());
+
+            Map map;
+            for (int i = 0; i < 301; ++i)
+                map = map.insert(i, 10 * i);
+
+            std::set<int> seen;
+            for (Map::const_iterator iter = map.begin();
+                 iter != map.end();
+                 iter++)
+            {
+                CHECK_EQUAL(10 * iter->first, iter->second);
+                CHECK_EQUAL(10 * (*iter).first, *map.find(iter->first));
+                seen.insert(iter->first);
+            }
+
+            CHECK_EQUAL(301, seen.size());
+            CHECK_EQUAL(0, *seen.begin());
+            CHECK_EQUAL(300, *seen.rbegin());
+        }
+
+        TEST(Diff)
+        {
+            Map base;
+            for (int i = 0; i < 600; ++i)
+                base = base.insert(i, i);
+            Map next = base.remove(3).remove(259).insert(5, 50)
+                .insert(700, 7).insert(956, 9).insert(10, 10);
+
+            Map::Diff d = diff(base, next);
+            std::sort(d.added.begin(), d.added.end());
+            std::sort(d.removed.begin(), d.removed.end());
+
+            CHECK_EQUAL(2, d.added.size());
+            CHECK_EQUAL(700, d.added.at(0).first);
+            CHECK_EQUAL(7, d.added.at(0).second);
+            CHECK_EQUAL(956, d.added.at(1).first);
+            CHECK_EQUAL(2, d.removed.size());
+            CHECK_EQUAL(3, d.removed.at(0).first);
+            CHECK_EQUAL(259, d.removed.at(1).first);
+            CHECK_EQUAL(259, d.removed.at(1).second);
+            CHECK_EQUAL(1, d.changed.size());
+            CHECK_EQUAL(5, d.changed.at(0).key);
+            CHECK_EQUAL(5, d.changed.at(0).before);
+            CHECK_EQUAL(50, d.changed.at(0).after);
+
+            Map::Diff back = diff(next, base);
+
+            CHECK_EQUAL(2, back.added.size());
+            CHECK_EQUAL(2, back.removed.size());
+            CHECK_EQUAL(1, back.changed.size());
+            CHECK_EQUAL(50, back.changed.at(0).before);
+
+            Map::Diff none = diff(base, base);
+
+            CHECK(none.added.empty());
+            CHECK(none.removed.empty());
+            CHECK(none.changed.empty());
+            CHECK_EQUAL(next.size(), diff(Map(), next).added.size());
+            CHECK_EQUAL(next.size(), diff(next, Map()).removed.size());
+        }
+
+        TEST(Equality)
+        {
+            Map a = Map().insert(257, 1).insert(513, 2).insert(769, 3);
+            Map b = Map().insert(769, 3).insert(513, 2).insert(257, 1);
+
+            CHECK(a == b);
+            CHECK(a == a);
+            CHECK(Map() == Map());
+            CHECK(a != Map());
+            CHECK(a != b.insert(513, 4));
+            CHECK(a != b.remove(513).insert(1, 2));
+
+            Map c, d;
+            for (int i = 0; i < 600; ++i)
+                c = c.insert(i, i);
+            Map::Transient builder;
+            for (int i = 599; i >= 0; --i)
+                builder.insert(i, i);
+            for (int i = 600; i < 700; ++i)
+                builder.insert(i, i).remove(i);
+            d = builder.persistent();
+
+            CHECK(c == d);
+            CHECK(c != d.insert(5, 6));
+            CHECK(c != d.remove(5));
+            CHECK(c.remove(5) == d.remove(5));
+
+#ifdef ODF_HASH_TRIE_MERKLE
+            CHECK_EQUAL(a.contentHash(), b.contentHash());
+            CHECK_EQUAL(c.contentHash(), d.contentHash());
+            CHECK(c.contentHash() != d.insert(5, 6).contentHash());
+            CHECK_EQUAL(0u, Map().contentHash());
+
+            Map::Transient editor(d);
+            editor.insert(5, 6).insert(261, 7).remove(300);
+            Map e = editor.persistent();
+
+            CHECK_EQUAL(d.insert(5, 6).insert(261, 7).remove(300).contentHash(),
+                        e.contentHash());
+            CHECK(d.insert(5, 6).insert(261, 7).remove(300) == e);
+#endif
+        }
+
         SUITE(TwoItemsLevelOneCollision)
         {
             int const key_a = 1;
@@ -179,8 +573,10 @@ SUITE(PersistentMap)
                 CHECK_EQUAL('a', *map.get(key_a));
                 CHECK_EQUAL('a', *map.get(key_a));
                 CHECK_MISSING(key_c, map);
+#if ODF_HASH_TRIE_CHUNK_BITS == 5
                 CHECK_EQUAL("PersistentMap({1: {0: 1 -> 97, 1: 33 -> 98}})",
                             map.asString());
+#endif
 
                 CHECK_EQUAL(1, map.remove(key_a).size());
                 CHECK_EQUAL(0, map.remove(key_a).remove(key_b).size());
@@ -369,6 +765,160 @@ SUITE(PersistentMap)
                 }
             }
         }        
+
+        SUITE(FromRange)
+        {
+            typedef std::vector<std::pair<int, int> > Entries;
+
+            Map fromInserts(Entries const& entries)
+            {
+                Map map;
+                for (size_t i = 0; i < entries.size(); ++i)
+                    map = map.insert(entries[i].first, entries[i].second);
+                return map;
+            }
+
+            TEST(EmptyRange)
+            {
+                Entries entries;
+                Map map = Map::fromRange(entries.begin(), entries.end());
+
+                CHECK_EQUAL(0, map.size());
+                CHECK_EQUAL("PersistentMap({})", map.asString());
+            }
+
+            TEST(SingleCollision)
+            {
+                Entries entries;
+                entries.push_back(std::make_pair(257, 'a'));
+                entries.push_back(std::make_pair(513, 'b'));
+                Map map = Map::fromRange(entries.begin(), entries.end());
+
+                CHECK_EQUAL(fromInserts(entries).asString(), map.asString());
+            }
+
+            TEST(SmallMatchesInserts)
+            {
+                Entries entries;
+                for (int i = 0; i < 301; ++i)
+                    entries.push_back(std::make_pair(i * 7, i));
+                Map map = Map::fromRange(entries.begin(), entries.end());
+
+                CHECK_EQUAL(301, map.size());
+                CHECK_EQUAL(fromInserts(entries).asString(), map.asString());
+            }
+
+            TEST(LargeWithDuplicates)
+            {
+                int const N = 20000;
+                int const M = 15000;
+                Entries entries;
+                for (int i = 0; i < N; ++i)
+                    entries.push_back(std::make_pair(i % M, i));
+                Map map = Map::fromRange(entries.begin(), entries.end());
+
+                CHECK_EQUAL(M, map.size());
+                for (int i = 0; i < M; ++i)
+                    CHECK_EQUAL(i < N - M ? i + M : i, *map.get(i));
+                CHECK_EQUAL(fromInserts(entries).asString(), map.asString());
+            }
+        }
+
+        SUITE(Transient)
+        {
+            int const N = 3001;
+
+            TEST(InsertN)
+            {
+                Map::Transient builder;
+                for (int i = 0; i < N; ++i)
+                {
+                    builder.insert(i, i);
+                    CHECK_EQUAL(i + 1, builder.size());
+                }
+                Map map = builder.persistent();
+
+                CHECK_EQUAL(N, map.size());
+                for (int i = 0; i < N; ++i)
+                    CHECK_EQUAL(i, *map.get(i));
+            }
+
+            TEST(SourceUnchanged)
+            {
+                Map base;
+                for (int i = 0; i < N; ++i)
+                    base = base.insert(i, 10 * i);
+
+                Map::Transient builder(base);
+                for (int i = 0; i < N; i += 3)
+                    builder.remove(i);
+                for (int i = 1; i < N; i += 3)
+                    builder.insert(i, 7 * i);
+                for (int i = N; i < 2 * N; ++i)
+                    builder.insert(i, 10 * i);
+                Map map = builder.persistent();
+
+                CHECK_EQUAL(N, base.size());
+                for (int i = 0; i < N; ++i)
+                    CHECK_EQUAL(10 * i, *base.get(i));
+                CHECK_MISSING(N, base);
+
+                CHECK_EQUAL(2 * N - (N + 2) / 3, map.size());
+                for (int i = 0; i < 2 * N; ++i)
+                {
+                    if (i >= N)
+                        CHECK_EQUAL(10 * i, *map.get(i));
+                    else if (i % 3 == 0)
+                        CHECK_MISSING(i, map);
+                    else if (i % 3 == 1)
+                        CHECK_EQUAL(7 * i, *map.get(i));
+                    else
+                        CHECK_EQUAL(10 * i, *map.get(i));
+                }
+            }
+
+            TEST(Upsert)
+            {
+                Map::Transient counts;
+                for (int i = 0; i < 10 * N; ++i)
+                    counts.upsert(i % N, Increment(), 1);
+                counts.update(N, Increment());
+                Map map = counts.persistent();
+
+                CHECK_EQUAL(N, map.size());
+                for (int i = 0; i < N; ++i)
+                    CHECK_EQUAL(10, *map.get(i));
+            }
+
+            TEST(FrozenAfterPersistent)
+            {
+                Map::Transient builder;
+                for (int i = 0; i < N; ++i)
+                    builder.insert(i, i);
+                Map first = builder.persistent();
+
+                for (int i = 0; i < N; i += 2)
+                    builder.remove(i);
+                for (int i = 1; i < N; i += 2)
+                    builder.insert(i, -i);
+                Map second = builder.persistent();
+
+                for (int i = 0; i < N; ++i)
+                    builder.remove(i);
+
+                CHECK_EQUAL(0, builder.size());
+                CHECK_EQUAL(N, first.size());
+                CHECK_EQUAL(N / 2, second.size());
+                for (int i = 0; i < N; ++i)
+                {
+                    CHECK_EQUAL(i, *first.get(i));
+                    if (i % 2 == 0)
+                        CHECK_MISSING(i, second);
+                    else
+                        CHECK_EQUAL(-i, *second.get(i));
+                }
+            }
+        }
     }
 
     SUITE(LongHash)
@@ -413,6 +963,60 @@ SUITE(PersistentMap)
             CHECK_MISSING(keys[0], map);
         }
 
+        int sumValues(int const acc, int const, int const val)
+        {
+            return acc + val;
+        }
+
+        int plus(int const a, int const b)
+        {
+            return a + b;
+        }
+
+        bool notMultipleOfSeven(int const key, int const)
+        {
+            return key % 7 != 0;
+        }
+
+        int triple(int const val)
+        {
+            return 3 * val;
+        }
+
+        int same(int const val)
+        {
+            return val;
+        }
+
+        TEST(ParallelBulkOperations)
+        {
+            int const N = 100000;
+            Map map;
+            for (int i = 0; i < N; ++i)
+                map = map.insert(i, i % 1000);
+
+            int const expected = (N / 1000) * 499500;
+            for (size_t nrThreads = 1; nrThreads <= 8; nrThreads *= 2)
+                CHECK_EQUAL(expected,
+                            map.parallelReduce(0, sumValues, plus, nrThreads));
+
+            Map filtered = map.filter(notMultipleOfSeven, 4);
+            CHECK_EQUAL(N - (N + 6) / 7, filtered.size());
+            for (int i = 0; i < N; ++i)
+                CHECK_EQUAL(i % 7 != 0, filtered.contains(i));
+
+            Map tripled = map.mapValues(triple, 4);
+            CHECK_EQUAL(N, tripled.size());
+            for (int i = 0; i < N; ++i)
+                CHECK_EQUAL(3 * (i % 1000), *tripled.find(i));
+
+            // Nothing changes, so everything is shared.
+            CHECK(map.mapValues(same, 4).find(12345) == map.find(12345));
+            CHECK(map.filter(notMultipleOfSeven, 4).find(1) ==
+                  filtered.find(1));
+            CHECK(map.mapValues(same, 4) == map);
+        }
+
         TEST(HigherBitCollisions)
         {
             int keys[] = {
@@ -444,6 +1048,603 @@ SUITE(PersistentMap)
     }
 }
 
+// Hashes only the length and first character, to get collisions.
+hashType hashChars(char const* const s)
+{
+    size_t const n = strlen(s);
+    return n * 256 + (n > 0 ? s[0] : 0);
+}
+
+hashType hashString(std::string const s)
+{
+    return hashChars(s.c_str());
+}
+
+struct CountedKey
+{
+    static int copies;
+
+    int value;
+
+    explicit CountedKey(int const v)
+        : value(v)
+    {
+    }
+
+    CountedKey(CountedKey const& other)
+        : value(other.value)
+    {
+        ++copies;
+    }
+
+    bool operator==(CountedKey const& other) const
+    {
+        return value == other.value;
+    }
+
+    bool operator!=(CountedKey const& other) const
+    {
+        return value != other.value;
+    }
+
+    // Plain ints serve as probes.
+    bool operator==(int const other) const
+    {
+        return value == other;
+    }
+
+    friend std::ostream& operator<<(std::ostream& out, CountedKey const& key)
+    {
+        return out << key.value;
+    }
+
+    friend size_t hash_value(CountedKey const& key)
+    {
+        return key.value;
+    }
+};
+
+int CountedKey::copies = 0;
+
+hashType hashInt(int const value)
+{
+    return (hashType) value * 2654435761u;
+}
+
+hashType hashCounted(CountedKey const key)
+{
+    return hashInt(key.value);
+}
+
+// Probes for the keys above, hashed without building a key.
+namespace odf
+{
+namespace hash_trie
+{
+
+template<>
+struct ProbeHash<std::string, hashString>
+{
+    static hashType hash(char const* const s)
+    {
+        return hashChars(s);
+    }
+};
+
+template<>
+struct ProbeHash<CountedKey, hashCounted>
+{
+    static hashType hash(int const value)
+    {
+        return hashInt(value);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+SUITE(KeyPassing)
+{
+    typedef PersistentMap<std::string, int, hashString> StringMap;
+
+    TEST(ProbeLookup)
+    {
+        StringMap map;
+        std::vector<std::string> keys;
+        for (int i = 0; i < 2000; ++i)
+        {
+            std::string key(1 + i % 7, 'a' + i % 13);
+            key += char('0' + i / 91);
+            key += char('0' + i % 91);
+            keys.push_back(key);
+            map = map.insert(key, i);
+        }
+
+        for (int i = 0; i < 2000; ++i)
+        {
+            char const* probe = keys[i].c_str();
+            CHECK_EQUAL(map.find(keys[i]), map.find(probe));
+            CHECK_EQUAL(i, *map.find(probe));
+        }
+        CHECK(not map.contains("missing"));
+        CHECK(not map.contains("a"));
+        CHECK(not StringMap().contains("a"));
+
+        StringMap const one = StringMap().insert("key", 1);
+        CHECK(one.contains("key"));
+        CHECK(not one.contains("kex"));
+        CHECK(one.contains("key", hashChars("key")));
+
+        StringMap::Transient builder(map);
+        builder.remove(keys[5]);
+        CHECK(not builder.contains(keys[5].c_str()));
+        CHECK_EQUAL(6, *builder.find(keys[6].c_str()));
+        CHECK_EQUAL(7, *builder.find(keys[7].c_str(), hashString(keys[7])));
+    }
+
+    TEST(KeysAreNotCopiedPerLevel)
+    {
+        typedef PersistentMap<CountedKey, int, hashCounted> Map;
+
+        Map map;
+        for (int i = 0; i < 20000; ++i)
+            map = map.insert(CountedKey(i), i);
+
+        // Each operation copies the key once to call the hash function, and
+        // an insertion once more into the new leaf.
+        CountedKey::copies = 0;
+        CHECK_EQUAL(17, *map.find(CountedKey(17)));
+        CHECK_EQUAL(1, CountedKey::copies);
+
+        // Lookups by probe copy nothing.
+        CountedKey::copies = 0;
+        CHECK_EQUAL(17, *map.find(17));
+        CHECK(map.contains(19999) and not map.contains(20000));
+        CHECK_EQUAL(0, CountedKey::copies);
+
+        CountedKey::copies = 0;
+        map = map.insert(CountedKey(20000), 0).remove(CountedKey(5));
+        CHECK_EQUAL(3, CountedKey::copies);
+    }
+}
+
+SUITE(DeferredDeletion)
+{
+    // Counts live instances, to see when the nodes holding them are freed.
+    struct Counted
+    {
+        static int live;
+
+        int value;
+
+        Counted(int const v = 0)
+            : value(v)
+        {
+            ++live;
+        }
+
+        Counted(Counted const& other)
+            : value(other.value)
+        {
+            ++live;
+        }
+
+        ~Counted()
+        {
+            --live;
+        }
+
+        bool operator==(Counted const& other) const
+        {
+            return value == other.value;
+        }
+
+        bool operator!=(Counted const& other) const
+        {
+            return value != other.value;
+        }
+
+        friend std::ostream& operator<<(std::ostream& out, Counted const& c)
+        {
+            return out << c.value;
+        }
+
+        friend size_t hash_value(Counted const& c)
+        {
+            return c.value;
+        }
+    };
+
+    int Counted::live = 0;
+
+    hashType hashInt(int const key)
+    {
+        return (hashType) key * 2654435761u;
+    }
+
+    typedef PersistentMap<int, Counted, hashInt> CountedMap;
+
+    CountedMap const makeMap(int const n)
+    {
+        CountedMap map;
+        for (int i = 0; i < n; ++i)
+            map = map.insert(i, Counted(i));
+        return map;
+    }
+
+    TEST(DrainFreesInSteps)
+    {
+        {
+            CountedMap const map = makeMap(1000);
+            CHECK_EQUAL(1000, Counted::live);
+            DeferredDeletion::enable();
+        }
+        CHECK_EQUAL(1000, Counted::live);
+        CHECK_EQUAL(1u, DeferredDeletion::pending());
+
+        CHECK_EQUAL(1u, DeferredDeletion::drain(1));
+        CHECK(DeferredDeletion::pending() > 1);
+        CHECK_EQUAL(1000, Counted::live);
+
+        int steps = 0;
+        while (DeferredDeletion::drain(10) > 0)
+            ++steps;
+        CHECK(steps > 10);
+        CHECK_EQUAL(0u, DeferredDeletion::pending());
+        CHECK_EQUAL(0, Counted::live);
+
+        DeferredDeletion::enable(false);
+    }
+
+    TEST(SharedNodesStayAlive)
+    {
+        DeferredDeletion::enable();
+        CountedMap const kept = makeMap(100);
+        {
+            CountedMap const changed = kept.insert(500, Counted(500));
+        }
+        while (DeferredDeletion::drain(10) > 0)
+            ;
+        DeferredDeletion::enable(false);
+
+        CHECK_EQUAL(100u, kept.size());
+        for (int i = 0; i < 100; ++i)
+            CHECK_EQUAL(i, kept.getVal(i, Counted(-1)).value);
+    }
+
+    TEST(PurgeInternTable)
+    {
+        InternTable<int, Counted> table;
+        {
+            CountedMap const map = makeMap(10000).interned(table);
+            CHECK_EQUAL(0u, table.purge());
+            DeferredDeletion::enable();
+        }
+        size_t const held = table.size();
+        CHECK(held > 10000);
+
+        CHECK_EQUAL(held, table.purge());
+        CHECK_EQUAL(0u, table.size());
+        CHECK_EQUAL(1u, DeferredDeletion::pending());
+        CHECK_EQUAL(10000, Counted::live);
+
+        while (DeferredDeletion::drain(100) > 0)
+            ;
+        DeferredDeletion::enable(false);
+        CHECK_EQUAL(0, Counted::live);
+    }
+
+    TEST(DisabledFreesAtOnce)
+    {
+        {
+            CountedMap const map = makeMap(1000);
+        }
+        CHECK_EQUAL(0u, DeferredDeletion::pending());
+        CHECK_EQUAL(0, Counted::live);
+    }
+}
+
+SUITE(Snapshot)
+{
+    hashType eightBitHash(int const val)
+    {
+        return val % 256;
+    }
+
+    hashType spreadHash(int const val)
+    {
+        return (hashType) val * 2654435761u;
+    }
+
+    typedef PersistentMap<int, int, eightBitHash> Map;
+    typedef MappedMap<int, int, eightBitHash> Mapped;
+
+    struct TempFile
+    {
+        TempFile()
+        {
+            char name[] = "/tmp/testSnapshotXXXXXX";
+            int fd = mkstemp(name);
+            if (fd >= 0)
+                close(fd);
+            path = name;
+        }
+
+        ~TempFile()
+        {
+            unlink(path.c_str());
+        }
+
+        template<typename M>
+        bool save(M const& map) const
+        {
+            std::ofstream out(path.c_str(), std::ios::binary);
+            return map.writeSnapshot(out);
+        }
+
+        uint64_t length() const
+        {
+            std::ifstream in(path.c_str(), std::ios::binary | std::ios::ate);
+            return in.tellg();
+        }
+
+        std::string path;
+    };
+
+    void checkRoundTrip(Map const& map, int const maxKey)
+    {
+        TempFile file;
+        CHECK(file.save(map));
+
+        Mapped mapped(file.path.c_str());
+        CHECK(mapped.isOpen());
+        CHECK_EQUAL(map.size(), mapped.size());
+        for (int i = -1; i <= maxKey + 1; ++i)
+        {
+            CHECK_EQUAL(map.contains(i), mapped.contains(i));
+            CHECK_EQUAL(map.getVal(i, -1), mapped.getVal(i, -1));
+        }
+    }
+
+    TEST(RoundTrip)
+    {
+        checkRoundTrip(Map(), 10);
+        checkRoundTrip(Map().insert(7, 70), 10);
+        checkRoundTrip(Map().insert(257, 1).insert(513, 2).insert(769, 3),
+                       1000);
+
+        Map map;
+        for (int i = 0; i < 1000; ++i)
+            map = map.insert(i, 3 * i);
+        checkRoundTrip(map, 1000);
+        checkRoundTrip(map.insert(5000, 1).remove(4).remove(260), 5000);
+    }
+
+    TEST(LargeMap)
+    {
+        typedef PersistentMap<int, int, spreadHash> BigMap;
+
+        BigMap::Transient builder;
+        for (int i = 0; i < 100000; ++i)
+            builder.insert(i, i % 77);
+        BigMap const map = builder.persistent();
+
+        TempFile file;
+        CHECK(file.save(map));
+
+        MappedMap<int, int, spreadHash> mapped(file.path.c_str());
+        CHECK_EQUAL(100000u, mapped.size());
+        for (int i = 0; i < 100000; ++i)
+            CHECK_EQUAL(i % 77, *mapped.find(i));
+        CHECK(not mapped.contains(100000));
+        CHECK(not mapped.contains(-5));
+    }
+
+    TEST(TruncatedSnapshot)
+    {
+        typedef PersistentMap<int, int, spreadHash> BigMap;
+        typedef MappedMap<int, int, spreadHash> BigMapped;
+
+        BigMap::Transient builder;
+        for (int i = 0; i < 100000; ++i)
+            builder.insert(i, i % 77);
+        BigMap const map = builder.persistent();
+
+        TempFile file;
+        CHECK(file.save(map));
+        std::ifstream in(file.path.c_str(), std::ios::binary);
+        std::string const contents((std::istreambuf_iterator<char>(in)),
+                                   std::istreambuf_iterator<char>());
+        in.close();
+
+        // As left by a writer that was killed a third of the way through.
+        size_t const third = contents.size() / 3;
+        CHECK_EQUAL(0, truncate(file.path.c_str(), third));
+        CHECK(not BigMapped(file.path.c_str()).isOpen());
+
+        // The same with a header that claims otherwise, as some other damage
+        // might produce. Lookups must stay within the file.
+        SnapshotHeader header;
+        memcpy(&header, contents.data(), sizeof(header));
+        header.length = third;
+        {
+            std::ofstream out(file.path.c_str(), std::ios::binary);
+            out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+            out.write(contents.data() + sizeof(header),
+                      third - sizeof(header));
+        }
+
+        BigMapped mapped(file.path.c_str());
+        CHECK(mapped.isOpen());
+        size_t found = 0;
+        for (int i = 0; i < 100000; ++i)
+        {
+            int const* vp = mapped.find(i);
+            if (vp)
+            {
+                CHECK_EQUAL(i % 77, *vp);
+                ++found;
+            }
+        }
+        CHECK(found < 100000);
+    }
+
+    TEST(RejectsOtherFiles)
+    {
+        CHECK(not Mapped("/nonexistent/snapshot").isOpen());
+        CHECK_EQUAL(0u, Mapped("/nonexistent/snapshot").size());
+        CHECK(not Mapped("/nonexistent/snapshot").contains(1));
+
+        TempFile file;
+        CHECK(file.save(Map().insert(1, 2)));
+        CHECK(Mapped(file.path.c_str()).isOpen());
+        CHECK(not (MappedMap<int, double, eightBitHash>(
+                       file.path.c_str()).isOpen()));
+
+        {
+            std::ofstream out(file.path.c_str());
+            out << std::string(100, 'x');
+        }
+        CHECK(not Mapped(file.path.c_str()).isOpen());
+    }
+
+    typedef SnapshotLog<int, int> Log;
+
+    void checkCurrentVersion(TempFile const& file, Map const& map,
+                             int const maxKey)
+    {
+        Mapped mapped(file.path.c_str());
+        CHECK(mapped.isOpen());
+        CHECK_EQUAL(map.size(), mapped.size());
+        for (int i = -1; i <= maxKey + 1; ++i)
+            CHECK_EQUAL(map.getVal(i, -1), mapped.getVal(i, -1));
+    }
+
+    TEST(LogAppendsOnlyNewNodes)
+    {
+        TempFile file;
+        unlink(file.path.c_str());
+        Log log(file.path.c_str());
+        CHECK(log.isOpen());
+        checkCurrentVersion(file, Map(), 10);
+
+        Map map;
+        for (int i = 0; i < 2000; ++i)
+            map = map.insert(i, i);
+        CHECK(map.appendSnapshot(log));
+        checkCurrentVersion(file, map, 2000);
+        uint64_t const full = log.length();
+        size_t const nrNodes = log.nrKnownNodes();
+
+        CHECK(map.appendSnapshot(log));
+        CHECK_EQUAL(full + sizeof(SnapshotRoot), log.length());
+        CHECK_EQUAL(nrNodes, log.nrKnownNodes());
+
+        Map const next = map.insert(5000, 1).insert(3, 33);
+        uint64_t const before = log.length();
+        CHECK(next.appendSnapshot(log));
+        CHECK(log.length() - before < full / 10);
+        CHECK_EQUAL(nrNodes, log.nrKnownNodes());
+        checkCurrentVersion(file, next, 5000);
+
+        Map last = next;
+        for (int i = 0; i < 2000; i += 3)
+            last = last.remove(i);
+        CHECK(last.appendSnapshot(log));
+        checkCurrentVersion(file, last, 5000);
+
+        CHECK(Map().appendSnapshot(log));
+        CHECK_EQUAL(0u, log.nrKnownNodes());
+        checkCurrentVersion(file, Map(), 10);
+
+        CHECK(map.appendSnapshot(log));
+        checkCurrentVersion(file, map, 2000);
+    }
+
+    TEST(LogKeepsSharedNodesAlive)
+    {
+        TempFile file;
+        unlink(file.path.c_str());
+        Log log(file.path.c_str());
+
+        Map map;
+        for (int i = 0; i < 1000; ++i)
+            map = map.insert(i, i);
+        CHECK(map.appendSnapshot(log));
+
+        // The nodes of the first version are released here, except for
+        // the ones the log holds on to. New nodes must not be mistaken for
+        // them even if they end up at the same addresses.
+        map = Map();
+        for (int round = 1; round < 4; ++round)
+        {
+            Map other;
+            for (int i = 0; i < 1000; ++i)
+                other = other.insert(i, round * i);
+            CHECK(other.appendSnapshot(log));
+            checkCurrentVersion(file, other, 1000);
+        }
+    }
+
+    TEST(LogReopen)
+    {
+        TempFile file;
+        unlink(file.path.c_str());
+
+        Map map;
+        for (int i = 0; i < 500; ++i)
+            map = map.insert(i, 2 * i);
+        uint64_t length;
+        {
+            Log log(file.path.c_str());
+            CHECK(map.appendSnapshot(log));
+            CHECK(map.insert(1, -1).appendSnapshot(log));
+            length = log.length();
+        }
+        checkCurrentVersion(file, map.insert(1, -1), 500);
+
+        // An unfinished append leaves the previous version current.
+        {
+            std::ofstream out(file.path.c_str(),
+                              std::ios::binary | std::ios::app);
+            out << std::string(100, 'x');
+        }
+        checkCurrentVersion(file, map.insert(1, -1), 500);
+
+        {
+            Log log(file.path.c_str());
+            CHECK(log.isOpen());
+            CHECK_EQUAL(length, log.length());
+            CHECK(map.remove(7).appendSnapshot(log));
+        }
+        checkCurrentVersion(file, map.remove(7), 500);
+
+        // A torn append whose tail happens to look like a root record.
+        {
+            std::string const junk(96, '\xff');
+            SnapshotRoot record;
+            memset(&record, 0, sizeof(record));
+            record.kind  = SnapshotNode::root;
+            record.check = snapshotRootCheck;
+            record.size  = 12345;
+            record.root  = file.length() + junk.size() - 8;
+
+            std::ofstream out(file.path.c_str(),
+                              std::ios::binary | std::ios::app);
+            out << junk;
+            out.write(reinterpret_cast<char const*>(&record), sizeof(record));
+        }
+        checkCurrentVersion(file, map.remove(7), 500);
+
+        CHECK(not (SnapshotLog<int, double>(file.path.c_str()).isOpen()));
+
+        TempFile plain;
+        CHECK(plain.save(map));
+        CHECK(not Log(plain.path.c_str()).isOpen());
+        checkRoundTrip(map, 500);
+    }
+}
+
 int main()
 {
     return UnitTest::RunAllTests();
@@ -0,0 +1,320 @@
+/* -*-c++-*- */
+
+// On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
+#include <UnitTest++.h>
+
+#include <string.h>
+
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "PersistentSet.hpp"
+
+using namespace odf::hash_trie;
+
+
+hashType hashChars(char const* const s)
+{
+    return strlen(s) * 256 + (s[0] ? s[0] : 0);
+}
+
+hashType hashString(std::string const s)
+{
+    return hashChars(s.c_str());
+}
+
+// Strings can be looked up by char const* probes, hashed without building a
+// string.
+namespace odf
+{
+namespace hash_trie
+{
+
+template<>
+struct ProbeHash<std::string, hashString>
+{
+    static hashType hash(char const* const s)
+    {
+        return hashChars(s);
+    }
+};
+
+} // namespace hash_trie
+} // namespace odf
+
+SUITE(PersistentSet)
+{
+    SUITE(EightBitHash)
+    {
+        hashType hashfun(int const val)
+        {
+            return val % 256;
+        }
+
+        typedef PersistentSet<int, hashfun> Set;
+
+        Set fromRule(int const n, int const mod, int const rest)
+        {
+            Set::Transient builder;
+            for (int i = 0; i < n; ++i)
+                if (i % mod == rest)
+                    builder.insert(i);
+            return builder.persistent();
+        }
+
+        std::set<int> contents(Set const& set)
+        {
+            return std::set<int>(set.begin(), set.end());
+        }
+
+        bool sameRoot(Set const& a, Set const& b)
+        {
+            return a.size() > 0 and &*a.begin() == &*b.begin();
+        }
+
+        TEST(Equality)
+        {
+            Set a = fromRule(700, 3, 1);
+            Set b = fromRule(700, 1, 0).subtract(fromRule(700, 3, 0))
+                .subtract(fromRule(700, 3, 2));
+
+            CHECK(a == b);
+            CHECK(a != b.insert(0));
+            CHECK(a != b.remove(1));
+            CHECK(Set() == a.subtract(b));
+#ifdef ODF_HASH_TRIE_MERKLE
+            CHECK_EQUAL(a.contentHash(), b.contentHash());
+#endif
+        }
+
+        TEST(EmptyOperands)
+        {
+            Set a = fromRule(300, 1, 0);
+
+            CHECK_EQUAL(300, a.unite(Set()).size());
+            CHECK_EQUAL(300, Set().unite(a).size());
+            CHECK_EQUAL(0, a.intersect(Set()).size());
+            CHECK_EQUAL(0, Set().subtract(a).size());
+            CHECK_EQUAL(300, a.subtract(Set()).size());
+            CHECK(Set().isSubsetOf(a));
+            CHECK(not a.isSubsetOf(Set()));
+        }
+
+        TEST(MatchesStdSet)
+        {
+            for (int m = 1; m < 6; ++m)
+            {
+                for (int n = 1; n < 6; ++n)
+                {
+                    Set a = fromRule(700, m, 0);
+                    Set b = fromRule(900, n, n - 1);
+                    std::set<int> sa = contents(a);
+                    std::set<int> sb = contents(b);
+
+                    std::set<int> u(sa), i, d;
+                    u.insert(sb.begin(), sb.end());
+                    for (std::set<int>::const_iterator it = sa.begin();
+                         it != sa.end();
+                         ++it)
+                    {
+                        if (sb.count(*it))
+                            i.insert(*it);
+                        else
+                            d.insert(*it);
+                    }
+
+                    CHECK(u == contents(a.unite(b)));
+                    CHECK_EQUAL(u.size(), a.unite(b).size());
+                    CHECK(i == contents(a.intersect(b)));
+                    CHECK_EQUAL(i.size(), a.intersect(b).size());
+                    CHECK(d == contents(a.subtract(b)));
+                    CHECK_EQUAL(d.size(), a.subtract(b).size());
+                    CHECK_EQUAL(d.empty(), a.isSubsetOf(b));
+                }
+            }
+        }
+
+        TEST(SharedVersions)
+        {
+            Set base = fromRule(3000, 1, 0);
+            Set next = base.remove(17).remove(273).insert(5000).insert(5256);
+
+            CHECK(sameRoot(base, base.unite(base)));
+            CHECK(sameRoot(base, base.intersect(base)));
+            CHECK_EQUAL(0, base.subtract(base).size());
+            CHECK(base.isSubsetOf(base));
+
+            CHECK(sameRoot(base, base.unite(base.remove(5))));
+            CHECK(sameRoot(base, base.intersect(base.insert(7000))));
+            CHECK(base.remove(5).isSubsetOf(base));
+            CHECK(not next.isSubsetOf(base));
+
+            CHECK(contents(next.subtract(base)) ==
+                  contents(Set().insert(5000).insert(5256)));
+            CHECK(contents(base.subtract(next)) ==
+                  contents(Set().insert(17).insert(273)));
+            CHECK_EQUAL(3002, base.unite(next).size());
+            CHECK_EQUAL(2998, base.intersect(next).size());
+        }
+
+        TEST(ContainsMany)
+        {
+            Set set = fromRule(50000, 3, 1);
+
+            std::vector<int> keys;
+            for (int i = -5; i < 50100; i += 7)
+                keys.push_back(i);
+
+            std::vector<bool> found;
+            set.containsMany(keys, found);
+            CHECK_EQUAL(keys.size(), found.size());
+            for (size_t i = 0; i < keys.size(); ++i)
+                CHECK_EQUAL(set.contains(keys[i]), bool(found[i]));
+
+            Set().containsMany(keys, found);
+            CHECK(std::find(found.begin(), found.end(), true) == found.end());
+        }
+    }
+
+    SUITE(LongHash)
+    {
+        hashType hashfun(int const val)
+        {
+            return (hashType) val * 2654435761u;
+        }
+
+        typedef PersistentSet<int, hashfun> Set;
+
+        TEST(LargeSets)
+        {
+            Set::Transient evens, thirds;
+            for (int i = 0; i < 30000; ++i)
+            {
+                if (i % 2 == 0)
+                    evens.insert(i);
+                if (i % 3 == 0)
+                    thirds.insert(i);
+            }
+            Set a = evens.persistent();
+            Set b = thirds.persistent();
+
+            Set both = a.intersect(b);
+
+            CHECK_EQUAL(20000, a.unite(b).size());
+            CHECK_EQUAL(5000, both.size());
+            CHECK_EQUAL(10000, a.subtract(b).size());
+            CHECK(both.isSubsetOf(a));
+            CHECK(both.isSubsetOf(b));
+            CHECK(not a.isSubsetOf(a.unite(b).remove(0)));
+            for (int i = 0; i < 30000; ++i)
+                CHECK_EQUAL(i % 6 == 0, both.contains(i));
+        }
+
+        TEST(Interning)
+        {
+            int const n = 12;
+            std::vector<Set> tenants;
+            for (int t = 0; t < n; ++t)
+            {
+                Set::Transient keys;
+                for (int i = 0; i < 3000; ++i)
+                    keys.insert(t % 2 ? i : 2999 - i);
+                Set set = keys.persistent();
+                if (t % 3 == 0)
+                    set = set.insert(5000).remove(5000);
+                else if (t % 3 == 1)
+                    set = set.insert(5000 + t);
+                tenants.push_back(set);
+            }
+
+            InternTable<int, bool> table;
+            std::vector<Set> interned;
+            for (int t = 0; t < n; ++t)
+                interned.push_back(tenants[t].interned(table));
+
+            std::vector<Set> same;
+            for (int t = 0; t < n; ++t)
+            {
+                CHECK(interned[t] == tenants[t]);
+                if (t % 3 != 1)
+                    same.push_back(interned[t]);
+            }
+
+            SharedMemoryUsage const usage =
+                Set::memoryUsage(same.begin(), same.end());
+            for (size_t i = 0; i < same.size(); ++i)
+                CHECK_EQUAL(0u, usage.unique[i].total());
+
+            size_t const before = Set::memoryUsage(
+                tenants.begin(), tenants.end()).shared.total();
+            SharedMemoryUsage const after =
+                Set::memoryUsage(interned.begin(), interned.end());
+            size_t total = after.shared.total();
+            for (int t = 0; t < n; ++t)
+                total += after.unique[t].total();
+            CHECK_EQUAL(0u, before);
+            CHECK(total * 5 < tenants[0].memoryUsage().total() * n);
+
+            CHECK(interned[0].interned(table) == interned[0]);
+            size_t const held = table.size();
+            CHECK_EQUAL(0u, table.purge());
+
+            tenants.clear();
+            interned.clear();
+            CHECK(table.purge() > 0);
+            CHECK(table.size() < held);
+            same.clear();
+            table.purge();
+            CHECK_EQUAL(0u, table.size());
+        }
+
+        TEST(Stats)
+        {
+            Set::Transient keys;
+            for (int i = 0; i < 30000; ++i)
+                keys.insert(i);
+            TrieStats stats = keys.persistent().stats();
+
+            size_t total = 0;
+            for (size_t d = 0; d < stats.depths.size(); ++d)
+                total += stats.depths[d];
+            CHECK_EQUAL(30000u, total);
+            CHECK(stats.bucketSizes.empty());
+            CHECK(stats.averageDepth() > 2.0 and stats.averageDepth() < 4.0);
+            CHECK(stats.nrArrays > 0);
+            CHECK_EQUAL(0u, stats.nrSparseArrays);
+
+            CHECK(Set().stats().depths.empty());
+        }
+    }
+
+    SUITE(StringKeys)
+    {
+        typedef PersistentSet<std::string, hashString> Set;
+
+        TEST(ProbeLookup)
+        {
+            char const* words[] = { "apple", "apply", "ample", "a", "b", "" };
+
+            Set::Transient builder;
+            for (size_t i = 0; i < 5; ++i)
+                builder.insert(words[i]);
+            CHECK(builder.contains("apply"));
+            CHECK(builder.contains("apply", hashChars("apply")));
+
+            Set const set = builder.persistent();
+            for (size_t i = 0; i < 5; ++i)
+                CHECK(set.contains(words[i]));
+            CHECK(not set.contains(words[5]));
+            CHECK(not set.contains("apples"));
+            CHECK(not set.contains("amply", hashChars("amply")));
+        }
+    }
+}
+
+int main()
+{
+    return UnitTest::RunAllTests();
+}
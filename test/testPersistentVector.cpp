@@ -0,0 +1,165 @@
+/* -*-c++-*- */
+
+// On Ubuntu, set CPLUS_INCLUDE_PATH to /usr/include/unittest++ for this!
+#include <UnitTest++.h>
+
+#include <vector>
+
+#include "PersistentVector.hpp"
+
+using namespace odf::hash_trie;
+
+
+SUITE(PersistentVector)
+{
+    typedef PersistentVector<int> Vector;
+
+    // Enough elements for three levels of inner nodes.
+    int const N = fanout * fanout * fanout + fanout + 3;
+
+    Vector const makeVector(int const n)
+    {
+        Vector v;
+        for (int i = 0; i < n; ++i)
+            v = v.push_back(i);
+        return v;
+    }
+
+    void checkContents(Vector const& v, std::vector<int> const& expected)
+    {
+        CHECK_EQUAL(expected.size(), v.size());
+        for (size_t i = 0; i < expected.size(); ++i)
+            CHECK_EQUAL(expected[i], v.at(i));
+
+        size_t i = 0;
+        for (Vector::const_iterator it = v.begin(); it != v.end(); ++it, ++i)
+            CHECK_EQUAL(expected[i], *it);
+        CHECK_EQUAL(expected.size(), i);
+    }
+
+    TEST(Empty)
+    {
+        Vector const v;
+        CHECK_EQUAL(0u, v.size());
+        CHECK(v.empty());
+        CHECK(v.begin() == v.end());
+        CHECK_EQUAL(-1, v.getVal(0, -1));
+        CHECK_EQUAL(0u, v.pop_back().size());
+        CHECK_EQUAL(0u, v.memoryUsage().total());
+    }
+
+    TEST(PushBack)
+    {
+        std::vector<int> expected;
+        Vector v;
+        for (int i = 0; i < N; ++i)
+        {
+            Vector const next = v.push_back(i);
+            CHECK_EQUAL(size_t(i), v.size());
+            v = next;
+            expected.push_back(i);
+        }
+        checkContents(v, expected);
+        CHECK_EQUAL(N - 1, v[N - 1]);
+        CHECK_EQUAL(-1, v.getVal(N, -1));
+    }
+
+    TEST(Set)
+    {
+        Vector const v = makeVector(N);
+        Vector w = v;
+        std::vector<int> expected;
+        for (int i = 0; i < N; ++i)
+            expected.push_back(i);
+
+        for (int i = 0; i < N; i += 7)
+        {
+            w = w.set(i, -i);
+            expected[i] = -i;
+        }
+        w = w.set(N - 1, 1000);
+        expected[N - 1] = 1000;
+
+        checkContents(w, expected);
+        for (int i = 0; i < N; ++i)
+            CHECK_EQUAL(i, v.at(i));
+    }
+
+    TEST(PopBack)
+    {
+        Vector v = makeVector(N);
+        std::vector<int> expected;
+        for (int i = 0; i < N; ++i)
+            expected.push_back(i);
+
+        while (not v.empty())
+        {
+            Vector const next = v.pop_back();
+            CHECK_EQUAL(expected.size(), v.size());
+            v = next;
+            expected.pop_back();
+            if (expected.size() % (fanout / 2 + 1) == 0)
+                checkContents(v, expected);
+        }
+        CHECK_EQUAL(0u, v.memoryUsage().total());
+    }
+
+    TEST(PopAndPushAcrossLevels)
+    {
+        int const n = fanout * fanout + fanout;
+        Vector v = makeVector(n + 1);
+        Vector const popped = v.pop_back().pop_back();
+        v = popped.push_back(-1).push_back(-2).push_back(-3);
+
+        std::vector<int> expected;
+        for (int i = 0; i < n - 1; ++i)
+            expected.push_back(i);
+        checkContents(popped, expected);
+
+        expected.push_back(-1);
+        expected.push_back(-2);
+        expected.push_back(-3);
+        checkContents(v, expected);
+    }
+
+    TEST(Transient)
+    {
+        Vector const source = makeVector(100);
+
+        Vector::Transient t(source);
+        for (int i = 100; i < N; ++i)
+            t.push_back(i);
+        t.set(5, -5).set(N - 2, -1).pop_back();
+        CHECK_EQUAL(size_t(N - 1), t.size());
+        Vector const result = t.persistent();
+
+        t.set(6, -6).push_back(0);
+        CHECK_EQUAL(6, result.at(6));
+        CHECK_EQUAL(-6, t.at(6));
+
+        std::vector<int> expected;
+        for (int i = 0; i < N - 1; ++i)
+            expected.push_back(i);
+        expected[5] = -5;
+        expected[N - 2] = -1;
+        checkContents(result, expected);
+
+        CHECK_EQUAL(100u, source.size());
+        for (int i = 0; i < 100; ++i)
+            CHECK_EQUAL(i, source.at(i));
+    }
+
+    TEST(SharesUnchangedNodes)
+    {
+        Vector const v = makeVector(N);
+        size_t const whole = v.memoryUsage().total();
+        Vector const w = v.set(N / 2, 0);
+        CHECK_EQUAL(whole, w.memoryUsage().total());
+        CHECK(whole > size_t(N) * sizeof(int));
+    }
+}
+
+int main()
+{
+    return UnitTest::RunAllTests();
+}
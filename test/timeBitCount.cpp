@@ -0,0 +1,273 @@
+/* -*-c++-*- */
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <stdlib.h>
+#include <sys/times.h>
+
+#include "hash_trie.hpp"
+
+using namespace odf::hash_trie;
+
+using std::string;
+using std::vector;
+using std::cout;
+using std::cerr;
+using std::endl;
+
+class Stopwatch
+{
+private:
+    bool const useCpuTime_;
+
+    long accumulated_;
+    long start_;
+    bool isRunning_;
+
+    tms mutable tmsCurrent_;
+
+    long time() const
+    {
+        clock_t res = times(&tmsCurrent_);
+        if (res < 0)
+            throw "Cannot determine user time.";
+
+    	if (useCpuTime_)
+            return tmsCurrent_.tms_utime;
+        else
+            return res;
+    }
+
+public:
+    Stopwatch(bool useCpuTime = true)
+        : useCpuTime_(useCpuTime),
+          accumulated_(0),
+          start_(0),
+          isRunning_(false)
+    {
+    }
+    
+    string mode() const
+    {
+    	if (useCpuTime_)
+            return "CPU";
+        else
+            return "Real";
+    }
+    
+    void resume()
+    {
+        if (!isRunning_)
+        {
+            isRunning_ = true;
+            start_ = time();
+        }
+    }
+
+    void start()
+    {
+        accumulated_ = 0;
+        isRunning_ = true;
+        start_ = time();
+    }
+    
+    void stop()
+    {
+        if (isRunning_)
+        {
+            accumulated_ += time() - start_;
+            isRunning_ = false;
+        }
+    }
+    
+    /**
+     * Reports the elapsed time on this timer in milliseconds.
+     */
+    long elapsed() const
+    {
+        static long clktck = 0;
+
+        if (clktck == 0 and (clktck = sysconf(_SC_CLK_TCK)) <= 0)
+            throw "Cannot determine system clock rate";
+
+    	return (accumulated_ + (isRunning_ ? time() - start_ : 0))
+            * 1000 / clktck;
+    }
+    
+    string format() const
+    {
+        return format(elapsed());
+    }
+    
+    static string format(long const milliseconds)
+    {
+        std::stringstream ss;
+    	ss << milliseconds / 10 / 100.0 << " seconds";
+        return ss.str();
+    }
+};
+
+
+
+// ----------------------------------------------------------------------------
+// The variants to compare. Each computes the child index for a bit, as
+// indexForBit does on every hop through a trie.
+// ----------------------------------------------------------------------------
+
+indexType portableIndex(hashType const bitmap, hashType const bit)
+{
+    return portableBitCount(bitmap & (bit - 1));
+}
+
+indexType libraryIndex(hashType const bitmap, hashType const bit)
+{
+    return indexForBit(bitmap, bit);
+}
+
+#if defined(__GNUC__) and (defined(__x86_64__) or defined(__i386__))
+#define HAVE_TARGET_VARIANTS 1
+
+__attribute__((target("popcnt")))
+indexType popcntIndex(hashType const bitmap, hashType const bit)
+{
+    return __builtin_popcount(bitmap & (bit - 1));
+}
+
+__attribute__((target("popcnt,bmi2")))
+indexType bzhiIndex(hashType const bitmap, hashType const position)
+{
+    return __builtin_popcount(__builtin_ia32_bzhi_si(bitmap, position));
+}
+
+// Functions compiled for a wider target cannot be inlined into ordinary
+// ones, so these loops carry the target attribute themselves.
+__attribute__((target("popcnt")))
+unsigned long runPopcnt(vector<hashType> const& maps,
+                        vector<hashType> const& bits,
+                        int const rounds)
+{
+    unsigned long sum = 0;
+    for (int r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < maps.size(); ++i)
+            sum += popcntIndex(maps[i], bits[i]);
+    return sum;
+}
+
+__attribute__((target("popcnt,bmi2")))
+unsigned long runBzhi(vector<hashType> const& maps,
+                      vector<hashType> const& positions,
+                      int const rounds)
+{
+    unsigned long sum = 0;
+    for (int r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < maps.size(); ++i)
+            sum += bzhiIndex(maps[i], positions[i]);
+    return sum;
+}
+#endif
+
+typedef indexType (*IndexFunction)(hashType, hashType);
+
+
+// The inner loop is instantiated once per variant so that each call can be
+// inlined; the function pointer version shows the cost of naive dispatch.
+template<indexType (*F)(hashType, hashType)>
+unsigned long runDirect(vector<hashType> const& maps,
+                        vector<hashType> const& bits,
+                        int const rounds)
+{
+    unsigned long sum = 0;
+    for (int r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < maps.size(); ++i)
+            sum += F(maps[i], bits[i]);
+    return sum;
+}
+
+unsigned long runIndirect(IndexFunction const f,
+                          vector<hashType> const& maps,
+                          vector<hashType> const& bits,
+                          int const rounds)
+{
+    unsigned long sum = 0;
+    for (int r = 0; r < rounds; ++r)
+        for (size_t i = 0; i < maps.size(); ++i)
+            sum += f(maps[i], bits[i]);
+    return sum;
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        cerr << "Missing argument: number of rounds." << endl;
+        return 1;
+    }
+
+    int const rounds = atoi(argv[1]);
+    size_t const N = 1 << 16;
+
+    vector<hashType> maps(N);
+    vector<hashType> bits(N);
+    vector<hashType> positions(N);
+
+    srand(123456789);
+
+    for (size_t i = 0; i < N; ++i)
+    {
+        maps[i] = (hashType(rand()) << 16) ^ hashType(rand());
+        positions[i] = rand() % 32;
+        bits[i] = hashType(1) << positions[i];
+    }
+
+    cout << "Hardware popcount in library: "
+         << (hasHardwareBitCount() ? "yes" : "no") << endl;
+
+    Stopwatch stopWatch;
+    unsigned long expected = 0;
+
+    stopWatch.start();
+    expected = runDirect<portableIndex>(maps, bits, rounds);
+    stopWatch.stop();
+    cout << "Portable (SWAR):      " << stopWatch.format() << endl;
+
+    stopWatch.start();
+    unsigned long check = runDirect<libraryIndex>(maps, bits, rounds);
+    stopWatch.stop();
+    cout << "Library (dispatched): " << stopWatch.format() << endl;
+    if (check != expected)
+        cerr << "  *** results differ ***" << endl;
+
+#ifdef HAVE_TARGET_VARIANTS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("popcnt"))
+    {
+        stopWatch.start();
+        check = runPopcnt(maps, bits, rounds);
+        stopWatch.stop();
+        cout << "POPCNT (compiled in): " << stopWatch.format() << endl;
+        if (check != expected)
+            cerr << "  *** results differ ***" << endl;
+
+        stopWatch.start();
+        check = runIndirect(popcntIndex, maps, bits, rounds);
+        stopWatch.stop();
+        cout << "POPCNT (via pointer): " << stopWatch.format() << endl;
+        if (check != expected)
+            cerr << "  *** results differ ***" << endl;
+    }
+    if (__builtin_cpu_supports("popcnt") and __builtin_cpu_supports("bmi2"))
+    {
+        stopWatch.start();
+        check = runBzhi(maps, positions, rounds);
+        stopWatch.stop();
+        cout << "POPCNT with BZHI:     " << stopWatch.format() << endl;
+        if (check != expected)
+            cerr << "  *** results differ ***" << endl;
+    }
+#endif
+
+    return 0;
+}
@@ -1,12 +1,22 @@
 /* -*-c++-*- */
 
+#include <algorithm>
+#include <fstream>
+#include <iostream>
 #include <string>
 #include <sstream>
+#include <vector>
+#include <utility>
 #include <stdlib.h>
 #include <sys/times.h>
+#include <unistd.h>
 #include <boost/unordered_map.hpp>
 
 #include "PersistentMap.hpp"
+#include "MappedMap.hpp"
+#include "CompactMap.hpp"
+#include "PersistentIntMap.hpp"
+#include "PersistentVector.hpp"
 
 using namespace odf::hash_trie;
 
@@ -17,6 +27,44 @@ hashType hashfun(int const val)
 
 typedef PersistentMap<int, int, hashfun> Map;
 
+struct Increment
+{
+    int operator()(int const n) const
+    {
+        return n + 1;
+    }
+};
+typedef CompactMap<int, int, hashfun> CMap;
+
+long sumValues(long const acc, int const, int const val)
+{
+    return acc + val;
+}
+
+long plus(long const a, long const b)
+{
+    return a + b;
+}
+
+bool isOdd(int const key, int const)
+{
+    return key % 2 != 0;
+}
+
+struct ChangeCounter
+{
+    ChangeCounter()
+        : count(0)
+    {
+    }
+
+    void added(int const, int const) { ++count; }
+    void removed(int const, int const) { ++count; }
+    void changed(int const, int const, int const) { ++count; }
+
+    long count;
+};
+
 using boost::unordered_map;
 using std::string;
 using std::cout;
@@ -162,6 +210,37 @@ int main(int argc, char** argv)
 
     stopWatch.start();
 
+    double sumG = 0.0;
+    std::vector<int> batch;
+    std::vector<int const*> found;
+    for (int i = N / 2; i < N; i += 200)
+    {
+        batch.assign(values + i, values + std::min(i + 200, N));
+        map.getMany(batch, found);
+        for (size_t k = 0; k < found.size(); ++k)
+            sumG += *found[k];
+    }
+
+    cerr << "  Time for " << N/2 << " queries in batches of 200: "
+         << stopWatch.format() << endl;
+
+    if (sumG != sumA)
+        cerr << "Results don't match!" << endl;
+
+    stopWatch.start();
+
+    size_t visited = 0;
+    for (Map::const_iterator iter = map.begin(); iter != map.end(); ++iter)
+        visited += iter->second >= 0;
+
+    cerr << "  Time for " << visited << " iterations: "
+         << stopWatch.format() << endl;
+
+    if (visited != map.size())
+        cerr << "Iteration count doesn't match!" << endl;
+
+    stopWatch.start();
+
     Map copy = map;
     for (int i = 0; i < N; i += 2)
         copy = copy.remove(values[i]);
@@ -172,6 +251,438 @@ int main(int argc, char** argv)
     cerr << endl;
 
 
+    cerr << "Transient map:" << endl;
+
+    stopWatch.start();
+
+    Map::Transient builder;
+
+    for (int i = 0; i < N; ++i)
+        builder.insert(values[i], i);
+
+    Map built = builder.persistent();
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    Map::Transient remover(built);
+    for (int i = 0; i < N; i += 2)
+        remover.remove(values[i]);
+
+    cerr << "  Time for " << N/2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    if (built.size() != map.size() or remover.size() != copy.size())
+        cerr << "Sizes don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Memory usage (bytes):" << endl;
+
+    odf::hash_trie::MemoryUsage const usage = map.memoryUsage();
+    cerr << "  Leaves: " << usage.leaves
+         << ", collision nodes: " << usage.collisions
+         << ", bitmapped nodes: " << usage.bitmapped
+         << ", array nodes: " << usage.arrays
+         << ", child arrays: " << usage.childArrays << endl;
+
+    stopWatch.start();
+
+    Map const versions[] = { map, copy };
+    SharedMemoryUsage const shared = Map::memoryUsage(versions, versions + 2);
+
+    cerr << "  Full and half map share " << shared.shared.total()
+         << ", hold alone " << shared.unique[0].total()
+         << " and " << shared.unique[1].total()
+         << " (" << stopWatch.format() << ")" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Counters:" << endl;
+
+    int const K = N / 10 > 0 ? N / 10 : 1;
+
+    stopWatch.start();
+
+    Map counts;
+    for (int i = 0; i < N; ++i)
+    {
+        int const k = values[i] % K;
+        counts = counts.insert(k, counts.getVal(k, 0) + 1);
+    }
+
+    cerr << "  Time for " << N << " lookups and inserts: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    Map upserted;
+    for (int i = 0; i < N; ++i)
+        upserted = upserted.upsert(values[i] % K, Increment(), 1);
+
+    cerr << "  Time for " << N << " upserts:             "
+         << stopWatch.format() << endl;
+
+    if (counts.size() != upserted.size())
+        cerr << "Sizes don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Diff of two versions:" << endl;
+
+    Map next = map;
+    for (int i = 0; i < 100 and 3 * i + 2 < N; ++i)
+        next = next.remove(values[3 * i])
+            .insert(values[3 * i + 1], -1)
+            .insert(-1 - i, i);
+
+    stopWatch.start();
+
+    ChangeCounter counter;
+    for (int r = 0; r < 1000; ++r)
+        diff(map, next, counter);
+
+    cerr << "  Time for 1000 diffs (" << counter.count / 1000 << " changes): "
+         << stopWatch.format() << endl;
+
+    cerr << endl;
+
+
+    Stopwatch wallClock(false);
+
+    cerr << "Bulk-built map (" << wallClock.mode() << " time):" << endl;
+
+    std::vector<std::pair<int, int> > entries;
+    for (int i = 0; i < N; ++i)
+        entries.push_back(std::make_pair(values[i], i));
+
+    wallClock.start();
+
+    Map bulk = Map::fromRange(entries.begin(), entries.end());
+
+    cerr << "  Time for " << N << " insertions: "
+         << wallClock.format() << endl;
+
+    if (bulk.size() != map.size())
+        cerr << "Sizes don't match!" << endl;
+
+    cerr << endl;
+
+
+    long expected = 0;
+    for (Map::const_iterator iter = map.begin(); iter != map.end(); ++iter)
+        expected += iter->second;
+
+    size_t const nrThreads[] = { 1, 0 };
+    for (int k = 0; k < 2; ++k)
+    {
+        size_t const n = nrThreads[k];
+        cerr << "Bulk operations on " << (n ? "one thread" : "all cores")
+             << " (" << wallClock.mode() << " time):" << endl;
+
+        wallClock.start();
+        long const sum = map.parallelReduce(0L, sumValues, plus, n);
+        cerr << "  Time for reduce:    " << wallClock.format() << endl;
+
+        wallClock.start();
+        Map const incremented = map.mapValues(Increment(), n);
+        cerr << "  Time for mapValues: " << wallClock.format() << endl;
+
+        wallClock.start();
+        Map const odd = map.filter(isOdd, n);
+        cerr << "  Time for filter:    " << wallClock.format() << endl;
+
+        if (sum != expected or incremented.size() != map.size()
+            or odd.size() > map.size())
+            cerr << "Results don't match!" << endl;
+
+        cerr << endl;
+    }
+
+
+    cerr << "Snapshot (" << wallClock.mode() << " time):" << endl;
+
+    char path[] = "/tmp/timePersistentMapXXXXXX";
+    int const fd = mkstemp(path);
+    if (fd >= 0)
+        close(fd);
+
+    wallClock.start();
+    {
+        std::ofstream out(path, std::ios::binary);
+        map.writeSnapshot(out);
+    }
+    cerr << "  Time for writing:     " << wallClock.format() << endl;
+
+    wallClock.start();
+
+    MappedMap<int, int, hashfun> const mapped(path);
+
+    double sumM = 0.0;
+    for (int i = N / 2; i < N; ++i)
+        sumM += mapped.getVal(values[i], 0);
+
+    cerr << "  Time for mapping and " << N/2 << " queries: "
+         << wallClock.format() << endl;
+
+    unlink(path);
+
+    if (sumM != sumA or mapped.size() != map.size())
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Snapshot log (" << wallClock.mode() << " time):" << endl;
+
+    unlink(path);
+    {
+        SnapshotLog<int, int> log(path);
+
+        wallClock.start();
+        map.appendSnapshot(log);
+        cerr << "  Time for first append: " << wallClock.format()
+             << " (" << log.length() << " bytes)" << endl;
+
+        PersistentMap<int, int, hashfun> changed = map;
+        for (int i = 0; i < N / 1000; ++i)
+            changed = changed.insert(values[i], -i - 1);
+
+        uint64_t const before = log.length();
+        wallClock.start();
+        changed.appendSnapshot(log);
+        cerr << "  Time for append after " << N / 1000 << " updates: "
+             << wallClock.format()
+             << " (" << log.length() - before << " bytes)" << endl;
+    }
+    {
+        MappedMap<int, int, hashfun> const logged(path);
+        if (logged.size() != map.size())
+            cerr << "Results don't match!" << endl;
+    }
+    unlink(path);
+
+    cerr << endl;
+
+
+    cerr << "Releasing a map of " << N << " entries (" << wallClock.mode()
+         << " time):" << endl;
+
+    {
+        Map copy;
+        for (int i = 0; i < N; ++i)
+            copy = copy.insert(values[i], i);
+        wallClock.start();
+        copy = Map();
+        cerr << "  Time to release at once:      " << wallClock.format()
+             << endl;
+    }
+    {
+        Map copy;
+        for (int i = 0; i < N; ++i)
+            copy = copy.insert(values[i], i);
+        DeferredDeletion::enable();
+        wallClock.start();
+        copy = Map();
+        cerr << "  Time to release with deferral: " << wallClock.format()
+             << endl;
+
+        size_t nodes = 0;
+        size_t steps = 0;
+        wallClock.start();
+        for (size_t n; (n = DeferredDeletion::drain(4096)) > 0; ++steps)
+            nodes += n;
+        cerr << "  Time to drain " << nodes << " nodes in " << steps
+             << " steps: " << wallClock.format() << endl;
+        DeferredDeletion::enable(false);
+    }
+
+    cerr << endl;
+
+
+    cerr << "Persistent vector:" << endl;
+
+    stopWatch.start();
+
+    PersistentVector<int> vec;
+    for (int i = 0; i < N; ++i)
+        vec = vec.push_back(i);
+
+    cerr << "  Time for " << N << " appends:           "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    PersistentVector<int>::Transient appender;
+    for (int i = 0; i < N; ++i)
+        appender.push_back(i);
+    PersistentVector<int> const vecB = appender.persistent();
+
+    cerr << "  Time for " << N << " transient appends: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    double sumV = 0.0;
+    for (int i = N / 2; i < N; ++i)
+    {
+        sumV += vec.at(values[i] % N);
+    }
+
+    cerr << "  Time for " << N/2 << " queries:           "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    for (int i = 0; i < N / 2; ++i)
+        vec = vec.set(values[i] % N, i);
+
+    cerr << "  Time for " << N/2 << " updates:           "
+         << stopWatch.format() << endl;
+    cerr << "  Memory used: " << vec.memoryUsage().total() << " bytes" << endl;
+
+    cerr << "Persistent map with the same keys:" << endl;
+
+    stopWatch.start();
+
+    Map dense;
+    for (int i = 0; i < N; ++i)
+        dense = dense.insert(i, i);
+
+    cerr << "  Time for " << N << " insertions:        "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    double sumD = 0.0;
+    for (int i = N / 2; i < N; ++i)
+    {
+        sumD += dense.getVal(values[i] % N, 0);
+    }
+
+    cerr << "  Time for " << N/2 << " queries:           "
+         << stopWatch.format() << endl;
+    cerr << "  Memory used: " << dense.memoryUsage().total() << " bytes"
+         << endl;
+
+    if (sumV != sumD or vecB.size() != dense.size())
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Integer map:" << endl;
+
+    stopWatch.start();
+
+    PersistentIntMap<int> imap;
+    for (int i = 0; i < N; ++i)
+        imap = imap.insert(values[i], i);
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    double sumI = 0.0;
+    for (int i = N / 2; i < N; ++i)
+    {
+        sumI += imap.getVal(values[i], 0);
+    }
+
+    cerr << "  Time for " << N/2 << " queries:    "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    size_t inRange = 0;
+    for (int i = 0; i < 1000; ++i)
+    {
+        int const lo = values[i] / 2;
+        inRange += imap.range(lo, lo + RAND_MAX / 2000).size();
+    }
+
+    cerr << "  Time for 1000 range queries (" << inRange / 1000
+         << " entries each): " << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    PersistentIntMap<int> idense;
+    for (int i = 0; i < N; ++i)
+        idense = idense.insert(i, i);
+
+    cerr << "  Time for " << N << " insertions with the same keys as the "
+         << "vector: " << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    size_t visitedI = 0;
+    for (PersistentIntMap<int>::const_iterator it = imap.begin();
+         it != imap.end(); ++it)
+        ++visitedI;
+
+    cerr << "  Time for " << visitedI << " iterations in key order: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    PersistentIntMap<int> icopy = imap;
+    for (int i = 0; i < N; i += 2)
+        icopy = icopy.remove(values[i]);
+
+    cerr << "  Time for " << N/2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    if (sumI != sumA or icopy.size() != copy.size()
+        or visitedI != map.size() or idense.size() != dense.size())
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Compact map:" << endl;
+
+    stopWatch.start();
+
+    CMap cmap;
+
+    for (int i = 0; i < N; ++i)
+        cmap = cmap.insert(values[i], i);
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    double sumC = 0.0;
+    for (int i = N / 2; i < N; ++i)
+    {
+        sumC += cmap.getVal(values[i], 0);
+    }
+
+    cerr << "  Time for " << N/2 << " queries:    "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    CMap ccopy = cmap;
+    for (int i = 0; i < N; i += 2)
+        ccopy = ccopy.remove(values[i]);
+
+    cerr << "  Time for " << N/2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    if (sumC != sumA or ccopy.size() != copy.size())
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
     cerr << "Boost unordered_map:" << endl;
 
     stopWatch.start();
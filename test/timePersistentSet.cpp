@@ -1,5 +1,6 @@
 /* -*-c++-*- */
 
+#include <iostream>
 #include <string>
 #include <sstream>
 #include <stdlib.h>
@@ -7,6 +8,7 @@
 #include <boost/unordered_set.hpp>
 
 #include "PersistentSet.hpp"
+#include "CompactSet.hpp"
 
 using namespace odf::hash_trie;
 
@@ -16,6 +18,7 @@ hashType hashfun(int const val)
 }
 
 typedef PersistentSet<int, hashfun> Set;
+typedef CompactSet<int, hashfun> CSet;
 
 using boost::unordered_set;
 using std::string;
@@ -162,6 +165,18 @@ int main(int argc, char** argv)
 
     stopWatch.start();
 
+    size_t visited = 0;
+    for (Set::const_iterator iter = set.begin(); iter != set.end(); ++iter)
+        visited += *iter >= 0;
+
+    cerr << "  Time for " << visited << " iterations: "
+         << stopWatch.format() << endl;
+
+    if (visited != set.size())
+        cerr << "Iteration count doesn't match!" << endl;
+
+    stopWatch.start();
+
     Set copy = set;
     for (int i = 0; i < N; i += 2)
         copy = copy.remove(values[i]);
@@ -171,6 +186,161 @@ int main(int argc, char** argv)
 
     cerr << endl;
 
+
+    cerr << "Set algebra on two versions:" << endl;
+
+    int const M = N / 1000 > 0 ? N / 1000 : 1;
+    Set next = set;
+    for (int i = 0; i < M; ++i)
+        next = next.remove(values[2 * i]).insert(-1 - i);
+
+    stopWatch.start();
+
+    size_t changes = 0;
+    for (int r = 0; r < 100; ++r)
+        changes += set.subtract(next).size() + next.subtract(set).size();
+
+    cerr << "  Time for 200 differences (" << M << " changes): "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    size_t sizes = 0;
+    for (int r = 0; r < 100; ++r)
+        sizes += set.unite(next).size() + set.intersect(next).size();
+
+    cerr << "  Time for 100 unions and intersections: "
+         << stopWatch.format() << endl;
+
+    if (sizes != 100 * (set.size() + next.size()) or
+        changes + 200 * set.intersect(next).size() != sizes)
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Transient set:" << endl;
+
+    stopWatch.start();
+
+    Set::Transient builder;
+
+    for (int i = 0; i < N; ++i)
+        builder.insert(values[i]);
+
+    Set built = builder.persistent();
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    Set::Transient remover(built);
+    for (int i = 0; i < N; i += 2)
+        remover.remove(values[i]);
+
+    cerr << "  Time for " << N / 2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    if (built.size() != set.size() or remover.size() != copy.size())
+        cerr << "Sizes don't match!" << endl;
+
+    cerr << endl;
+
+
+    Stopwatch wallClock(false);
+
+    cerr << "Bulk-built set (" << wallClock.mode() << " time):" << endl;
+
+    wallClock.start();
+
+    Set bulk = Set::fromRange(values, values + N);
+
+    cerr << "  Time for " << N << " insertions: "
+         << wallClock.format() << endl;
+
+    if (bulk.size() != set.size())
+        cerr << "Sizes don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Interned sets:" << endl;
+
+    Set const versions[] = { set, built, bulk, copy };
+    size_t before = 0;
+    for (int i = 0; i < 4; ++i)
+        before += versions[i].memoryUsage().total();
+
+    stopWatch.start();
+
+    InternTable<int, bool> table;
+    Set interned[4];
+    for (int i = 0; i < 4; ++i)
+        interned[i] = versions[i].interned(table);
+
+    cerr << "  Time for interning 4 sets: " << stopWatch.format() << endl;
+
+    SharedMemoryUsage const usage = Set::memoryUsage(interned, interned + 4);
+    size_t after = usage.shared.total();
+    for (int i = 0; i < 4; ++i)
+        after += usage.unique[i].total();
+
+    cerr << "  Memory used: " << before / 1024 << " KB before, "
+         << after / 1024 << " KB after" << endl;
+
+    stopWatch.start();
+
+    size_t same = 0;
+    for (int r = 0; r < 100000; ++r)
+        same += (interned[r % 3] == interned[(r + 1) % 3]);
+
+    cerr << "  Time for 100000 comparisons: " << stopWatch.format() << endl;
+
+    if (same != 100000 or interned[3] == interned[0])
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
+    cerr << "Compact set:" << endl;
+
+    stopWatch.start();
+
+    CSet cset;
+
+    for (int i = 0; i < N; ++i)
+        cset = cset.insert(values[i]);
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    int countC = 0;
+    for (int i = N / 2; i < N + N / 2; ++i)
+    {
+        countC += cset.contains(values[i]);
+    }
+
+    cerr << "  Time for " << N << " queries:    "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    CSet ccopy = cset;
+    for (int i = 0; i < N; i += 2)
+        ccopy = ccopy.remove(values[i]);
+
+    cerr << "  Time for " << N / 2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    if (countC != countA or ccopy.size() != copy.size())
+        cerr << "Results don't match!" << endl;
+
+    cerr << endl;
+
+
     cerr << "Boost unordered_set:" << endl;
 
     stopWatch.start();
@@ -0,0 +1,290 @@
+/* -*-c++-*- */
+
+// Read throughput of several threads sharing one map snapshot, and sharing
+// an atomic map that another thread keeps updating. Build with
+// ODF_HASH_TRIE_ATOMIC defined (see Makefile).
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <stdlib.h>
+#include <sys/times.h>
+#include <boost/atomic.hpp>
+#include <boost/thread.hpp>
+
+#include "AtomicPersistentMap.hpp"
+
+using namespace odf::hash_trie;
+
+hashType hashfun(int const val)
+{
+    return val;
+}
+
+typedef AtomicPersistentMap<int, int, hashfun> Shared;
+typedef Shared::Map Map;
+
+using std::string;
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::exception;
+
+class Stopwatch
+{
+private:
+    bool const useCpuTime_;
+
+    long accumulated_;
+    long start_;
+    bool isRunning_;
+
+    tms mutable tmsCurrent_;
+
+    long time() const
+    {
+        clock_t res = times(&tmsCurrent_);
+        if (res < 0)
+            throw "Cannot determine user time.";
+
+    	if (useCpuTime_)
+            return tmsCurrent_.tms_utime;
+        else
+            return res;
+    }
+
+public:
+    Stopwatch(bool useCpuTime = true)
+        : useCpuTime_(useCpuTime),
+          accumulated_(0),
+          start_(0),
+          isRunning_(false)
+    {
+    }
+    
+    string mode() const
+    {
+    	if (useCpuTime_)
+            return "CPU";
+        else
+            return "Real";
+    }
+    
+    void resume()
+    {
+        if (!isRunning_)
+        {
+            isRunning_ = true;
+            start_ = time();
+        }
+    }
+
+    void start()
+    {
+        accumulated_ = 0;
+        isRunning_ = true;
+        start_ = time();
+    }
+    
+    void stop()
+    {
+        if (isRunning_)
+        {
+            accumulated_ += time() - start_;
+            isRunning_ = false;
+        }
+    }
+    
+    /**
+     * Reports the elapsed time on this timer in milliseconds.
+     */
+    long elapsed() const
+    {
+        static long clktck = 0;
+
+        if (clktck == 0 and (clktck = sysconf(_SC_CLK_TCK)) <= 0)
+            throw "Cannot determine system clock rate";
+
+    	return (accumulated_ + (isRunning_ ? time() - start_ : 0))
+            * 1000 / clktck;
+    }
+    
+    string format() const
+    {
+        return format(elapsed());
+    }
+    
+    static string format(long const milliseconds)
+    {
+        std::stringstream ss;
+    	ss << milliseconds / 10 / 100.0 << " seconds";
+        return ss.str();
+    }
+};
+
+
+
+// A snapshot of a plain map is a copy; one of an atomic map is a load.
+Map const snapshotOf(Map const& map)
+{
+    return map;
+}
+
+Map const snapshotOf(Shared const& shared)
+{
+    return shared.load();
+}
+
+// Each reader repeatedly takes its own snapshot of the shared map, as a
+// worker would when picking up the current version, then queries it.
+template<typename Source>
+struct Reader
+{
+    Reader(Source const* shared,
+           size_t const* keys,
+           int const nrKeys,
+           int const nrRounds,
+           long* result)
+        : shared_(shared),
+          keys_(keys),
+          nrKeys_(nrKeys),
+          nrRounds_(nrRounds),
+          result_(result)
+    {
+    }
+
+    void operator()() const
+    {
+        long sum = 0;
+        for (int r = 0; r < nrRounds_; ++r)
+        {
+            Map snapshot = snapshotOf(*shared_);
+            for (int i = 0; i < nrKeys_; ++i)
+                sum += snapshot.getVal(keys_[i], 0);
+        }
+        *result_ = sum;
+    }
+
+private:
+    Source const* shared_;
+    size_t const* keys_;
+    int nrKeys_;
+    int nrRounds_;
+    long* result_;
+};
+
+// Keeps updating an atomic map until told to stop.
+struct Writer
+{
+    Writer(Shared* shared, size_t const* keys, int const nrKeys,
+           boost::atomic<bool>* done)
+        : shared_(shared),
+          keys_(keys),
+          nrKeys_(nrKeys),
+          done_(done)
+    {
+    }
+
+    void operator()() const
+    {
+        for (int i = 0; not done_->load(); i = (i + 1) % nrKeys_)
+            shared_->insert(keys_[i], i);
+    }
+
+private:
+    Shared* shared_;
+    size_t const* keys_;
+    int nrKeys_;
+    boost::atomic<bool>* done_;
+};
+
+template<typename Source>
+void timeReads(Source const& shared,
+               size_t const* values,
+               int const N,
+               int const maxThreads)
+{
+    int const nrRounds = 100;
+    int const nrKeys = N / nrRounds > 0 ? N / nrRounds : 1;
+
+    Stopwatch wallClock(false);
+
+    for (int nrThreads = 1; ; nrThreads = std::min(2 * nrThreads, maxThreads))
+    {
+        long* results = new long[nrThreads];
+        boost::thread_group threads;
+
+        wallClock.start();
+
+        for (int t = 0; t < nrThreads; ++t)
+        {
+            size_t const* keys = values + (t * nrKeys) % (N - nrKeys + 1);
+            threads.create_thread(Reader<Source>(
+                &shared, keys, nrKeys, nrRounds, results + t));
+        }
+        threads.join_all();
+
+        wallClock.stop();
+
+        long const queries = (long) nrThreads * nrRounds * nrKeys;
+        double const seconds = wallClock.elapsed() / 1000.0;
+
+        cerr << "  " << nrThreads << " threads, " << queries << " queries: "
+             << wallClock.format();
+        if (seconds > 0)
+            cerr << " (" << queries / seconds / 1e6 << " million per second)";
+        cerr << endl;
+
+        delete[] results;
+
+        if (nrThreads >= maxThreads)
+            break;
+    }
+}
+
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        cerr << "Missing argument: number of items to insert." << endl;
+        return 1;
+    }
+
+    int const N = atoi(argv[1]);
+    int const maxThreads = std::max(
+        1, argc > 2 ? atoi(argv[2])
+                    : (int) boost::thread::hardware_concurrency());
+
+    size_t* values = new size_t[N];
+
+    srand(123456789);
+
+    for (int i = 0; i < N; ++i)
+    {
+        values[i] = rand();
+    }
+
+    Map::Transient builder;
+    for (int i = 0; i < N; ++i)
+        builder.insert(values[i], i);
+    Map const shared = builder.persistent();
+
+    cerr << "Shared snapshot reads (Real time):" << endl;
+    timeReads(shared, values, N, maxThreads);
+    cerr << endl;
+
+    cerr << "Atomic map reads with one writer (Real time):" << endl;
+    Shared atomic(shared);
+    boost::atomic<bool> done(false);
+    boost::thread writer(Writer(&atomic, values, N, &done));
+    timeReads(atomic, values, N, maxThreads);
+    done.store(true);
+    writer.join();
+    cerr << endl;
+
+    delete[] values;
+
+    return 0;
+}
@@ -0,0 +1,211 @@
+/* -*-c++-*- */
+
+// Times the basic map operations for one choice of the trie shape settings in
+// hash_trie.hpp. "make sweep" builds and runs this for a range of them.
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <stdlib.h>
+#include <sys/times.h>
+
+#include "PersistentMap.hpp"
+
+using namespace odf::hash_trie;
+
+// Spreads the key over all bits of the hash code.
+hashType hashfun(uint64_t const key)
+{
+    uint64_t const m0 = (uint64_t(0x9e3779b9) << 32) | 0x7f4a7c15;
+    uint64_t const m1 = (uint64_t(0xbf58476d) << 32) | 0x1ce4e5b9;
+    uint64_t const m2 = (uint64_t(0x94d049bb) << 32) | 0x133111eb;
+
+    uint64_t h = key + m0;
+    h = (h ^ (h >> 30)) * m1;
+    h = (h ^ (h >> 27)) * m2;
+    return hashType(h ^ (h >> 31));
+}
+
+typedef PersistentMap<uint64_t, int, hashfun> Map;
+
+using std::string;
+using std::cerr;
+using std::endl;
+
+class Stopwatch
+{
+private:
+    bool const useCpuTime_;
+
+    long accumulated_;
+    long start_;
+    bool isRunning_;
+
+    tms mutable tmsCurrent_;
+
+    long time() const
+    {
+        clock_t res = times(&tmsCurrent_);
+        if (res < 0)
+            throw "Cannot determine user time.";
+
+    	if (useCpuTime_)
+            return tmsCurrent_.tms_utime;
+        else
+            return res;
+    }
+
+public:
+    Stopwatch(bool useCpuTime = true)
+        : useCpuTime_(useCpuTime),
+          accumulated_(0),
+          start_(0),
+          isRunning_(false)
+    {
+    }
+    
+    string mode() const
+    {
+    	if (useCpuTime_)
+            return "CPU";
+        else
+            return "Real";
+    }
+    
+    void resume()
+    {
+        if (!isRunning_)
+        {
+            isRunning_ = true;
+            start_ = time();
+        }
+    }
+
+    void start()
+    {
+        accumulated_ = 0;
+        isRunning_ = true;
+        start_ = time();
+    }
+    
+    void stop()
+    {
+        if (isRunning_)
+        {
+            accumulated_ += time() - start_;
+            isRunning_ = false;
+        }
+    }
+    
+    /**
+     * Reports the elapsed time on this timer in milliseconds.
+     */
+    long elapsed() const
+    {
+        static long clktck = 0;
+
+        if (clktck == 0 and (clktck = sysconf(_SC_CLK_TCK)) <= 0)
+            throw "Cannot determine system clock rate";
+
+    	return (accumulated_ + (isRunning_ ? time() - start_ : 0))
+            * 1000 / clktck;
+    }
+    
+    string format() const
+    {
+        return format(elapsed());
+    }
+    
+    static string format(long const milliseconds)
+    {
+        std::stringstream ss;
+    	ss << milliseconds / 10 / 100.0 << " seconds";
+        return ss.str();
+    }
+};
+
+
+int main(int argc, char** argv)
+{
+    Stopwatch stopWatch;
+
+    if (argc < 2)
+    {
+        cerr << "Missing argument: number of items to insert." << endl;
+        return 1;
+    }
+
+    int const N = atoi(argv[1]);
+    std::vector<uint64_t> keys(N);
+
+    srand(123456789);
+
+    for (int i = 0; i < N; ++i)
+        keys[i] = (uint64_t(rand()) << 31) ^ uint64_t(rand());
+
+    std::vector<hashType> hashes(N);
+    for (int i = 0; i < N; ++i)
+        hashes[i] = hashfun(keys[i]);
+    std::sort(hashes.begin(), hashes.end());
+    size_t const distinct =
+        std::unique(hashes.begin(), hashes.end()) - hashes.begin();
+
+    cerr << "Hash bits: " << int(hashBits)
+         << ", chunk bits: " << int(chunkBits)
+         << ", bitmapped nodes up to " << int(maxBitmappedSize)
+         << ", array nodes from " << int(minArraySize)
+         << " children" << endl;
+
+    stopWatch.start();
+
+    Map map;
+    for (int i = 0; i < N; ++i)
+        map = map.insert(keys[i], i);
+
+    cerr << "  Time for " << N << " insertions: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    long sum = 0;
+    for (int i = 0; i < N; ++i)
+        sum += map.getVal(keys[i], 0);
+
+    cerr << "  Time for " << N << " queries:    "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    size_t visited = 0;
+    for (Map::const_iterator iter = map.begin(); iter != map.end(); ++iter)
+        ++visited;
+
+    cerr << "  Time for " << visited << " iterations: "
+         << stopWatch.format() << endl;
+
+    stopWatch.start();
+
+    Map copy = map;
+    for (int i = 0; i < N; i += 2)
+        copy = copy.remove(keys[i]);
+
+    cerr << "  Time for " << N/2 << " removals:   "
+         << stopWatch.format() << endl;
+
+    cerr << "  Distinct hash codes: " << distinct << " of "
+         << map.size() << " keys" << endl;
+
+    TrieStats const stats = map.stats();
+    cerr << "  Average depth: " << stats.averageDepth()
+         << ", largest bucket: "
+         << (stats.bucketSizes.empty() ? 1 : stats.bucketSizes.size() - 1)
+         << ", average bitmapped node: "
+         << stats.averageBitmappedPopulation() << " children" << endl;
+
+    if (visited != map.size() or sum < 0)
+        cerr << "Results don't match!" << endl;
+
+    return 0;
+}
@@ -0,0 +1,220 @@
+/** -*-c++-*-
+ *
+ *  Memory allocation for hash trie nodes and their child arrays.
+ *
+ *  Path copying allocates and frees many small blocks of just a few distinct
+ *  sizes. PoolAllocator keeps released blocks on per-thread free lists, one
+ *  for each multiple of eight bytes up to a fixed limit, and hands them out
+ *  again without taking a lock. HeapAllocator uses plain operator new.
+ *
+ *  To plug in a different allocator, define ODF_HASH_TRIE_ALLOCATOR to the
+ *  name of a class with the static members
+ *      void* allocate(size_t bytes)
+ *      void  deallocate(void* p, size_t bytes)
+ *  before including any hash trie header. All translation units in a
+ *  program must agree on this setting.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_TRIE_ALLOCATOR_HPP
+#define ODF_TRIE_ALLOCATOR_HPP 1
+
+#include <stddef.h>
+#include <new>
+
+#include <boost/thread/tss.hpp>
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// ----------------------------------------------------------------------------
+// The plain allocator.
+// ----------------------------------------------------------------------------
+
+struct HeapAllocator
+{
+    static void* allocate(size_t const bytes)
+    {
+        return ::operator new(bytes);
+    }
+
+    static void deallocate(void* const p, size_t const)
+    {
+        ::operator delete(p);
+    }
+};
+
+
+// ----------------------------------------------------------------------------
+// The pooling allocator. Blocks larger than the biggest size class come from
+// the heap directly. Each free list holds at most maxFree blocks; anything
+// beyond that goes back to the heap, as do all cached blocks when a thread
+// exits. Blocks may be released by a different thread than the one that
+// allocated them.
+// ----------------------------------------------------------------------------
+
+#if defined(__GNUC__)
+
+class PoolAllocator
+{
+public:
+    static void* allocate(size_t const bytes)
+    {
+        size_t const k = sizeClass(bytes);
+        if (k >= nrClasses)
+            return ::operator new(bytes);
+
+        FreeLists& lists = localLists();
+        Block* head = lists.heads[k];
+        if (head)
+        {
+            lists.heads[k] = head->next;
+            --lists.lengths[k];
+            return head;
+        }
+        else
+        {
+            return ::operator new((k + 1) * granularity);
+        }
+    }
+
+    static void deallocate(void* const p, size_t const bytes)
+    {
+        size_t const k = sizeClass(bytes);
+        FreeLists& lists = localLists();
+        if (k >= nrClasses or lists.lengths[k] >= maxFree)
+        {
+            ::operator delete(p);
+        }
+        else
+        {
+            Block* block = static_cast<Block*>(p);
+            block->next = lists.heads[k];
+            lists.heads[k] = block;
+            ++lists.lengths[k];
+        }
+    }
+
+private:
+    static size_t const granularity = 8;
+    static size_t const nrClasses   = 64;
+    static size_t const maxFree     = 4096;
+
+    struct Block
+    {
+        Block* next;
+    };
+
+    struct FreeLists
+    {
+        FreeLists()
+        {
+            for (size_t k = 0; k < nrClasses; ++k)
+            {
+                heads[k] = 0;
+                lengths[k] = 0;
+            }
+        }
+
+        ~FreeLists()
+        {
+            for (size_t k = 0; k < nrClasses; ++k)
+            {
+                while (heads[k])
+                {
+                    Block* next = heads[k]->next;
+                    ::operator delete(heads[k]);
+                    heads[k] = next;
+                }
+            }
+        }
+
+        Block* heads[nrClasses];
+        size_t lengths[nrClasses];
+    };
+
+    static size_t sizeClass(size_t const bytes)
+    {
+        return bytes == 0 ? 0 : (bytes - 1) / granularity;
+    }
+
+    // The thread-specific pointer owns the lists and frees them when the
+    // thread exits; the __thread copy is just a fast way to reach them.
+    static FreeLists& localLists()
+    {
+        FreeLists*& cached = cachedLists();
+        if (cached == 0)
+        {
+            static boost::thread_specific_ptr<FreeLists> owner(releaseLists);
+            cached = new FreeLists();
+            owner.reset(cached);
+        }
+        return *cached;
+    }
+
+    static FreeLists*& cachedLists()
+    {
+        static __thread FreeLists* cached = 0;
+        return cached;
+    }
+
+    static void releaseLists(FreeLists* const lists)
+    {
+        cachedLists() = 0;
+        delete lists;
+    }
+};
+
+#ifndef ODF_HASH_TRIE_ALLOCATOR
+#define ODF_HASH_TRIE_ALLOCATOR ::odf::hash_trie::PoolAllocator
+#endif
+
+#else // !__GNUC__
+
+#ifndef ODF_HASH_TRIE_ALLOCATOR
+#define ODF_HASH_TRIE_ALLOCATOR ::odf::hash_trie::HeapAllocator
+#endif
+
+#endif // !__GNUC__
+
+typedef ODF_HASH_TRIE_ALLOCATOR Allocator;
+
+
+// ----------------------------------------------------------------------------
+// Arrays of a known length, allocated through the configured allocator. They
+// must be released with deleteArray and the same length.
+// ----------------------------------------------------------------------------
+
+template<typename T>
+T* newArray(size_t const len)
+{
+    if (len == 0)
+        return 0;
+
+    T* p = static_cast<T*>(Allocator::allocate(len * sizeof(T)));
+    for (size_t i = 0; i < len; ++i)
+        new (p + i) T();
+    return p;
+}
+
+template<typename T>
+void deleteArray(T const* const p, size_t const len)
+{
+    if (p == 0)
+        return;
+
+    for (size_t i = 0; i < len; ++i)
+        p[i].~T();
+    Allocator::deallocate(const_cast<T*>(p), len * sizeof(T));
+}
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_TRIE_ALLOCATOR_HPP
@@ -0,0 +1,537 @@
+/** -*-c++-*-
+ *
+ *  A compact binary file format for hash tries, meant to be read in place,
+ *  e.g. from a memory-mapped file.
+ *
+ *  A file starts with a SnapshotHeader, followed by the nodes in breadth-first
+ *  order. The header records the length of the whole file, so that one that
+ *  was not written to the end can be recognized. Like the nodes of a compact
+ *  trie, each node has one bitmap for the entries it holds directly and one
+ *  for its child nodes. Child nodes are given by their byte offsets from the
+ *  start of the file, so a snapshot can be used at any address. A node
+ *  consists of
+ *      a SnapshotNode,
+ *      the offsets of its children, as 64-bit integers, and
+ *      its entries, each a key followed by a value,
+ *  padded to a multiple of eight bytes. Entries with equal hash codes are
+ *  kept in bucket nodes, which have no bitmaps and list their entries only.
+ *
+ *  A snapshot log holds any number of versions of a trie in one file that is
+ *  only ever appended to. It starts with a SnapshotHeader with a different
+ *  magic string, followed by nodes in the format above and SnapshotRoot
+ *  records. Nodes in a log are written after their children, and each root
+ *  record names the root node and size of one version, which consists of
+ *  the nodes written before it. The last complete root record is the
+ *  current version.
+ *
+ *  Keys and values are copied byte by byte, so they must be plain old data.
+ *  Numbers are stored in the byte order of the machine that wrote the file,
+ *  and the trie shape settings and the hash function used for reading must
+ *  be the same as for writing.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_TRIE_SNAPSHOT_HPP
+#define ODF_TRIE_SNAPSHOT_HPP 1
+
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <ostream>
+#include <vector>
+
+#include <boost/static_assert.hpp>
+#include <boost/type_traits/alignment_of.hpp>
+#include <boost/type_traits/is_pod.hpp>
+
+#include "hash_trie.hpp"
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+struct SnapshotHeader
+{
+    char     magic[8];
+    uint32_t byteOrder;
+    uint32_t version;
+    uint32_t hashBits;
+    uint32_t chunkBits;
+    uint32_t keySize;
+    uint32_t valSize;
+    uint64_t size;
+
+    // The offset of the root node, or 0 if the trie is empty.
+    uint64_t root;
+
+    // The length of a snapshot file in bytes. Unused in a snapshot log,
+    // which keeps growing.
+    uint64_t length;
+};
+
+struct SnapshotNode
+{
+    enum Kind { inner = 1, bucket = 2, root = 3 };
+
+    uint32_t kind;
+
+    // The number of entries in a bucket node.
+    uint32_t count;
+
+    uint64_t dataMap;
+    uint64_t nodeMap;
+};
+
+// A version in a snapshot log. The kind field lines up with that of a
+// SnapshotNode, so that the records in a log can be told apart.
+struct SnapshotRoot
+{
+    uint32_t kind;
+    uint32_t check;
+    uint64_t size;
+    uint64_t root;
+};
+
+template<typename Key, typename Val>
+struct SnapshotEntry
+{
+    Key key;
+    Val val;
+};
+
+char const snapshotMagic[8] = { 'O', 'D', 'F', 'H', 'A', 'M', 'T', 0 };
+char const snapshotLogMagic[8] = { 'O', 'D', 'F', 'H', 'L', 'O', 'G', 0 };
+uint32_t const snapshotByteOrder = 0x01020304;
+uint32_t const snapshotVersion = 2;
+uint32_t const snapshotRootCheck = 0x524f4f54;
+
+inline size_t snapshotPadded(size_t const bytes)
+{
+    return (bytes + 7) & ~size_t(7);
+}
+
+template<typename Key, typename Val>
+SnapshotHeader makeSnapshotHeader(char const* const magic)
+{
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, magic, sizeof(header.magic));
+    header.byteOrder = snapshotByteOrder;
+    header.version   = snapshotVersion;
+    header.hashBits  = hashBits;
+    header.chunkBits = chunkBits;
+    header.keySize   = sizeof(Key);
+    header.valSize   = sizeof(Val);
+    return header;
+}
+
+template<typename Key, typename Val>
+bool isSnapshotHeaderFor(SnapshotHeader const& header,
+                         char const* const magic = snapshotMagic)
+{
+    return memcmp(header.magic, magic, sizeof(header.magic)) == 0
+        and header.byteOrder == snapshotByteOrder
+        and header.version == snapshotVersion
+        and header.hashBits == hashBits
+        and header.chunkBits == chunkBits
+        and header.keySize == sizeof(Key)
+        and header.valSize == sizeof(Val);
+}
+
+// ----------------------------------------------------------------------------
+// How trie nodes are encoded. Leaves below an inner node become entries of the
+// corresponding snapshot node, and a leaf at the root is put into an inner
+// node of its own. Every other node becomes a snapshot node of its own.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+struct SnapshotEncoding
+{
+    typedef SnapshotEntry<Key, Val> Entry;
+
+    BOOST_STATIC_ASSERT(boost::is_pod<Key>::value);
+    BOOST_STATIC_ASSERT(boost::is_pod<Val>::value);
+    BOOST_STATIC_ASSERT(boost::alignment_of<Entry>::value <= 8);
+
+    static bool isBucket(Node<Key, Val> const* const node)
+    {
+        return node->isLeaf() and node->nrSlots() > 0;
+    }
+
+    // The children of an inner node or a root leaf, by hash chunk.
+    static void getSlots(Node<Key, Val> const* const node,
+                         Node<Key, Val> const** const slots)
+    {
+        if (node->isLeaf())
+            slots[masked(node->hash(), 0)] = node;
+        else
+            node->getChildren(slots);
+    }
+
+    static size_t nodeSize(Node<Key, Val> const* const node)
+    {
+        if (isBucket(node))
+            return snapshotPadded(
+                sizeof(SnapshotNode) + node->nrSlots() * sizeof(Entry));
+
+        Node<Key, Val> const* slots[fanout] = { 0 };
+        getSlots(node, slots);
+
+        size_t nrNodes = 0, nrEntries = 0;
+        for (indexType i = 0; i < fanout; ++i)
+        {
+            if (slots[i] and slots[i]->nrSlots() == 0)
+                ++nrEntries;
+            else if (slots[i])
+                ++nrNodes;
+        }
+        return snapshotPadded(sizeof(SnapshotNode)
+                              + nrNodes * sizeof(uint64_t)
+                              + nrEntries * sizeof(Entry));
+    }
+
+    // Appends the encoding of a node to the buffer. The offsets of the child
+    // nodes that are not entries are given in the order of their slots.
+    static void encode(Node<Key, Val> const* const node,
+                       uint64_t const* const childOffsets,
+                       std::vector<char>& out)
+    {
+        size_t const start = out.size();
+        out.resize(start + nodeSize(node), 0);
+        char* const p = &out[start];
+
+        SnapshotNode* const head = reinterpret_cast<SnapshotNode*>(p);
+        if (isBucket(node))
+        {
+            head->kind = SnapshotNode::bucket;
+            head->count = node->nrSlots();
+            Entry* const entries = reinterpret_cast<Entry*>(head + 1);
+            for (size_t i = 0; i < node->nrSlots(); ++i)
+                setEntry(entries[i], node->child(i));
+            return;
+        }
+
+        Node<Key, Val> const* slots[fanout] = { 0 };
+        getSlots(node, slots);
+
+        head->kind = SnapshotNode::inner;
+        size_t nrNodes = 0;
+        for (indexType i = 0; i < fanout; ++i)
+        {
+            if (slots[i] and slots[i]->nrSlots() == 0)
+                head->dataMap |= uint64_t(1) << i;
+            else if (slots[i])
+            {
+                head->nodeMap |= uint64_t(1) << i;
+                ++nrNodes;
+            }
+        }
+
+        uint64_t* const offsets = reinterpret_cast<uint64_t*>(head + 1);
+        for (size_t k = 0; k < nrNodes; ++k)
+            offsets[k] = childOffsets[k];
+
+        Entry* entry = reinterpret_cast<Entry*>(offsets + nrNodes);
+        for (indexType i = 0; i < fanout; ++i)
+            if (slots[i] and slots[i]->nrSlots() == 0)
+                setEntry(*entry++, slots[i]);
+    }
+
+private:
+    static void setEntry(Entry& entry, Node<Key, Val> const* const leaf)
+    {
+        entry.key = leaf->key();
+        entry.val = leafValue(leaf);
+    }
+};
+
+// ----------------------------------------------------------------------------
+// Writes a trie as a snapshot. Nodes are written in the same order in which
+// their offsets are handed out, so the output is produced in a single pass.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+class SnapshotWriter
+{
+public:
+    typedef SnapshotEncoding<Key, Val> Encoding;
+
+    explicit SnapshotWriter(std::ostream& out)
+        : out_(out),
+          next_(sizeof(SnapshotHeader))
+    {
+    }
+
+    // Returns false if the stream reported an error.
+    bool write(Node<Key, Val> const* const root)
+    {
+        SnapshotHeader header = makeSnapshotHeader<Key, Val>(snapshotMagic);
+        header.size   = root ? root->size() : 0;
+        header.length = next_ + (root ? encodedSize(root) : 0);
+        header.root   = root ? reserve(root) : 0;
+        out_.write(reinterpret_cast<char const*>(&header), sizeof(header));
+
+        std::vector<char> buffer;
+        while (not queue_.empty())
+        {
+            Node<Key, Val> const* node = queue_.front();
+            queue_.pop_front();
+
+            buffer.clear();
+            writeNode(node, buffer);
+            out_.write(&buffer[0], buffer.size());
+        }
+
+        return out_.good();
+    }
+
+private:
+    std::ostream& out_;
+    uint64_t next_;
+    std::deque<Node<Key, Val> const*> queue_;
+
+    // The number of bytes the nodes from the given one down will take up.
+    static uint64_t encodedSize(Node<Key, Val> const* const root)
+    {
+        uint64_t total = 0;
+        std::vector<Node<Key, Val> const*> pending(1, root);
+        while (not pending.empty())
+        {
+            Node<Key, Val> const* const node = pending.back();
+            pending.pop_back();
+            total += Encoding::nodeSize(node);
+
+            if (not Encoding::isBucket(node))
+            {
+                Node<Key, Val> const* slots[fanout] = { 0 };
+                Encoding::getSlots(node, slots);
+                for (indexType i = 0; i < fanout; ++i)
+                    if (slots[i] and slots[i]->nrSlots() > 0)
+                        pending.push_back(slots[i]);
+            }
+        }
+        return total;
+    }
+
+    // Assigns the next free offset to a node and queues it for writing.
+    uint64_t reserve(Node<Key, Val> const* const node)
+    {
+        uint64_t const offset = next_;
+        next_ += Encoding::nodeSize(node);
+        queue_.push_back(node);
+        return offset;
+    }
+
+    void writeNode(Node<Key, Val> const* const node, std::vector<char>& out)
+    {
+        uint64_t offsets[fanout];
+        size_t nrNodes = 0;
+
+        if (not Encoding::isBucket(node))
+        {
+            Node<Key, Val> const* slots[fanout] = { 0 };
+            Encoding::getSlots(node, slots);
+            for (indexType i = 0; i < fanout; ++i)
+                if (slots[i] and slots[i]->nrSlots() > 0)
+                    offsets[nrNodes++] = reserve(slots[i]);
+        }
+
+        Encoding::encode(node, offsets, out);
+    }
+};
+
+template<typename Key, typename Val>
+bool writeTrieSnapshot(Node<Key, Val> const* const root, std::ostream& out)
+{
+    return SnapshotWriter<Key, Val>(out).write(root);
+}
+
+// ----------------------------------------------------------------------------
+// The size of the record at the given address in a snapshot log, or 0 if
+// there is no complete record of a known kind within the available bytes.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+uint64_t snapshotRecordSize(char const* const record, uint64_t const available)
+{
+    if (available < sizeof(SnapshotNode))
+        return 0;
+
+    SnapshotNode const* head = reinterpret_cast<SnapshotNode const*>(record);
+    uint64_t bytes;
+
+    if (head->kind == SnapshotNode::inner)
+        bytes = sizeof(SnapshotNode)
+            + bitCount(bitmapType(head->nodeMap)) * sizeof(uint64_t)
+            + bitCount(bitmapType(head->dataMap))
+            * sizeof(SnapshotEntry<Key, Val>);
+    else if (head->kind == SnapshotNode::bucket)
+        bytes = sizeof(SnapshotNode)
+            + uint64_t(head->count) * sizeof(SnapshotEntry<Key, Val>);
+    else if (head->kind == SnapshotNode::root
+             and reinterpret_cast<SnapshotRoot const*>(record)->check
+             == snapshotRootCheck)
+        bytes = sizeof(SnapshotRoot);
+    else
+        return 0;
+
+    bytes = snapshotPadded(bytes);
+    return bytes <= available ? bytes : 0;
+}
+
+// ----------------------------------------------------------------------------
+// The size of the node at the given offset in a snapshot or snapshot log of
+// the given length, or 0 if there is no complete node of a known kind there.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+uint64_t snapshotNodeSize(char const* const base,
+                          uint64_t    const length,
+                          uint64_t    const offset)
+{
+    if (offset < sizeof(SnapshotHeader) or offset % 8 != 0 or offset > length)
+        return 0;
+
+    uint64_t const bytes =
+        snapshotRecordSize<Key, Val>(base + offset, length - offset);
+    if (bytes == 0)
+        return 0;
+
+    uint32_t const kind =
+        reinterpret_cast<SnapshotNode const*>(base + offset)->kind;
+    if (kind == SnapshotNode::inner or kind == SnapshotNode::bucket)
+        return bytes;
+    else
+        return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Whether there is a root record at the given offset in a snapshot log that
+// names a complete node before it, or no node for an empty trie.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+bool isSnapshotLogRoot(char const* const base, uint64_t const pos)
+{
+    SnapshotRoot const* record =
+        reinterpret_cast<SnapshotRoot const*>(base + pos);
+    return record->kind == SnapshotNode::root
+        and record->check == snapshotRootCheck
+        and (record->root == 0
+             or snapshotNodeSize<Key, Val>(base, pos, record->root) > 0);
+}
+
+// ----------------------------------------------------------------------------
+// Finds the last complete root record in a snapshot log of the given length
+// and returns its offset, or 0 if there is none. A log that was written
+// without interruption ends with a root record; otherwise, the records are
+// scanned from the start, and anything after the last root record is taken
+// to be the remains of an unfinished append. Either way, a root record only
+// counts if the node it names is complete, and lookups check the nodes below
+// that one as they go (see findInSnapshot()).
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+uint64_t findSnapshotLogRoot(char const* const base, uint64_t const length)
+{
+    if (length >= sizeof(SnapshotHeader) + sizeof(SnapshotRoot)
+        and length % 8 == 0)
+    {
+        uint64_t const pos = length - sizeof(SnapshotRoot);
+        if (isSnapshotLogRoot<Key, Val>(base, pos))
+            return pos;
+    }
+
+    uint64_t found = 0;
+    uint64_t pos = sizeof(SnapshotHeader);
+    while (pos < length)
+    {
+        uint64_t const bytes =
+            snapshotRecordSize<Key, Val>(base + pos, length - pos);
+        if (bytes == 0)
+            break;
+        if (reinterpret_cast<SnapshotNode const*>(base + pos)->kind
+            == SnapshotNode::root
+            and isSnapshotLogRoot<Key, Val>(base, pos))
+            found = pos;
+        pos += bytes;
+    }
+    return found;
+}
+
+// ----------------------------------------------------------------------------
+// Looks up a key in a snapshot of the given length that starts at the given
+// address, starting from the root node at the given offset. Returns a pointer
+// to the value inside the snapshot, or 0 if the key is not there. Each node
+// is checked to lie within the snapshot before it is read, and a lookup that
+// runs into a node that does not is treated as failed, so that a damaged
+// file cannot lead to reads outside of it.
+// ----------------------------------------------------------------------------
+
+template<typename Key, typename Val>
+Val const* findInSnapshot(char const* const  base,
+                          uint64_t    const  length,
+                          uint64_t    const  root,
+                          hashType    const  hash,
+                          Key         const& key)
+{
+    typedef SnapshotEntry<Key, Val> Entry;
+
+    if (root == 0)
+        return 0;
+
+    uint64_t offset = root;
+    for (indexType shift = 0; ; shift += chunkBits)
+    {
+        if (snapshotNodeSize<Key, Val>(base, length, offset) == 0)
+            return 0;
+
+        char const* node = base + offset;
+        SnapshotNode const* head = reinterpret_cast<SnapshotNode const*>(node);
+        uint64_t const* offsets =
+            reinterpret_cast<uint64_t const*>(node + sizeof(SnapshotNode));
+
+        if (head->kind == SnapshotNode::bucket)
+        {
+            Entry const* entries = reinterpret_cast<Entry const*>(offsets);
+            for (uint32_t i = 0; i < head->count; ++i)
+                if (entries[i].key == key)
+                    return &entries[i].val;
+            return 0;
+        }
+
+        // Only buckets are found below the last level.
+        if (shift >= hashBits)
+            return 0;
+
+        bitmapType const dataMap = head->dataMap;
+        bitmapType const nodeMap = head->nodeMap;
+        bitmapType const bit = maskBit(hash, shift);
+
+        if (dataMap & bit)
+        {
+            Entry const* entries = reinterpret_cast<Entry const*>(
+                offsets + bitCount(nodeMap));
+            Entry const& entry = entries[indexForBit(dataMap, bit)];
+            return entry.key == key ? &entry.val : 0;
+        }
+        else if (nodeMap & bit)
+        {
+            offset = offsets[indexForBit(nodeMap, bit)];
+        }
+        else
+        {
+            return 0;
+        }
+    }
+}
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_TRIE_SNAPSHOT_HPP
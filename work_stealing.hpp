@@ -0,0 +1,150 @@
+/** -*-c++-*-
+ *
+ *  A simple work-stealing scheduler for a fixed set of independent tasks.
+ *
+ *  The tasks are dealt out round-robin to one queue per worker. Each worker
+ *  runs tasks from the back of its own queue, and once that is empty, steals
+ *  from the fronts of the others. Since tasks do not spawn new ones, a worker
+ *  that finds all queues empty is done. The calling thread serves as the
+ *  first worker.
+ *
+ *  Copyright 2012  Olaf Delgado-Friedrichs
+ *
+ */
+
+
+#ifndef ODF_WORK_STEALING_HPP
+#define ODF_WORK_STEALING_HPP 1
+
+#include <stddef.h>
+#include <algorithm>
+#include <deque>
+#include <vector>
+
+#include <boost/scoped_array.hpp>
+#include <boost/thread.hpp>
+
+
+namespace odf
+{
+namespace hash_trie
+{
+
+// Below this many entries, splitting work on a trie between threads costs
+// more than it saves.
+size_t const parallelThreshold = 4096;
+
+// The number of threads to use when asked for 0.
+inline size_t defaultNrThreads()
+{
+    size_t const n = boost::thread::hardware_concurrency();
+    return n > 0 ? n : 1;
+}
+
+template<typename Task>
+class WorkStealingPool
+{
+public:
+    // The tasks must stay in place until run() returns.
+    WorkStealingPool(std::vector<Task>& tasks, size_t const nrWorkers)
+        : nrWorkers_(nrWorkers > 0 ? nrWorkers : 1),
+          queues_(new Queue[nrWorkers_])
+    {
+        for (size_t i = 0; i < tasks.size(); ++i)
+            queues_[i % nrWorkers_].tasks.push_back(&tasks[i]);
+    }
+
+    void run()
+    {
+        boost::thread_group threads;
+        for (size_t i = 1; i < nrWorkers_; ++i)
+            threads.create_thread(Worker(this, i));
+        work(0);
+        threads.join_all();
+    }
+
+private:
+    struct Queue
+    {
+        boost::mutex mutex;
+        std::deque<Task*> tasks;
+    };
+
+    struct Worker
+    {
+        Worker(WorkStealingPool* const pool, size_t const index)
+            : pool_(pool),
+              index_(index)
+        {
+        }
+
+        void operator()() const
+        {
+            pool_->work(index_);
+        }
+
+    private:
+        WorkStealingPool* pool_;
+        size_t index_;
+    };
+
+    size_t const nrWorkers_;
+    boost::scoped_array<Queue> queues_;
+
+    void work(size_t const self)
+    {
+        Task* task;
+        while ((task = next(self)) != 0)
+            (*task)();
+    }
+
+    Task* next(size_t const self)
+    {
+        {
+            Queue& own = queues_[self];
+            boost::mutex::scoped_lock lock(own.mutex);
+            if (not own.tasks.empty())
+            {
+                Task* task = own.tasks.back();
+                own.tasks.pop_back();
+                return task;
+            }
+        }
+
+        for (size_t k = 1; k < nrWorkers_; ++k)
+        {
+            Queue& victim = queues_[(self + k) % nrWorkers_];
+            boost::mutex::scoped_lock lock(victim.mutex);
+            if (not victim.tasks.empty())
+            {
+                Task* task = victim.tasks.front();
+                victim.tasks.pop_front();
+                return task;
+            }
+        }
+
+        return 0;
+    }
+};
+
+// Runs all the given tasks on the given number of threads and waits for them
+// to finish.
+template<typename Task>
+void runWorkStealing(std::vector<Task>& tasks, size_t const nrThreads)
+{
+    if (nrThreads <= 1 or tasks.size() <= 1)
+    {
+        for (size_t i = 0; i < tasks.size(); ++i)
+            tasks[i]();
+    }
+    else
+    {
+        WorkStealingPool<Task> pool(tasks, std::min(nrThreads, tasks.size()));
+        pool.run();
+    }
+}
+
+} // namespace hash_trie
+} // namespace odf
+
+#endif // !ODF_WORK_STEALING_HPP